@@ -0,0 +1,47 @@
+/* Bench.cc
+   Main fxn for running the benchmarks.
+
+   Usage: BenchMongoXX [--min-ms N] [--repetitions N] [name-substring ...]
+   Results are written to stdout as JSON.
+*/
+
+#include "Benchmark.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+int main(int argc, char **argv) {
+  unsigned long long min_nanos = 200ULL * 1000 * 1000;
+  unsigned int repetitions = 5;
+  std::vector<std::string> filters;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--min-ms") == 0 and i + 1 < argc) {
+      min_nanos = std::strtoull(argv[++i], 0, 10) * 1000 * 1000;
+    } else if (std::strcmp(argv[i], "--repetitions") == 0 and i + 1 < argc) {
+      repetitions = std::strtoul(argv[++i], 0, 10);
+    } else {
+      filters.push_back(argv[i]);
+    }
+  }
+  if (repetitions == 0) repetitions = 1;
+
+  std::vector<bench::Result> results;
+  std::vector<bench::Benchmark*> const& benchmarks = bench::Benchmark::registry();
+  for (std::vector<bench::Benchmark*>::const_iterator i = benchmarks.begin(); i != benchmarks.end(); ++i) {
+    bool wanted = filters.empty();
+    for (std::vector<std::string>::const_iterator f = filters.begin(); f != filters.end(); ++f) {
+      if (std::string((*i)->name()).find(*f) != std::string::npos) wanted = true;
+    }
+    if (not wanted) continue;
+    std::cerr << (*i)->name() << std::endl;
+    results.push_back(bench::measure(**i, min_nanos, repetitions));
+  }
+
+  bench::write_json(std::cout, results);
+  return 0;
+}
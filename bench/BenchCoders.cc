@@ -0,0 +1,82 @@
+/* BenchCoders.cc
+   Benchmarks for the element coders: arrays and maps.
+
+*/
+
+#include "Benchmark.hh"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+static std::vector<int> ints(int n) {
+  std::vector<int> v;
+  for (int i = 0; i < n; ++i) v.push_back(i);
+  return v;
+}
+
+static mongo::BSONObj wrap_array(std::vector<int> const& v) {
+  mongo::BSONObjBuilder builder;
+  builder.append("v", v);
+  return builder.obj();
+}
+
+static mongo::BSONObj wrap_map(int n) {
+  mongo::BSONObjBuilder inner;
+  for (int i = 0; i < n; ++i) {
+    std::ostringstream key;
+    key << "key" << i;
+    inner.append(key.str(), i);
+  }
+  mongo::BSONObjBuilder builder;
+  builder.append("m", inner.obj());
+  return builder.obj();
+}
+
+
+BENCHMARK(ArrayCoder_encode_1000) {
+  ArrayCoder<int, std::allocator<int>, BasicCoder<int> > coder =
+    array_coder<int, std::allocator<int> >(BasicCoder<int>());
+  std::vector<int> v = ints(1000);
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume(coder.encode(v));
+  }
+}
+
+BENCHMARK(ArrayCoder_decode_1000) {
+  ArrayCoder<int, std::allocator<int>, BasicCoder<int> > coder =
+    array_coder<int, std::allocator<int> >(BasicCoder<int>());
+  mongo::BSONObj bson = wrap_array(ints(1000));
+  mongo::BSONElement element = bson.firstElement();
+  std::vector<int> v;
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    coder.decode(v, element);
+    bench::consume(v);
+  }
+}
+
+BENCHMARK(Decoder_vector_1000) {
+  mongo::BSONObj bson = wrap_array(ints(1000));
+  mongo::BSONElement element = bson.firstElement();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    std::vector<int> v;
+    decode_element(v, element);
+    bench::consume(v);
+  }
+}
+
+BENCHMARK(Decoder_map_100) {
+  mongo::BSONObj bson = wrap_map(100);
+  mongo::BSONElement element = bson.firstElement();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    std::map<std::string, int> m;
+    decode_element(m, element);
+    bench::consume(m);
+  }
+}
@@ -0,0 +1,77 @@
+/* BenchFilters.cc
+   Benchmarks for building Filters and Updates.
+
+*/
+
+#include "Benchmark.hh"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+
+using namespace mongoxx;
+
+
+struct Person {
+  std::string first_name;
+  std::string last_name;
+  int age;
+  double weight;
+  bool alive;
+};
+
+static Mapper<Person> person_mapper() {
+  Mapper<Person> mapper;
+  mapper.add_field("first_name", &Person::first_name);
+  mapper.add_field("last_name", &Person::last_name);
+  mapper.add_field("age", &Person::age);
+  mapper.add_field("weight", &Person::weight);
+  mapper.add_field("alive", &Person::alive);
+  return mapper;
+}
+
+
+BENCHMARK(Filter_single) {
+  Mapper<Person> mapper = person_mapper();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume((mapper[&Person::age] > 25).to_bson());
+  }
+}
+
+BENCHMARK(Filter_compose_2) {
+  Mapper<Person> mapper = person_mapper();
+  Filter a = mapper[&Person::first_name] == "Jack";
+  Filter b = mapper[&Person::age] > 25;
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume((a, b).to_bson());
+  }
+}
+
+BENCHMARK(Filter_compose_5) {
+  Mapper<Person> mapper = person_mapper();
+  Filter a = mapper[&Person::first_name] == "Jack";
+  Filter b = mapper[&Person::last_name] == "Saalweachter";
+  Filter c = mapper[&Person::age] > 25;
+  Filter d = mapper[&Person::age] < 35;
+  Filter e = mapper[&Person::weight] >= 150.0;
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume((a, b, c, d, e).to_bson());
+  }
+}
+
+BENCHMARK(Update_single) {
+  Mapper<Person> mapper = person_mapper();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume((mapper[&Person::age] += 1).to_bson());
+  }
+}
+
+BENCHMARK(Update_merge_3) {
+  Mapper<Person> mapper = person_mapper();
+  Update a = mapper[&Person::age] += 1;
+  Update b = mapper[&Person::weight] += 0.5;
+  Update c = mapper[&Person::first_name] = "Sal";
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume((a, b, c).to_bson());
+  }
+}
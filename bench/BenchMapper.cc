@@ -0,0 +1,151 @@
+/* BenchMapper.cc
+   Benchmarks for encoding and decoding objects through a Mapper.
+
+*/
+
+#include "Benchmark.hh"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct Small {
+  std::string first_name;
+  std::string last_name;
+  int age;
+};
+
+struct Wide {
+  int f0, f1, f2, f3, f4, f5, f6, f7, f8, f9;
+  int f10, f11, f12, f13, f14, f15, f16, f17, f18, f19;
+};
+
+struct Nested {
+  std::string name;
+  std::vector<int> scores;
+  std::vector<Small> people;
+};
+
+
+static Mapper<Small> small_mapper() {
+  Mapper<Small> mapper;
+  mapper.add_field("first_name", &Small::first_name);
+  mapper.add_field("last_name", &Small::last_name);
+  mapper.add_field("age", &Small::age);
+  return mapper;
+}
+
+static Mapper<Wide> wide_mapper() {
+  Mapper<Wide> mapper;
+  mapper.add_field("f0", &Wide::f0).add_field("f1", &Wide::f1)
+    .add_field("f2", &Wide::f2).add_field("f3", &Wide::f3)
+    .add_field("f4", &Wide::f4).add_field("f5", &Wide::f5)
+    .add_field("f6", &Wide::f6).add_field("f7", &Wide::f7)
+    .add_field("f8", &Wide::f8).add_field("f9", &Wide::f9)
+    .add_field("f10", &Wide::f10).add_field("f11", &Wide::f11)
+    .add_field("f12", &Wide::f12).add_field("f13", &Wide::f13)
+    .add_field("f14", &Wide::f14).add_field("f15", &Wide::f15)
+    .add_field("f16", &Wide::f16).add_field("f17", &Wide::f17)
+    .add_field("f18", &Wide::f18).add_field("f19", &Wide::f19);
+  return mapper;
+}
+
+static Mapper<Nested> nested_mapper() {
+  Mapper<Nested> mapper;
+  mapper.add_field("name", &Nested::name);
+  mapper.add_field("scores", &Nested::scores);
+  mapper.add_field("people", &Nested::people, small_mapper());
+  return mapper;
+}
+
+static Small small_object() {
+  Small small = { "Jack", "Saalweachter", 28 };
+  return small;
+}
+
+static Wide wide_object() {
+  Wide wide = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+		10, 11, 12, 13, 14, 15, 16, 17, 18, 19 };
+  return wide;
+}
+
+static Nested nested_object() {
+  Nested nested;
+  nested.name = "nested";
+  for (int i = 0; i < 100; ++i) nested.scores.push_back(i);
+  for (int i = 0; i < 10; ++i) nested.people.push_back(small_object());
+  return nested;
+}
+
+
+BENCHMARK(Mapper_to_bson_small) {
+  Mapper<Small> mapper = small_mapper();
+  Small small = small_object();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume(mapper.to_bson(small));
+  }
+}
+
+BENCHMARK(Mapper_from_bson_small) {
+  Mapper<Small> mapper = small_mapper();
+  mongo::BSONObj bson = mapper.to_bson(small_object());
+  Small small;
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    mapper.from_bson(bson, small);
+    bench::consume(small);
+  }
+}
+
+BENCHMARK(Mapper_to_bson_wide) {
+  Mapper<Wide> mapper = wide_mapper();
+  Wide wide = wide_object();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume(mapper.to_bson(wide));
+  }
+}
+
+BENCHMARK(Mapper_from_bson_wide) {
+  Mapper<Wide> mapper = wide_mapper();
+  mongo::BSONObj bson = mapper.to_bson(wide_object());
+  Wide wide;
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    mapper.from_bson(bson, wide);
+    bench::consume(wide);
+  }
+}
+
+BENCHMARK(Mapper_to_bson_nested) {
+  Mapper<Nested> mapper = nested_mapper();
+  Nested nested = nested_object();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume(mapper.to_bson(nested));
+  }
+}
+
+BENCHMARK(Mapper_from_bson_nested) {
+  Mapper<Nested> mapper = nested_mapper();
+  mongo::BSONObj bson = mapper.to_bson(nested_object());
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    Nested nested;
+    mapper.from_bson(bson, nested);
+    bench::consume(nested);
+  }
+}
+
+BENCHMARK(Mapper_lookup_field_first) {
+  Mapper<Wide> mapper = wide_mapper();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume(mapper.lookup_field(&Wide::f0));
+  }
+}
+
+BENCHMARK(Mapper_lookup_field_last) {
+  Mapper<Wide> mapper = wide_mapper();
+  for (unsigned long long i = 0; i < iterations; ++i) {
+    bench::consume(mapper.lookup_field(&Wide::f19));
+  }
+}
@@ -0,0 +1,117 @@
+/* Benchmark.hh
+   A tiny benchmark harness.  Benchmarks register themselves with the
+   BENCHMARK macro, the same way UnitTest++ tests do with TEST, and the
+   runner times each one and prints the results as JSON.
+
+*/
+
+#ifndef MONGOXX_BENCHMARK_HH
+#define MONGOXX_BENCHMARK_HH
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+  class Benchmark {
+  public:
+    Benchmark(char const* name) : m_name(name) {
+      registry().push_back(this);
+    }
+    virtual ~Benchmark() { }
+
+    /**
+     * Runs the body of the benchmark.
+     * @param iterations how many times to repeat the operation
+     */
+    virtual void run(unsigned long long iterations) = 0;
+
+    char const* name() const { return m_name; }
+
+    static std::vector<Benchmark*>& registry() {
+      static std::vector<Benchmark*> benchmarks;
+      return benchmarks;
+    }
+
+  private:
+    char const* m_name;
+  };
+
+  /**
+   * Keeps the compiler from optimizing away a value.
+   */
+  template <typename T>
+  inline void consume(T const& t) {
+    asm volatile("" : : "g"(&t) : "memory");
+  }
+
+  inline unsigned long long now_nanos() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+  }
+
+  struct Result {
+    std::string name;
+    unsigned long long iterations;
+    std::vector<double> ns_per_op;
+  };
+
+  /**
+   * Times one benchmark: grows the iteration count until a run takes at
+   * least min_nanos, then repeats that run several times.
+   */
+  inline Result measure(Benchmark &benchmark, unsigned long long min_nanos,
+			unsigned int repetitions) {
+    Result result;
+    result.name = benchmark.name();
+
+    unsigned long long iterations = 1;
+    while (true) {
+      unsigned long long start = now_nanos();
+      benchmark.run(iterations);
+      unsigned long long elapsed = now_nanos() - start;
+      if (elapsed >= min_nanos or iterations >= (1ULL << 40)) break;
+      iterations *= elapsed < min_nanos / 16 ? 10 : 2;
+    }
+    result.iterations = iterations;
+
+    for (unsigned int i = 0; i < repetitions; ++i) {
+      unsigned long long start = now_nanos();
+      benchmark.run(iterations);
+      result.ns_per_op.push_back(double(now_nanos() - start) / iterations);
+    }
+    std::sort(result.ns_per_op.begin(), result.ns_per_op.end());
+    return result;
+  }
+
+  inline void write_json(std::ostream &out, std::vector<Result> const& results) {
+    out << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+      Result const& r = results[i];
+      out << (i ? ",\n" : "\n") << "    { \"name\": \"" << r.name << "\""
+	  << ", \"iterations\": " << r.iterations
+	  << ", \"repetitions\": " << r.ns_per_op.size()
+	  << ", \"ns_per_op_min\": " << r.ns_per_op.front()
+	  << ", \"ns_per_op_median\": " << r.ns_per_op[r.ns_per_op.size() / 2]
+	  << ", \"ns_per_op_max\": " << r.ns_per_op.back() << " }";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+};
+
+#define BENCHMARK(Name)							\
+  class Benchmark##Name : public bench::Benchmark {			\
+  public:								\
+    Benchmark##Name() : bench::Benchmark(#Name) { }			\
+    void run(unsigned long long iterations);				\
+  } benchmark##Name##Instance;						\
+  void Benchmark##Name::run(unsigned long long iterations)
+
+#endif
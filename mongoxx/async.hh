@@ -0,0 +1,417 @@
+/* async.hh
+   Futures, and a pool of Sessions to run queries and writes on without
+   blocking the caller.
+
+*/
+
+#ifndef MONGOXX_ASYNC_HH
+#define MONGOXX_ASYNC_HH
+
+#include "mapper.hh"
+#include "query.hh"
+#include "queue.hh"
+#include "session.hh"
+#include "table.hh"
+#include "update.hh"
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * Thrown by Future::get() when the operation failed.  The message is the
+   * original exception's.
+   */
+  class async_error : public std::runtime_error {
+  public:
+    explicit async_error(std::string const &message) : runtime_error(message) { }
+  };
+
+  /**
+   * A Future is the eventual result of an operation running elsewhere.
+   * Copies share the result.  Callbacks added with on_complete() run on the
+   * thread that finishes the operation, or at once if it already has;
+   * other threads don't see the future ready until they have all run.
+   *
+   *   Future<std::vector<Person> > adults = async.all(query);
+   *   ...
+   *   std::vector<Person> people = adults.get();
+   */
+  template <typename T>
+  class Future {
+  public:
+    typedef boost::function<void (Future const&)> Callback;
+
+    Future() : m_state(new State()) { }
+
+    /**
+     * Tests whether the operation has finished, one way or the other.
+     */
+    bool ready() const {
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      return done();
+    }
+
+    /**
+     * Waits for the operation to finish.
+     */
+    void wait() const {
+      boost::unique_lock<boost::mutex> lock(m_state->mutex);
+      while (not done()) m_state->finished.wait(lock);
+    }
+
+    /**
+     * Waits a while for the operation to finish.
+     * @param timeout_ms how long to wait, in milliseconds
+     * @return true if it finished
+     */
+    bool wait(unsigned int timeout_ms) const {
+      boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+      boost::unique_lock<boost::mutex> lock(m_state->mutex);
+      while (not done()) {
+	if (not m_state->finished.timed_wait(lock, deadline)) return done();
+      }
+      return true;
+    }
+
+    /**
+     * Waits for the result.
+     * @return the result
+     * @throws async_error if the operation failed
+     */
+    T get() const {
+      wait();
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      if (m_state->failed) throw async_error(m_state->error);
+      return m_state->value;
+    }
+
+    /**
+     * Tests whether the operation failed.  Only meaningful once ready.
+     */
+    bool failed() const {
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      return m_state->failed;
+    }
+
+    /**
+     * Gets why the operation failed.
+     * @return the error message, or empty if it hasn't failed
+     */
+    std::string error() const {
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      return m_state->error;
+    }
+
+    /**
+     * Arranges for a function to be called when the operation finishes.
+     * @param callback called with this future; should not throw
+     */
+    void on_complete(Callback const& callback) const {
+      {
+	boost::lock_guard<boost::mutex> lock(m_state->mutex);
+	if (not m_state->ready) {
+	  m_state->callbacks.push_back(callback);
+	  return;
+	}
+      }
+      callback(*this);
+    }
+
+    /**
+     * Finishes the operation successfully.  For whoever runs it.
+     * @param value the result
+     */
+    void set_value(T const& value) const {
+      finish(&value, std::string());
+    }
+
+    /**
+     * Finishes the operation with an error.  For whoever runs it.
+     * @param error what went wrong
+     */
+    void set_error(std::string const& error) const {
+      finish(0, error);
+    }
+
+  private:
+    struct State {
+      State() : ready(false), calling(false), failed(false), value() { }
+      boost::mutex mutex;
+      boost::condition_variable finished;
+      bool ready;
+      bool calling;                // the callbacks are still running
+      boost::thread::id finisher;  // on this thread
+      bool failed;
+      T value;
+      std::string error;
+      std::vector<Callback> callbacks;
+    };
+
+    // Whether this thread may see the result.  Called with the mutex held.
+    bool done() const {
+      return m_state->ready and (not m_state->calling or m_state->finisher == boost::this_thread::get_id());
+    }
+
+    void finish(T const* value, std::string const& error) const {
+      std::vector<Callback> callbacks;
+      {
+	boost::lock_guard<boost::mutex> lock(m_state->mutex);
+	if (m_state->ready) return;
+	m_state->ready = true;
+	if (value) {
+	  m_state->value = *value;
+	} else {
+	  m_state->failed = true;
+	  m_state->error = error;
+	}
+	callbacks.swap(m_state->callbacks);
+	if (callbacks.empty()) {
+	  m_state->finished.notify_all();
+	  return;
+	}
+	m_state->calling = true;
+	m_state->finisher = boost::this_thread::get_id();
+      }
+      for (typename std::vector<Callback>::const_iterator i = callbacks.begin(); i != callbacks.end(); ++i) {
+	try {
+	  (*i)(*this);
+	} catch (...) {
+	  // Nobody to tell.
+	}
+      }
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      m_state->calling = false;
+      m_state->finished.notify_all();
+    }
+
+    std::tr1::shared_ptr<State> m_state;
+  };
+
+  /**
+   * An AsyncSession runs queries and writes on a few worker threads, each
+   * with a Session of its own, and hands back Futures.  The caller never
+   * waits on the server, so a handful of threads can keep hundreds of
+   * operations outstanding.  Operations start in the order they were
+   * submitted, but with more than one worker they may finish in any order;
+   * use one worker where writes must land in order.
+   *
+   *   AsyncSession async("localhost", 4);
+   *   Future<std::vector<Person> > adults =
+   *     async.all(session.query(table).filter(table[&Person::age] >= 18));
+   *   Future<bool> done = async.insert(table, person);
+   *
+   * Queries may be built on any Session; they run on the workers'.  The
+   * synchronous Session API is unaffected.
+   */
+  class AsyncSession {
+  public:
+
+    /**
+     * Starts the workers.  Each connects on its first operation.
+     * @param host the server to talk to
+     * @param threads how many workers, and so connections
+     * @param backlog how many operations may wait before calls block
+     */
+    AsyncSession(std::string const& host, unsigned int threads = 4, size_t backlog = 10000)
+      : m_host(host), m_operations(backlog) {
+      if (threads == 0) threads = 1;
+      for (unsigned int k = 0; k < threads; ++k) {
+	m_threads.add_thread(new boost::thread(&AsyncSession::work, this));
+      }
+    }
+
+    /**
+     * Finishes every operation already submitted, then stops the workers.
+     */
+    ~AsyncSession() {
+      m_operations.close();
+      m_threads.join_all();
+    }
+
+    /**
+     * Runs Query::all().
+     * @param query the query; its own Session isn't used
+     * @return the matching objects, eventually
+     */
+    template <typename T>
+    Future<std::vector<T> > all(Query<T> const& query) {
+      Future<std::vector<T> > future;
+      submit(new AllOperation<T>(query, future));
+      return future;
+    }
+
+    /**
+     * Runs Query::first().
+     * @param query the query; its own Session isn't used
+     * @return the first matching object, eventually; fails if there is none
+     */
+    template <typename T>
+    Future<T> first(Query<T> const& query) {
+      Future<T> future;
+      submit(new FirstOperation<T>(query, future));
+      return future;
+    }
+
+    /**
+     * Runs Query::result(), streaming each object to a function on the
+     * worker as it is decoded, rather than collecting them.
+     * @param query the query; its own Session isn't used
+     * @param f called as f(t) for each object; copied
+     * @return how many objects were delivered, eventually
+     */
+    template <typename T, typename F>
+    Future<size_t> each(Query<T> const& query, F const& f) {
+      Future<size_t> future;
+      submit(new EachOperation<T, F>(query, f, future));
+      return future;
+    }
+
+    /**
+     * Runs Query::update().
+     * @param query the query selecting what to update
+     * @param update the update
+     * @return true once the update has been sent
+     */
+    template <typename T>
+    Future<bool> update(Query<T> const& query, Update const& update) {
+      Future<bool> future;
+      submit(new UpdateOperation<T>(query, update, future));
+      return future;
+    }
+
+    /**
+     * Runs Inserter::insert().
+     * @param collection the full name of the collection
+     * @param mapper the mapper to encode with
+     * @param t the object; copied
+     * @return true once the insert has been sent
+     */
+    template <typename T>
+    Future<bool> insert(std::string const& collection, Mapper<T> const* mapper, T const& t) {
+      Future<bool> future;
+      submit(new InsertOperation<T>(collection, mapper, t, future));
+      return future;
+    }
+
+    template <typename T>
+    Future<bool> insert(Table<T> const& table, T const& t) {
+      return insert(table.collection(), table.mapper(), t);
+    }
+
+    /**
+     * Gets how many operations are waiting for a worker.
+     */
+    size_t backlog() const { return m_operations.size(); }
+
+  private:
+    struct Operation {
+      virtual ~Operation() { }
+      virtual void run(Session &session) = 0;
+      virtual void fail(std::string const& error) = 0;
+    };
+
+    template <typename T, typename R>
+    struct QueryOperation : public Operation {
+      QueryOperation(Query<T> const& query, Future<R> const& future)
+	: query(query), future(future) { }
+      void fail(std::string const& error) { future.set_error(error); }
+      Query<T> query;
+      Future<R> future;
+    };
+
+    template <typename T>
+    struct AllOperation : public QueryOperation<T, std::vector<T> > {
+      AllOperation(Query<T> const& query, Future<std::vector<T> > const& future)
+	: QueryOperation<T, std::vector<T> >(query, future) { }
+      void run(Session &session) { this->future.set_value(this->query.bind(&session).all()); }
+    };
+
+    template <typename T>
+    struct FirstOperation : public QueryOperation<T, T> {
+      FirstOperation(Query<T> const& query, Future<T> const& future)
+	: QueryOperation<T, T>(query, future) { }
+      void run(Session &session) { this->future.set_value(this->query.bind(&session).first()); }
+    };
+
+    template <typename T, typename F>
+    struct EachOperation : public QueryOperation<T, size_t> {
+      EachOperation(Query<T> const& query, F const& f, Future<size_t> const& future)
+	: QueryOperation<T, size_t>(query, future), f(f) { }
+      void run(Session &session) {
+	QueryResult<T> result = this->query.bind(&session).result();
+	size_t n = 0;
+	for (T t; result.next(t); ++n) f(t);
+	this->future.set_value(n);
+      }
+      F f;
+    };
+
+    template <typename T>
+    struct UpdateOperation : public QueryOperation<T, bool> {
+      UpdateOperation(Query<T> const& query, Update const& update, Future<bool> const& future)
+	: QueryOperation<T, bool>(query, future), update(update) { }
+      void run(Session &session) {
+	this->query.bind(&session).update(update);
+	this->future.set_value(true);
+      }
+      Update update;
+    };
+
+    template <typename T>
+    struct InsertOperation : public Operation {
+      InsertOperation(std::string const& collection, Mapper<T> const* mapper, T const& t,
+		      Future<bool> const& future)
+	: collection(collection), mapper(mapper), t(t), future(future) { }
+      void run(Session &session) {
+	session.inserter(collection, mapper).insert(t);
+	future.set_value(true);
+      }
+      void fail(std::string const& error) { future.set_error(error); }
+      std::string collection;
+      Mapper<T> const* mapper;
+      T t;
+      Future<bool> future;
+    };
+
+    void submit(Operation *operation) {
+      std::tr1::shared_ptr<Operation> owned(operation);
+      if (not m_operations.push(owned)) owned->fail("AsyncSession is shutting down.");
+    }
+
+    void work() {
+      std::auto_ptr<Session> session;
+      for (std::tr1::shared_ptr<Operation> operation; m_operations.pop(operation); operation.reset()) {
+	try {
+	  if (not session.get()) session.reset(new Session(m_host));
+	  operation->run(*session);
+	} catch (std::exception const& e) {
+	  operation->fail(e.what());
+	} catch (...) {
+	  operation->fail("Unknown error.");
+	}
+      }
+    }
+
+    AsyncSession(AsyncSession const&);
+    AsyncSession& operator=(AsyncSession const&);
+
+    std::string m_host;
+    BoundedQueue<std::tr1::shared_ptr<Operation> > m_operations;
+    boost::thread_group m_threads;
+  };
+
+};
+
+#endif
@@ -0,0 +1,127 @@
+/* batch_sizer.hh
+   Picks batch sizes from how long recent batches took.
+
+*/
+
+#ifndef MONGOXX_BATCH_SIZER_HH
+#define MONGOXX_BATCH_SIZER_HH
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <cstddef>
+
+namespace mongoxx {
+
+  /**
+   * A BatchSizer is a feedback controller for batch sizes.  Each batch
+   * sent is recorded with how many documents it held and how long its
+   * round trip took; from that it estimates how many documents fit in the
+   * target latency, and moves the size toward it.  Small batches grow
+   * while the server keeps up, and shrink again when it slows, so neither
+   * round trips nor latency spikes pile up.
+   *
+   *   std::tr1::shared_ptr<BatchSizer> writes(new BatchSizer(50, 10, 1000));
+   *   session.size_writes("test.event", writes);
+   *
+   * The estimate is smoothed over several batches, and the size moves by
+   * at most a factor of two per batch.  A sizer is thread-safe, and may be
+   * shared by everything writing to (or reading from) a collection; reads
+   * and writes usually want sizers of their own.
+   */
+  class BatchSizer {
+  public:
+
+    /**
+     * What the sizer has seen.
+     */
+    struct Stats {
+      Stats() : size(0), batches(0), documents(0), micros(0), latency_ms(0) { }
+      size_t size;                 ///< the batch size it would pick now
+      unsigned long long batches;  ///< batches recorded
+      unsigned long long documents;
+      unsigned long long micros;   ///< total round trip time
+      double latency_ms;           ///< smoothed latency per batch
+
+      double documents_per_second() const {
+	return micros ? documents * 1e6 / micros : 0.0;
+      }
+    };
+
+    /**
+     * @param target_ms the round trip time to aim each batch at
+     * @param min_size the smallest batch to pick
+     * @param max_size the largest batch to pick
+     * @param initial_size where to start; 0 for min_size
+     */
+    BatchSizer(unsigned int target_ms = 100, size_t min_size = 10, size_t max_size = 1000,
+	       size_t initial_size = 0)
+      : m_target_micros(target_ms ? target_ms * 1000.0 : 1000.0),
+	m_min(min_size ? min_size : 1), m_max(std::max(max_size, m_min)) {
+      m_size = clamp(initial_size ? initial_size : m_min);
+      m_estimate = m_size;
+    }
+
+    /**
+     * Gets the size for the next batch.
+     */
+    size_t size() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return static_cast<size_t>(m_size);
+    }
+
+    /**
+     * Records a finished batch, and adjusts the size.
+     * @param documents how many documents it held; empty batches are ignored
+     * @param micros how long its round trip took, in microseconds
+     */
+    void record(size_t documents, unsigned long long micros) {
+      if (documents == 0) return;
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      ++m_stats.batches;
+      m_stats.documents += documents;
+      m_stats.micros += micros;
+      double latency = std::max(micros, 1ULL);
+      m_stats.latency_ms = m_stats.batches == 1 ? latency / 1000.0
+	: (1 - smoothing()) * m_stats.latency_ms + smoothing() * latency / 1000.0;
+
+      // How many documents would have taken the target time, at this
+      // batch's rate.
+      double fits = documents * m_target_micros / latency;
+      // The estimate is held to the bounds too, so a long run of fast
+      // batches doesn't leave it slow to come down.
+      m_estimate = clamp((1 - smoothing()) * m_estimate + smoothing() * fits);
+      m_size = clamp(std::min(std::max(m_estimate, m_size / 2), m_size * 2));
+    }
+
+    Stats stats() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      Stats stats = m_stats;
+      stats.size = static_cast<size_t>(m_size);
+      return stats;
+    }
+
+  private:
+    // How much each batch moves the smoothed figures.
+    static double smoothing() { return 0.25; }
+
+    double clamp(double size) const {
+      return std::min(std::max(size, double(m_min)), double(m_max));
+    }
+
+    BatchSizer(BatchSizer const&);
+    BatchSizer& operator=(BatchSizer const&);
+
+    double m_target_micros;
+    size_t m_min;
+    size_t m_max;
+    double m_size;
+    double m_estimate;
+    Stats m_stats;
+    mutable boost::mutex m_mutex;
+  };
+
+};
+
+#endif
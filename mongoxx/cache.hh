@@ -0,0 +1,223 @@
+/* cache.hh
+   A client-side read-through cache for decoded query results.
+
+*/
+
+#ifndef MONGOXX_CACHE_HH
+#define MONGOXX_CACHE_HH
+
+#include "mongo/client/dbclient.h"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A QueryCache holds the decoded results of recent queries, keyed by the
+   * collection and the serialized query.  Entries are evicted least recently
+   * used first once the cache holds more than its budget of documents, and
+   * expire after a fixed time to live.  Any write to a collection invalidates
+   * every entry for that collection.  Each entry remembers its type, so a
+   * key reused for another type (a new Mapper at a dead one's address) is
+   * a miss rather than a bad cast.
+   */
+  class QueryCache {
+  public:
+
+    /**
+     * Counters describing how well the cache is doing.
+     */
+    struct Stats {
+      Stats() : hits(0), misses(0), evictions(0), expirations(0),
+		invalidations(0), entries(0), documents(0) { }
+      unsigned long long hits;
+      unsigned long long misses;
+      unsigned long long evictions;
+      unsigned long long expirations;
+      unsigned long long invalidations;
+      size_t entries;
+      size_t documents;
+    };
+
+    /**
+     * Constructs a cache.
+     * @param max_documents the most decoded documents to hold at once
+     * @param ttl_ms how long an entry may be served, in milliseconds
+     */
+    QueryCache(size_t max_documents, unsigned int ttl_ms)
+      : m_max_documents(max_documents), m_ttl_ms(ttl_ms), m_documents(0) { }
+
+    /**
+     * Builds the key identifying a query.
+     * @param collection the name of the collection
+     * @param query the query, including any sort
+     * @param limit the query limit
+     * @param skip the query skip
+     * @param mapper the mapper decoding the results
+     * @return an opaque key
+     */
+    static std::string key(std::string const& collection,
+			   mongo::Query const& query,
+			   unsigned int limit, unsigned int skip,
+			   void const* mapper) {
+      std::ostringstream out;
+      out << collection << '\0' << limit << '\0' << skip << '\0' << mapper << '\0';
+      out.write(query.obj.objdata(), query.obj.objsize());
+      return out.str();
+    }
+
+    /**
+     * Looks up a cached result.
+     * @param key the key built by key()
+     * @param collection the name of the collection the query ran against
+     * @param results where to copy the cached result
+     * @return true on a hit
+     */
+    template <typename T>
+    bool get(std::string const& key, std::string const& collection,
+	     std::vector<T> &results) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      std::map<std::string, Entries::iterator>::iterator i = m_index.find(key);
+      if (i == m_index.end()) {
+	++m_stats.misses;
+	return false;
+      }
+      Entries::iterator entry = i->second;
+      if (*entry->type != typeid(std::vector<T>)) {
+	erase(entry);
+	++m_stats.misses;
+	return false;
+      }
+      if (entry->generation != m_generations[collection]) {
+	++m_stats.invalidations;
+	erase(entry);
+	++m_stats.misses;
+	return false;
+      }
+      if (entry->expires < boost::get_system_time()) {
+	++m_stats.expirations;
+	erase(entry);
+	++m_stats.misses;
+	return false;
+      }
+      m_entries.splice(m_entries.begin(), m_entries, entry);
+      ++m_stats.hits;
+      results = *std::tr1::static_pointer_cast<std::vector<T> const>(entry->value);
+      return true;
+    }
+
+    /**
+     * Stores a result.
+     * @param key the key built by key()
+     * @param collection the name of the collection the query ran against
+     * @param results the decoded result
+     */
+    template <typename T>
+    void put(std::string const& key, std::string const& collection,
+	     std::vector<T> const& results) {
+      size_t documents = results.empty() ? 1 : results.size();
+      if (documents > m_max_documents) return;
+
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      std::map<std::string, Entries::iterator>::iterator i = m_index.find(key);
+      if (i != m_index.end()) erase(i->second);
+
+      Entry entry;
+      entry.key = key;
+      entry.collection = collection;
+      entry.generation = m_generations[collection];
+      entry.expires = boost::get_system_time() + boost::posix_time::milliseconds(m_ttl_ms);
+      entry.documents = documents;
+      entry.value.reset(new std::vector<T>(results));
+      entry.type = &typeid(std::vector<T>);
+      m_entries.push_front(entry);
+      m_index[key] = m_entries.begin();
+      m_documents += documents;
+
+      while (m_documents > m_max_documents) {
+	++m_stats.evictions;
+	erase(--m_entries.end());
+      }
+    }
+
+    /**
+     * Drops every entry for a collection.
+     * @param collection the name of the collection that was written to
+     */
+    void invalidate(std::string const& collection) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      ++m_generations[collection];
+    }
+
+    /**
+     * Drops every entry.
+     */
+    void clear() {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_entries.clear();
+      m_index.clear();
+      m_documents = 0;
+    }
+
+    /**
+     * Gets a snapshot of the cache counters.
+     * @return the counters
+     */
+    Stats stats() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      Stats stats = m_stats;
+      stats.entries = m_entries.size();
+      stats.documents = m_documents;
+      return stats;
+    }
+
+    /**
+     * Zeroes the hit, miss, eviction, expiration and invalidation counters.
+     */
+    void reset_stats() {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_stats = Stats();
+    }
+
+  private:
+    struct Entry {
+      std::string key;
+      std::string collection;
+      unsigned long long generation;
+      boost::system_time expires;
+      size_t documents;
+      std::tr1::shared_ptr<void const> value;
+      std::type_info const* type;  // of *value
+    };
+    typedef std::list<Entry> Entries;
+
+    void erase(Entries::iterator entry) {
+      m_documents -= entry->documents;
+      m_index.erase(entry->key);
+      m_entries.erase(entry);
+    }
+
+    size_t m_max_documents;
+    unsigned int m_ttl_ms;
+
+    mutable boost::mutex m_mutex;
+    Entries m_entries;
+    std::map<std::string, Entries::iterator> m_index;
+    std::map<std::string, unsigned long long> m_generations;
+    size_t m_documents;
+    Stats m_stats;
+  };
+
+};
+
+#endif
@@ -0,0 +1,103 @@
+/* cancellation.hh
+   Lets one thread call off queries another thread is reading.
+
+*/
+
+#ifndef MONGOXX_CANCELLATION_HH
+#define MONGOXX_CANCELLATION_HH
+
+#include "mongo/client/dbclient.h"
+#include "mongo/client/connpool.h"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <string>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A CancellationToken is shared between whoever reads some queries and
+   * whoever may want them stopped.  Cancelling it kills the server cursors
+   * of every query it was given to, over a fresh connection, so a reader
+   * blocked waiting for a batch gets an answer promptly; the reader then
+   * throws cancelled_error.  Copies share one token.
+   *
+   *   CancellationToken token;
+   *   QueryResult<Person> people = session.query(table).cancel_with(token).result();
+   *   ...
+   *   token.cancel();   // from any thread
+   */
+  class CancellationToken {
+  public:
+    CancellationToken() : m_state(new State()) { }
+
+    /**
+     * Cancels every query using this token, now and in future.
+     */
+    void cancel() {
+      std::map<long long, std::string> cursors;
+      {
+	boost::lock_guard<boost::mutex> lock(m_state->mutex);
+	if (m_state->cancelled) return;
+	m_state->cancelled = true;
+	cursors.swap(m_state->cursors);
+      }
+      for (std::map<long long, std::string>::const_iterator i = cursors.begin(); i != cursors.end(); ++i) {
+	kill(i->second, i->first);
+      }
+    }
+
+    bool cancelled() const {
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      return m_state->cancelled;
+    }
+
+    /**
+     * Notes a server cursor to kill on cancel().  For QueryResult.
+     * @param host the server holding the cursor
+     * @param cursor_id the cursor
+     * @return false, and kills nothing, if the token is already cancelled
+     */
+    bool watch(std::string const& host, long long cursor_id) const {
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      if (m_state->cancelled) return false;
+      m_state->cursors[cursor_id] = host;
+      return true;
+    }
+
+    /**
+     * Forgets a server cursor, once it is finished with.
+     * @param cursor_id the cursor
+     */
+    void unwatch(long long cursor_id) const {
+      boost::lock_guard<boost::mutex> lock(m_state->mutex);
+      m_state->cursors.erase(cursor_id);
+    }
+
+  private:
+    struct State {
+      State() : cancelled(false) { }
+      boost::mutex mutex;
+      bool cancelled;
+      std::map<long long, std::string> cursors;
+    };
+
+    static void kill(std::string const& host, long long cursor_id) {
+      try {
+	mongo::ScopedDbConnection connection(host);
+	connection->killCursor(cursor_id);
+	connection.done();
+      } catch (std::exception const&) {
+	// The reader finds out soon enough on its own.
+      }
+    }
+
+    std::tr1::shared_ptr<State> m_state;
+  };
+
+};
+
+#endif
@@ -0,0 +1,302 @@
+/* counter_buffer.hh
+   Coalesces hot $inc updates in memory and writes them out in bulk.
+
+*/
+
+#ifndef MONGOXX_COUNTER_BUFFER_HH
+#define MONGOXX_COUNTER_BUFFER_HH
+
+#include "filter.hh"
+#include "query.hh"
+#include "session.hh"
+#include "update.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <climits>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+namespace mongoxx {
+
+  /**
+   * A CounterBuffer adds up $inc updates per (collection, filter, field) in
+   * memory, and sends one merged $inc per document when it flushes.  It
+   * flushes when it is holding too many distinct counters, every flush
+   * interval, on flush(), and when it is destroyed.
+   *
+   *   CounterBuffer counters(&counter_session);
+   *   counters.add(session.query(table).filter(table[&Page::url] == url),
+   *                table[&Page::hits] += 1);
+   *
+   * The buffer writes from a background thread, so the Session it is given
+   * should be dedicated to it.
+   */
+  class CounterBuffer {
+  public:
+
+    /**
+     * Counters describing how much coalescing is going on.
+     */
+    struct Stats {
+      Stats() : increments(0), updates(0), flushes(0) { }
+      unsigned long long increments;
+      unsigned long long updates;
+      unsigned long long flushes;
+    };
+
+    /**
+     * Constructs a CounterBuffer.
+     * @param session the session to write through; used only by the buffer
+     * @param max_pending flush once this many distinct counters are buffered
+     * @param flush_interval_ms flush this often in the background; 0 disables
+     */
+    CounterBuffer(Session *session, size_t max_pending = 1000,
+		  unsigned int flush_interval_ms = 1000)
+      : m_session(session), m_max_pending(max_pending),
+	m_flush_interval_ms(flush_interval_ms), m_pending_counters(0),
+	m_stopping(false) {
+      if (m_flush_interval_ms > 0) {
+	m_thread = boost::thread(&CounterBuffer::run, this);
+      }
+    }
+
+    /**
+     * Stops the background thread and flushes whatever is left.
+     */
+    ~CounterBuffer() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stopping = true;
+      }
+      m_wakeup.notify_all();
+      if (m_thread.joinable()) m_thread.join();
+      try {
+	flush();
+      } catch (std::exception const&) {
+	// Nothing sensible to do with it from a destructor.
+      }
+    }
+
+    /**
+     * Buffers an increment against the documents a query filters to.
+     * @param query the query selecting the document to increment
+     * @param update an Update made only of $inc operations
+     * @throws std::invalid_argument if the update does anything but $inc
+     */
+    template <typename T>
+    void add(Query<T> const& query, Update const& update) {
+      add(query.collection(), query.filters(), update);
+    }
+
+    /**
+     * Buffers an increment against the documents a filter selects.
+     * @param collection the name of the collection
+     * @param filter the filter selecting the document to increment
+     * @param update an Update made only of $inc operations
+     * @throws std::invalid_argument if the update does anything but $inc
+     */
+    void add(std::string const& collection, Filter const& filter,
+	     Update const& update) {
+      mongo::BSONObj bson = update.to_bson();
+      mongo::BSONObj filter_bson = filter.to_bson();
+      std::string key = collection + '\0' +
+	std::string(filter_bson.objdata(), filter_bson.objsize());
+
+      // Check the whole update before buffering any of it, so a rejected
+      // update leaves nothing behind.
+      for (mongo::BSONObjIterator i(bson); i.more(); ) {
+	mongo::BSONElement operation = i.next();
+	if (std::string(operation.fieldName()) != "$inc") {
+	  throw std::invalid_argument("CounterBuffer only buffers $inc updates.");
+	}
+	for (mongo::BSONObjIterator j(operation.Obj()); j.more(); ) {
+	  if (not j.next().isNumber()) {
+	    throw std::invalid_argument("CounterBuffer can only add numbers.");
+	  }
+	}
+      }
+
+      bool full;
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	for (mongo::BSONObjIterator i(bson); i.more(); ) {
+	  mongo::BSONElement operation = i.next();
+	  Target &target = m_pending[key];
+	  if (target.fields.empty()) {
+	    target.collection = collection;
+	    target.filter = filter_bson.getOwned();
+	  }
+	  for (mongo::BSONObjIterator j(operation.Obj()); j.more(); ) {
+	    mongo::BSONElement field = j.next();
+	    std::map<std::string, Delta>::iterator d = target.fields.find(field.fieldName());
+	    if (d == target.fields.end()) {
+	      d = target.fields.insert(std::make_pair(std::string(field.fieldName()), Delta())).first;
+	      ++m_pending_counters;
+	    }
+	    d->second.add(field);
+	    ++m_stats.increments;
+	  }
+	}
+	full = m_pending_counters >= m_max_pending;
+      }
+      if (full) flush();
+    }
+
+    /**
+     * Sends every buffered increment.  Increments that could not be sent are
+     * kept for the next flush.
+     * @throws whatever the Session throws if a write fails
+     */
+    void flush() {
+      boost::lock_guard<boost::mutex> session_lock(m_session_mutex);
+      Targets targets;
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	targets.swap(m_pending);
+	m_pending_counters = 0;
+	++m_stats.flushes;
+      }
+
+      for (Targets::iterator i = targets.begin(); i != targets.end(); ) {
+	try {
+	  mongo::BSONObjBuilder builder;
+	  for (std::map<std::string, Delta>::const_iterator d = i->second.fields.begin(); d != i->second.fields.end(); ++d) {
+	    d->second.append(builder, d->first);
+	  }
+	  m_session->execute_update(i->second.collection,
+				    mongo::Query(i->second.filter),
+				    Update("$inc", builder.obj()).to_bson());
+	} catch (...) {
+	  restore(i, targets.end());
+	  throw;
+	}
+	{
+	  boost::lock_guard<boost::mutex> lock(m_mutex);
+	  ++m_stats.updates;
+	}
+	targets.erase(i++);
+      }
+    }
+
+    /**
+     * Gets the number of distinct counters waiting to be flushed.
+     * @return the number of buffered counters
+     */
+    size_t pending() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_pending_counters;
+    }
+
+    /**
+     * Gets a snapshot of the buffer counters.
+     * @return the counters
+     */
+    Stats stats() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_stats;
+    }
+
+  private:
+    // An increment, kept in the narrowest BSON type that holds it so that
+    // an int counter stays an int.
+    struct Delta {
+      Delta() : type(mongo::NumberInt), integer(0), real(0.0) { }
+
+      // The element has been checked to be a number.
+      void add(mongo::BSONElement const& element) {
+	if (element.type() == mongo::NumberDouble) type = mongo::NumberDouble;
+	else if (element.type() == mongo::NumberLong and type == mongo::NumberInt) type = mongo::NumberLong;
+	integer += element.numberLong();
+	real += element.numberDouble();
+      }
+
+      void add(Delta const& delta) {
+	if (delta.type == mongo::NumberDouble) type = mongo::NumberDouble;
+	else if (delta.type == mongo::NumberLong and type == mongo::NumberInt) type = mongo::NumberLong;
+	integer += delta.integer;
+	real += delta.real;
+      }
+
+      void append(mongo::BSONObjBuilder &builder, std::string const& name) const {
+	if (type == mongo::NumberDouble) {
+	  builder.append(name, real);
+	} else if (type == mongo::NumberInt and integer >= INT_MIN and integer <= INT_MAX) {
+	  builder.append(name, static_cast<int>(integer));
+	} else {
+	  builder.append(name, integer);
+	}
+      }
+
+      mongo::BSONType type;
+      long long integer;
+      double real;
+    };
+
+    struct Target {
+      std::string collection;
+      mongo::BSONObj filter;
+      std::map<std::string, Delta> fields;
+    };
+    typedef std::map<std::string, Target> Targets;
+
+    // Puts unsent targets back so they go out with the next flush.
+    void restore(Targets::iterator begin, Targets::iterator end) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      for (Targets::iterator i = begin; i != end; ++i) {
+	Target &target = m_pending[i->first];
+	if (target.fields.empty()) {
+	  target.collection = i->second.collection;
+	  target.filter = i->second.filter;
+	}
+	for (std::map<std::string, Delta>::const_iterator d = i->second.fields.begin(); d != i->second.fields.end(); ++d) {
+	  std::map<std::string, Delta>::iterator mine = target.fields.find(d->first);
+	  if (mine == target.fields.end()) {
+	    target.fields[d->first] = d->second;
+	    ++m_pending_counters;
+	  } else {
+	    mine->second.add(d->second);
+	  }
+	}
+      }
+    }
+
+    void run() {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (not m_stopping) {
+	boost::system_time deadline = boost::get_system_time() +
+	  boost::posix_time::milliseconds(m_flush_interval_ms);
+	while (not m_stopping and m_wakeup.timed_wait(lock, deadline)) { }
+	if (m_stopping) break;
+	lock.unlock();
+	try {
+	  flush();
+	} catch (std::exception const&) {
+	  // The increments were kept; try again next interval.
+	}
+	lock.lock();
+      }
+    }
+
+    Session *m_session;
+    size_t m_max_pending;
+    unsigned int m_flush_interval_ms;
+
+    mutable boost::mutex m_mutex;
+    boost::mutex m_session_mutex;
+    boost::condition_variable m_wakeup;
+    Targets m_pending;
+    size_t m_pending_counters;
+    bool m_stopping;
+    Stats m_stats;
+    boost::thread m_thread;
+  };
+
+};
+
+#endif
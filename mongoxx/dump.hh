@@ -0,0 +1,447 @@
+/* dump.hh
+   Writes query results to BSON dump files, and reads them back through a
+   memory map.
+
+*/
+
+#ifndef MONGOXX_DUMP_HH
+#define MONGOXX_DUMP_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "mapper.hh"
+#include "query.hh"
+
+#include <boost/thread/thread.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mongoxx {
+
+  class dump_error : public std::runtime_error {
+  public:
+    explicit dump_error(std::string const &message) : runtime_error(message) { }
+  };
+
+  /**
+   * A DumpWriter streams documents into a dump file: plain concatenated
+   * BSON, the same format mongodump writes, so other tools can read it.
+   * Alongside it goes a small side index (the same path plus ".idx") giving
+   * the offset of every stride'th document, which lets a DumpReader split
+   * the file for parallel reading without scanning it.
+   *
+   *   DumpWriter dump("people.bson");
+   *   dump.write(session.query("test.person", &mapper).result());
+   *   dump.close();
+   */
+  class DumpWriter {
+  public:
+
+    /**
+     * Creates (or truncates) a dump file, and removes any index left by
+     * an earlier dump there.
+     * @param path where to write
+     * @param stride how many documents apart the index entries are
+     * @throws dump_error if the file can't be opened
+     */
+    DumpWriter(std::string const& path, unsigned int stride = 1024)
+      : m_path(path), m_stride(stride ? stride : 1), m_documents(0), m_offset(0),
+	m_used(0) {
+      m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (m_fd < 0) fail("open");
+      ::unlink((path + ".idx").c_str());
+      m_buffer.resize(buffer_size);
+    }
+
+    ~DumpWriter() {
+      try {
+	close();
+      } catch (std::exception const&) {
+	// Nowhere to report it; call close() yourself to find out.
+      }
+    }
+
+    /**
+     * Appends one document.
+     * @param document the document
+     */
+    void write(mongo::BSONObj const& document) {
+      if (m_fd < 0) throw dump_error("Dump '" + m_path + "' is closed.");
+      if (m_documents % m_stride == 0) m_index.push_back(m_offset);
+      append(document.objdata(), document.objsize());
+      m_offset += document.objsize();
+      ++m_documents;
+    }
+
+    /**
+     * Appends one object.
+     * @param t the object
+     * @param mapper the mapper to encode it with
+     */
+    template <typename T>
+    void write(T const& t, Mapper<T> const& mapper) {
+      write(mapper.to_bson(t));
+    }
+
+    /**
+     * Appends everything left in a query result, without decoding it.
+     * @param result the result to drain
+     * @return how many documents were written
+     */
+    template <typename T>
+    size_t write(QueryResult<T> const& result) {
+      size_t written = 0;
+      for (mongo::BSONObj obj; result.next_bson(obj); ++written) write(obj);
+      return written;
+    }
+
+    /**
+     * Flushes the dump and writes its index.  Does nothing the second time.
+     * @throws dump_error if either can't be written
+     */
+    void close() {
+      if (m_fd < 0) return;
+      flush();
+      int fd = m_fd;
+      m_fd = -1;
+      if (::close(fd) != 0) fail("close");
+      write_index();
+    }
+
+    std::string const& path() const { return m_path; }
+    unsigned long long documents() const { return m_documents; }
+    unsigned long long bytes() const { return m_offset; }
+
+  private:
+    enum { buffer_size = 1024 * 1024 };
+
+    void append(char const* data, size_t size) {
+      if (m_used + size > m_buffer.size()) {
+	flush();
+	if (size > m_buffer.size()) {
+	  write_fully(m_fd, data, size);
+	  return;
+	}
+      }
+      std::memcpy(&m_buffer[m_used], data, size);
+      m_used += size;
+    }
+
+    void flush() {
+      write_fully(m_fd, &m_buffer[0], m_used);
+      m_used = 0;
+    }
+
+    // The index is a header of three words, the stride, the document count
+    // and the dump's length, followed by one offset per stride documents;
+    // all native 64-bit.
+    void write_index() {
+      std::string path = m_path + ".idx";
+      int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) fail("open " + path);
+      std::vector<uint64_t> words;
+      words.reserve(m_index.size() + 3);
+      words.push_back(m_stride);
+      words.push_back(m_documents);
+      words.push_back(m_offset);
+      words.insert(words.end(), m_index.begin(), m_index.end());
+      try {
+	write_fully(fd, reinterpret_cast<char const*>(&words[0]), words.size() * sizeof(uint64_t));
+      } catch (...) {
+	::close(fd);
+	throw;
+      }
+      if (::close(fd) != 0) fail("close " + path);
+    }
+
+    void write_fully(int fd, char const* data, size_t size) {
+      while (size > 0) {
+	ssize_t n = ::write(fd, data, size);
+	if (n < 0) {
+	  if (errno == EINTR) continue;
+	  fail("write");
+	}
+	data += n;
+	size -= n;
+      }
+    }
+
+    void fail(std::string const& what) const {
+      throw dump_error("Dump '" + m_path + "': " + what + " failed: " + std::strerror(errno));
+    }
+
+    DumpWriter(DumpWriter const&);
+    DumpWriter& operator=(DumpWriter const&);
+
+    std::string m_path;
+    unsigned int m_stride;
+    int m_fd;
+    unsigned long long m_documents;
+    uint64_t m_offset;
+    std::vector<uint64_t> m_index;
+    std::vector<char> m_buffer;
+    size_t m_used;
+  };
+
+  /**
+   * A run of consecutive documents within a mapped dump.  Documents are
+   * handed out as BSONObjs pointing straight into the map; they stay valid
+   * as long as the DumpReader does.
+   */
+  class DumpRange {
+  public:
+    DumpRange(char const* begin, char const* end) : m_position(begin), m_end(end) { }
+
+    bool more() const { return m_position < m_end; }
+
+    /**
+     * Gets the next document, without copying it.
+     * @param obj where to store the document
+     * @return true if there was another document
+     * @throws dump_error if the dump is truncated or corrupt
+     */
+    bool next(mongo::BSONObj &obj) {
+      if (m_position >= m_end) return false;
+      int32_t size;
+      if (m_end - m_position < 5) throw dump_error("Dump is truncated.");
+      std::memcpy(&size, m_position, sizeof(size));
+      if (size < 5 or size > m_end - m_position) {
+	throw dump_error("Dump is corrupt or truncated.");
+      }
+      obj = mongo::BSONObj(m_position);
+      m_position += size;
+      return true;
+    }
+
+    /**
+     * Decodes the next document.
+     * @param t where to store the object
+     * @param mapper the mapper to decode with
+     * @return true if there was another document
+     */
+    template <typename T>
+    bool next(T &t, Mapper<T> const& mapper) {
+      mongo::BSONObj obj;
+      if (not next(obj)) return false;
+      mapper.from_bson(obj, t);
+      return true;
+    }
+
+  private:
+    char const* m_position;
+    char const* m_end;
+  };
+
+  /**
+   * A DumpReader memory-maps a dump file, so reading it costs no copies and
+   * no heap beyond the objects being decoded.  Without a side index (or
+   * with one that doesn't fit the file) it builds one by hopping from
+   * length prefix to length prefix, which touches one word per document.
+   *
+   *   DumpReader dump("people.bson");
+   *   Person person;
+   *   for (DumpRange all = dump.all(); all.next(person, mapper); ) ...
+   */
+  class DumpReader {
+  public:
+
+    /**
+     * Maps a dump file.
+     * @param path the dump to read
+     * @throws dump_error if the file can't be opened or mapped
+     */
+    DumpReader(std::string const& path)
+      : m_path(path), m_data(0), m_size(0), m_stride(1024), m_documents(0) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) fail("open");
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+	::close(fd);
+	fail("stat");
+      }
+      m_size = st.st_size;
+      if (m_size > 0) {
+	void *data = ::mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+	  ::close(fd);
+	  fail("mmap");
+	}
+	m_data = static_cast<char const*>(data);
+	::madvise(data, m_size, MADV_SEQUENTIAL);
+      }
+      ::close(fd);
+      try {
+	if (not read_index()) build_index();
+      } catch (...) {
+	if (m_data) ::munmap(const_cast<char*>(m_data), m_size);
+	throw;
+      }
+    }
+
+    ~DumpReader() {
+      if (m_data) ::munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    std::string const& path() const { return m_path; }
+    unsigned long long documents() const { return m_documents; }
+    size_t bytes() const { return m_size; }
+
+    /**
+     * Gets every document.
+     * @return a range over the whole dump
+     */
+    DumpRange all() const {
+      return DumpRange(m_data, m_data + m_size);
+    }
+
+    /**
+     * Splits the dump on document boundaries, for reading in parallel.
+     * @param parts how many ranges to make, at most
+     * @return ranges covering the whole dump, each document exactly once
+     */
+    std::vector<DumpRange> split(unsigned int parts) const {
+      std::vector<DumpRange> ranges;
+      if (parts == 0) parts = 1;
+      size_t points = m_index.size();
+      if (parts > points) parts = points ? points : 1;
+      size_t begin = 0;
+      for (unsigned int k = 1; k <= parts; ++k) {
+	size_t end = k == parts ? m_size : m_index[k * points / parts];
+	if (end > begin) ranges.push_back(DumpRange(m_data + begin, m_data + end));
+	begin = end;
+      }
+      return ranges;
+    }
+
+    /**
+     * Decodes every document, calling a function on each.
+     * @param mapper the mapper to decode with
+     * @param f called as f(t) for each object, in order
+     */
+    template <typename T, typename F>
+    void for_each(Mapper<T> const& mapper, F &f) const {
+      T t;
+      for (DumpRange range = all(); range.next(t, mapper); ) f(t);
+    }
+
+    /**
+     * Decodes every document on several threads at once, calling a
+     * function on each.  The function is shared, so must be thread safe;
+     * within a thread, objects arrive in dump order.
+     * @param mapper the mapper to decode with
+     * @param f called as f(t) for each object
+     * @param threads how many threads to use
+     * @throws dump_error if any thread found the dump corrupt
+     */
+    template <typename T, typename F>
+    void parallel_for_each(Mapper<T> const& mapper, F &f, unsigned int threads) const {
+      std::vector<DumpRange> ranges = split(threads);
+      std::vector<std::string> errors(ranges.size());
+      boost::thread_group group;
+      for (size_t k = 0; k < ranges.size(); ++k) {
+	group.create_thread(Visit<T, F>(ranges[k], mapper, f, errors[k]));
+      }
+      group.join_all();
+      for (size_t k = 0; k < errors.size(); ++k) {
+	if (not errors[k].empty()) throw dump_error(errors[k]);
+      }
+    }
+
+  private:
+    template <typename T, typename F>
+    struct Visit {
+      Visit(DumpRange const& range, Mapper<T> const& mapper, F &f, std::string &error)
+	: range(range), mapper(&mapper), f(&f), error(&error) { }
+      void operator()() {
+	try {
+	  T t;
+	  while (range.next(t, *mapper)) (*f)(t);
+	} catch (std::exception const& e) {
+	  *error = e.what();
+	}
+      }
+      DumpRange range;
+      Mapper<T> const* mapper;
+      F *f;
+      std::string *error;
+    };
+
+    bool read_index() {
+      std::string path = m_path + ".idx";
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      std::vector<uint64_t> words;
+      uint64_t word;
+      ssize_t n;
+      while ((n = ::read(fd, &word, sizeof(word))) == ssize_t(sizeof(word))) {
+	words.push_back(word);
+      }
+      ::close(fd);
+      if (n != 0 or words.size() < 3 or words[0] == 0) return false;
+
+      uint64_t stride = words[0];
+      uint64_t documents = words[1];
+      // An index for some other dump, or for this one before it grew.
+      if (words[2] != m_size) return false;
+      if (words.size() - 3 != (documents + stride - 1) / stride) return false;
+      if (words.size() > 3 and words[3] != 0) return false;
+      // A stale index may have the right count but the wrong offsets; each
+      // must at least hold a whole document, and leave room for the stride
+      // of documents before the next.
+      for (size_t k = 3; k < words.size(); ++k) {
+	uint64_t end = k + 1 < words.size() ? words[k + 1] : m_size;
+	if (words[k] >= end or (k + 1 < words.size() and end - words[k] < 5 * stride)) return false;
+	int32_t size;
+	if (end - words[k] < 5) return false;
+	std::memcpy(&size, m_data + words[k], sizeof(size));
+	if (size < 5 or uint64_t(size) > end - words[k] or m_data[words[k] + size - 1] != 0) return false;
+      }
+      m_stride = stride;
+      m_documents = documents;
+      m_index.assign(words.begin() + 3, words.end());
+      return true;
+    }
+
+    void build_index() {
+      m_index.clear();
+      m_documents = 0;
+      for (size_t offset = 0; offset < m_size; ++m_documents) {
+	int32_t size;
+	if (m_size - offset < 5) throw dump_error("Dump '" + m_path + "' is truncated.");
+	std::memcpy(&size, m_data + offset, sizeof(size));
+	if (size < 5 or size_t(size) > m_size - offset) {
+	  throw dump_error("Dump '" + m_path + "' is corrupt or truncated.");
+	}
+	if (m_documents % m_stride == 0) m_index.push_back(offset);
+	offset += size;
+      }
+    }
+
+    void fail(std::string const& what) const {
+      throw dump_error("Dump '" + m_path + "': " + what + " failed: " + std::strerror(errno));
+    }
+
+    DumpReader(DumpReader const&);
+    DumpReader& operator=(DumpReader const&);
+
+    std::string m_path;
+    char const* m_data;
+    size_t m_size;
+    uint64_t m_stride;
+    unsigned long long m_documents;
+    std::vector<uint64_t> m_index;
+  };
+
+};
+
+#endif
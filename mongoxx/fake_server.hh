@@ -0,0 +1,996 @@
+/* fake_server.hh
+   An in-process stand-in for mongod, speaking the wire protocol over loopback.
+
+*/
+
+#ifndef MONGOXX_FAKE_SERVER_HH
+#define MONGOXX_FAKE_SERVER_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "matcher.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace mongoxx {
+
+  /**
+   * A FakeServer listens on a loopback port and answers enough of the
+   * legacy wire protocol for a Session to run against it: OP_QUERY
+   * (including commands), OP_GET_MORE, OP_KILL_CURSORS, OP_INSERT,
+   * OP_UPDATE and OP_DELETE.  Collections live in memory and vanish with
+   * the server.
+   *
+   *   FakeServer server;
+   *   server.set_latency(500);
+   *   Session session(server.host());
+   *
+   * Queries are matched with a Matcher, and may be sorted.  A tailable
+   * query's cursor stays open at the end of the collection and picks up
+   * later inserts; with await-data, a getMore finding nothing new waits a
+   * moment (a fifth of a second, not mongod's second) for one.  Updates
+   * understand whole replacement, $set, $setOnInsert, $unset, $inc and
+   * $push.  Projections are ignored, and there are no indexes: every
+   * query is a scan.
+   *
+   * The commands handled are count, drop, dropDatabase, getlasterror,
+   * insert, update, delete, isMaster, ping, buildinfo and a few handshake
+   * odds and ends; anything else fails with "no such cmd".
+   */
+  class FakeServer {
+  public:
+
+    /**
+     * Starts a server on a free loopback port.
+     * @param latency_micros delay added before answering each request
+     * @throws std::runtime_error if the socket can't be set up
+     */
+    FakeServer(unsigned int latency_micros = 0)
+      : m_listener(-1), m_port(0), m_latency_micros(latency_micros),
+	m_stopping(false), m_next_cursor(1), m_next_request(1), m_requests(0) {
+      m_listener = ::socket(AF_INET, SOCK_STREAM, 0);
+      if (m_listener < 0) throw std::runtime_error("FakeServer could not create a socket.");
+
+      sockaddr_in address;
+      std::memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port = 0;
+      socklen_t length = sizeof(address);
+      if (::bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 or
+	  ::listen(m_listener, 64) != 0 or
+	  ::getsockname(m_listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+	::close(m_listener);
+	throw std::runtime_error("FakeServer could not listen on loopback.");
+      }
+      m_port = ntohs(address.sin_port);
+      m_acceptor = boost::thread(&FakeServer::accept_loop, this);
+    }
+
+    ~FakeServer() {
+      stop();
+    }
+
+    /**
+     * Stops accepting, drops every connection, and waits for the server
+     * threads to finish.  Safe to call more than once.
+     */
+    void stop() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (m_stopping) return;
+	m_stopping = true;
+	for (std::set<int>::const_iterator i = m_clients.begin(); i != m_clients.end(); ++i) {
+	  ::shutdown(*i, SHUT_RDWR);
+	}
+      }
+      ::shutdown(m_listener, SHUT_RDWR);
+      m_acceptor.join();
+      m_connections.join_all();
+      ::close(m_listener);
+    }
+
+    /**
+     * Gets the address to hand to a Session.
+     * @return "127.0.0.1:port"
+     */
+    std::string host() const {
+      std::ostringstream out;
+      out << "127.0.0.1:" << m_port;
+      return out.str();
+    }
+
+    unsigned short port() const { return m_port; }
+
+    /**
+     * Sets the delay added before answering each request, so round trips
+     * cost something repeatable.  Queries with a $maxTimeMS below it fail
+     * as though they had run out of time.
+     * @param latency_micros the delay, in microseconds
+     */
+    void set_latency(unsigned int latency_micros) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_latency_micros = latency_micros;
+    }
+
+    unsigned int latency() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_latency_micros;
+    }
+
+    /**
+     * Gets how many cursors are open, waiting for a getMore.
+     */
+    size_t open_cursors() const {
+      boost::lock_guard<boost::mutex> lock(m_data_mutex);
+      return m_cursors.size();
+    }
+
+    /**
+     * Gets the number of wire protocol messages received so far.
+     * @return the request count
+     */
+    unsigned long long requests() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_requests;
+    }
+
+    /**
+     * Adds a document directly, without going over the wire.
+     * @param ns the full name of the collection
+     * @param document the document; given an _id if it lacks one
+     */
+    void insert(std::string const& ns, mongo::BSONObj const& document) {
+      boost::lock_guard<boost::mutex> lock(m_data_mutex);
+      WriteResult result;
+      insert_document(ns, document, result);
+      if (result.code) throw std::runtime_error(result.error);
+    }
+
+    /**
+     * Gets a copy of every document in a collection, in insertion order.
+     * @param ns the full name of the collection
+     * @return the documents
+     */
+    std::vector<mongo::BSONObj> documents(std::string const& ns) const {
+      boost::lock_guard<boost::mutex> lock(m_data_mutex);
+      Collections::const_iterator i = m_collections.find(ns);
+      return i == m_collections.end() ? std::vector<mongo::BSONObj>() : i->second;
+    }
+
+    /**
+     * Drops every collection and open cursor.
+     */
+    void clear() {
+      boost::lock_guard<boost::mutex> lock(m_data_mutex);
+      m_collections.clear();
+      m_cursors.clear();
+    }
+
+  private:
+    enum {
+      op_reply = 1, op_update = 2001, op_insert = 2002, op_query = 2004,
+      op_get_more = 2005, op_delete = 2006, op_kill_cursors = 2007
+    };
+
+    enum { default_batch = 101, max_batch_bytes = 4 * 1024 * 1024, await_data_ms = 200 };
+
+    typedef std::map<std::string, std::vector<mongo::BSONObj> > Collections;
+
+    struct Cursor {
+      Cursor() : position(0), scanned(0), tailable(false), await_data(false) { }
+      std::vector<mongo::BSONObj> documents;
+      size_t position;
+      // For a tailable cursor: what it follows, and how much of the
+      // collection it has already looked at.
+      std::string ns;
+      mongo::BSONObj filter;
+      size_t scanned;
+      bool tailable;
+      bool await_data;
+    };
+
+    // What one write did, for getlasterror and the write commands.
+    struct WriteResult {
+      WriteResult() : n(0), modified(0), updated_existing(false), code(0) { }
+      long long n;
+      long long modified;
+      bool updated_existing;
+      mongo::BSONObj upserted;   ///< {_id: ...} of an upserted document
+      int code;
+      std::string error;
+    };
+
+    // Pulls little pieces out of a message body.
+    class Reader {
+    public:
+      Reader(char const* data, size_t size) : m_p(data), m_end(data + size) { }
+
+      bool more() const { return m_p < m_end; }
+
+      int int32() {
+	int value;
+	need(4);
+	std::memcpy(&value, m_p, 4);
+	m_p += 4;
+	return value;
+      }
+
+      long long int64() {
+	long long value;
+	need(8);
+	std::memcpy(&value, m_p, 8);
+	m_p += 8;
+	return value;
+      }
+
+      std::string cstring() {
+	char const* start = m_p;
+	while (m_p < m_end and *m_p) ++m_p;
+	need(1);
+	return std::string(start, m_p++);
+      }
+
+      mongo::BSONObj object() {
+	int size;
+	need(4);
+	std::memcpy(&size, m_p, 4);
+	if (size < 5) throw std::runtime_error("FakeServer got a malformed document.");
+	need(size);
+	mongo::BSONObj obj = mongo::BSONObj(m_p).getOwned();
+	m_p += size;
+	return obj;
+      }
+
+    private:
+      void need(size_t n) const {
+	if (static_cast<size_t>(m_end - m_p) < n) {
+	  throw std::runtime_error("FakeServer got a truncated message.");
+	}
+      }
+
+      char const* m_p;
+      char const* m_end;
+    };
+
+    void accept_loop() {
+      while (true) {
+	int client = ::accept(m_listener, 0, 0);
+	int error = errno;
+	// Out of descriptors or memory: give clients a moment to go away.
+	bool starved = client < 0 and (error == EMFILE or error == ENFILE or
+					error == ENOBUFS or error == ENOMEM);
+	if (starved) boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (m_stopping) {
+	  if (client >= 0) ::close(client);
+	  return;
+	}
+	if (client < 0) {
+	  if (starved or error == EINTR or error == ECONNABORTED) continue;
+	  return;
+	}
+	int one = 1;
+	::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	m_clients.insert(client);
+	m_connections.add_thread(new boost::thread(&FakeServer::serve, this, client));
+      }
+    }
+
+    void serve(int client) {
+      WriteResult last_error;
+      std::vector<char> message;
+      try {
+	while (true) {
+	  int header[4];
+	  if (not read_fully(client, reinterpret_cast<char*>(header), sizeof(header))) break;
+	  if (header[0] < 16 or header[0] > 48 * 1000 * 1000) break;
+	  message.resize(header[0] - 16);
+	  if (not message.empty() and not read_fully(client, &message[0], message.size())) break;
+
+	  unsigned int latency;
+	  {
+	    boost::lock_guard<boost::mutex> lock(m_mutex);
+	    ++m_requests;
+	    latency = m_latency_micros;
+	  }
+	  if (latency) boost::this_thread::sleep(boost::posix_time::microseconds(latency));
+
+	  Reader reader(message.empty() ? 0 : &message[0], message.size());
+	  if (not handle(client, header[1], header[3], reader, last_error)) break;
+	}
+      } catch (std::exception const&) {
+	// A malformed message; hang up, as mongod would.
+      }
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_clients.erase(client);
+      ::close(client);
+    }
+
+    // Answers one message.  Returns false to hang up.
+    bool handle(int client, int request_id, int op, Reader &reader,
+		WriteResult &last_error) {
+      switch (op) {
+      case op_query:
+	return handle_query(client, request_id, reader, last_error);
+      case op_get_more:
+	return handle_get_more(client, request_id, reader);
+      case op_kill_cursors: {
+	reader.int32();
+	int count = reader.int32();
+	boost::lock_guard<boost::mutex> lock(m_data_mutex);
+	for (int i = 0; i < count; ++i) m_cursors.erase(reader.int64());
+	return true;
+      }
+      case op_insert: {
+	bool continue_on_error = reader.int32() & 1;
+	std::string ns = reader.cstring();
+	last_error = WriteResult();
+	boost::lock_guard<boost::mutex> lock(m_data_mutex);
+	while (reader.more()) {
+	  WriteResult result;
+	  insert_document(ns, reader.object(), result);
+	  if (result.code) {
+	    last_error = result;
+	    if (not continue_on_error) break;
+	  }
+	}
+	return true;
+      }
+      case op_update: {
+	reader.int32();
+	std::string ns = reader.cstring();
+	int flags = reader.int32();
+	mongo::BSONObj selector = reader.object();
+	mongo::BSONObj update = reader.object();
+	last_error = WriteResult();
+	boost::lock_guard<boost::mutex> lock(m_data_mutex);
+	update_documents(ns, selector, update, flags & 1, flags & 2, last_error);
+	return true;
+      }
+      case op_delete: {
+	reader.int32();
+	std::string ns = reader.cstring();
+	int flags = reader.int32();
+	mongo::BSONObj selector = reader.object();
+	last_error = WriteResult();
+	boost::lock_guard<boost::mutex> lock(m_data_mutex);
+	remove_documents(ns, selector, flags & 1, last_error);
+	return true;
+      }
+      default:
+	return false;
+      }
+    }
+
+    bool handle_query(int client, int request_id, Reader &reader,
+		      WriteResult &last_error) {
+      int flags = reader.int32();
+      std::string ns = reader.cstring();
+      int skip = reader.int32();
+      int to_return = reader.int32();
+      mongo::BSONObj query = reader.object();
+
+      std::vector<mongo::BSONObj> batch;
+      long long cursor_id = 0;
+      try {
+	static std::string const command_suffix = ".$cmd";
+	if (ns.size() > command_suffix.size() and
+	    ns.compare(ns.size() - command_suffix.size(), command_suffix.size(), command_suffix) == 0) {
+	  mongo::BSONObj command = query.hasField("$query") ? query["$query"].Obj() : query;
+	  batch.push_back(run_command(ns.substr(0, ns.size() - command_suffix.size()),
+				      command, last_error));
+	  return reply(client, request_id, 0, 0, 0, batch);
+	}
+
+	mongo::BSONObj filter = query, order;
+	bool explain = false;
+	if (wrapped(query)) {
+	  filter = query.hasField("$query") ? query["$query"].Obj() : query["query"].Obj();
+	  if (query.hasField("$orderby")) order = query["$orderby"].Obj();
+	  if (query.hasField("orderby")) order = query["orderby"].Obj();
+	  explain = query["$explain"].trueValue();
+	  // The latency stands in for time spent running the query.
+	  int max_time_ms = query["$maxTimeMS"].numberInt();
+	  if (max_time_ms > 0 and latency() >= max_time_ms * 1000U) {
+	    batch.push_back(BSON("$err" << "operation exceeded time limit" << "code" << 50));
+	    return reply(client, request_id, 2 /* QueryFailure */, 0, 0, batch);
+	  }
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_data_mutex);
+	std::vector<mongo::BSONObj> found;
+	size_t scanned = find(ns, filter, order, found);
+	if (skip > 0) found.erase(found.begin(), found.begin() + std::min<size_t>(skip, found.size()));
+
+	if (explain) {
+	  batch.push_back(BSON("cursor" << "BasicCursor"
+			       << "nscanned" << static_cast<long long>(scanned)
+			       << "n" << static_cast<long long>(found.size())
+			       << "millis" << 0));
+	} else {
+	  // A negative count, or 1, asks for a single batch and no cursor.
+	  bool single = to_return < 0 or to_return == 1;
+	  size_t wanted = to_return == 0 ? size_t(default_batch) : size_t(std::abs(to_return));
+	  Cursor cursor;
+	  cursor.documents.swap(found);
+	  cursor.position = 0;
+	  if (flags & mongo::QueryOption_CursorTailable) {
+	    cursor.ns = ns;
+	    cursor.filter = filter.getOwned();
+	    cursor.scanned = scanned;
+	    cursor.tailable = true;
+	    cursor.await_data = flags & mongo::QueryOption_AwaitData;
+	  }
+	  take(cursor, wanted, batch);
+	  if (not single and (cursor.tailable or cursor.position < cursor.documents.size())) {
+	    cursor_id = m_next_cursor++;
+	    m_cursors[cursor_id] = cursor;
+	  }
+	}
+      } catch (std::exception const& e) {
+	batch.clear();
+	batch.push_back(BSON("$err" << e.what() << "code" << 2));
+	return reply(client, request_id, 2 /* QueryFailure */, 0, 0, batch);
+      }
+      return reply(client, request_id, 0, cursor_id, 0, batch);
+    }
+
+    bool handle_get_more(int client, int request_id, Reader &reader) {
+      reader.int32();
+      reader.cstring();
+      int to_return = reader.int32();
+      long long cursor_id = reader.int64();
+
+      std::vector<mongo::BSONObj> batch;
+      int starting_from = 0;
+      {
+	boost::unique_lock<boost::mutex> lock(m_data_mutex);
+	std::map<long long, Cursor>::iterator i = m_cursors.find(cursor_id);
+	if (i == m_cursors.end()) {
+	  return reply(client, request_id, 1 /* CursorNotFound */, 0, 0, batch);
+	}
+	if (i->second.tailable and not follow(i->second) and i->second.await_data) {
+	  boost::system_time until = boost::get_system_time() + boost::posix_time::milliseconds(int(await_data_ms));
+	  bool found = false;
+	  while (not found and m_inserted.timed_wait(lock, until)) {
+	    // The cursor may have been killed meanwhile.
+	    i = m_cursors.find(cursor_id);
+	    if (i == m_cursors.end()) return reply(client, request_id, 1 /* CursorNotFound */, 0, 0, batch);
+	    found = follow(i->second);
+	  }
+	  i = m_cursors.find(cursor_id);
+	  if (i == m_cursors.end()) return reply(client, request_id, 1 /* CursorNotFound */, 0, 0, batch);
+	}
+	starting_from = i->second.position;
+	size_t wanted = to_return == 0 ? i->second.documents.size() : size_t(std::abs(to_return));
+	take(i->second, wanted, batch);
+	if (not i->second.tailable and i->second.position >= i->second.documents.size()) {
+	  m_cursors.erase(i);
+	  cursor_id = 0;
+	}
+      }
+      return reply(client, request_id, 0, cursor_id, starting_from, batch);
+    }
+
+    // Adds what has been inserted since to a tailable cursor, and tells
+    // whether it has anything left to return.  Called with m_data_mutex held.
+    bool follow(Cursor &cursor) const {
+      if (cursor.position < cursor.documents.size()) return true;
+      Collections::const_iterator c = m_collections.find(cursor.ns);
+      size_t size = c == m_collections.end() ? 0 : c->second.size();
+      if (cursor.scanned < size) {
+	Matcher matcher(cursor.filter);
+	for (size_t k = cursor.scanned; k < size; ++k) {
+	  if (matcher.matches(c->second[k])) cursor.documents.push_back(c->second[k]);
+	}
+      }
+      cursor.scanned = size;
+      return cursor.position < cursor.documents.size();
+    }
+
+    // Moves up to 'wanted' documents, or about 4MB, out of a cursor.
+    static void take(Cursor &cursor, size_t wanted, std::vector<mongo::BSONObj> &batch) {
+      size_t bytes = 0;
+      while (cursor.position < cursor.documents.size() and batch.size() < wanted and
+	     (batch.empty() or bytes < size_t(max_batch_bytes))) {
+	bytes += cursor.documents[cursor.position].objsize();
+	batch.push_back(cursor.documents[cursor.position++]);
+      }
+    }
+
+    bool reply(int client, int response_to, int flags, long long cursor_id,
+	       int starting_from, std::vector<mongo::BSONObj> const& documents) {
+      std::vector<char> out(36);
+      for (std::vector<mongo::BSONObj>::const_iterator i = documents.begin(); i != documents.end(); ++i) {
+	out.insert(out.end(), i->objdata(), i->objdata() + i->objsize());
+      }
+      int length = out.size(), request_id, op = op_reply;
+      int returned = documents.size();
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	request_id = m_next_request++;
+      }
+      std::memcpy(&out[0], &length, 4);
+      std::memcpy(&out[4], &request_id, 4);
+      std::memcpy(&out[8], &response_to, 4);
+      std::memcpy(&out[12], &op, 4);
+      std::memcpy(&out[16], &flags, 4);
+      std::memcpy(&out[20], &cursor_id, 8);
+      std::memcpy(&out[28], &starting_from, 4);
+      std::memcpy(&out[32], &returned, 4);
+      return write_fully(client, &out[0], out.size());
+    }
+
+    static bool read_fully(int fd, char *buffer, size_t size) {
+      while (size > 0) {
+	ssize_t n = ::recv(fd, buffer, size, 0);
+	if (n <= 0) return false;
+	buffer += n;
+	size -= n;
+      }
+      return true;
+    }
+
+    static bool write_fully(int fd, char const* buffer, size_t size) {
+      while (size > 0) {
+	ssize_t n = ::send(fd, buffer, size, MSG_NOSIGNAL);
+	if (n <= 0) return false;
+	buffer += n;
+	size -= n;
+      }
+      return true;
+    }
+
+    // True if a query carries modifiers around its filter.
+    static bool wrapped(mongo::BSONObj const& query) {
+      mongo::BSONElement inner = query.hasField("$query") ? query["$query"] : query["query"];
+      return inner.type() == mongo::Object;
+    }
+
+    mongo::BSONObj run_command(std::string const& db, mongo::BSONObj const& command,
+			       WriteResult &last_error) {
+      std::string name = command.firstElement().fieldName();
+      std::string lower(name);
+      std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+      mongo::BSONObjBuilder out;
+
+      if (lower == "ismaster") {
+	out.appendBool("ismaster", true);
+	out.append("maxBsonObjectSize", 16 * 1024 * 1024);
+	out.append("maxMessageSizeBytes", 48 * 1000 * 1000);
+	out.append("maxWriteBatchSize", 1000);
+	out.append("minWireVersion", 0);
+	out.append("maxWireVersion", 0);
+      } else if (lower == "ping" or lower == "getnonce" or lower == "whatsmyuri") {
+	if (lower == "getnonce") out.append("nonce", "fake");
+	if (lower == "whatsmyuri") out.append("you", "127.0.0.1");
+      } else if (lower == "buildinfo") {
+	out.append("version", "2.4.0");
+	mongo::BSONArrayBuilder version;
+	version.append(2).append(4).append(0).append(0);
+	out.append("versionArray", version.arr());
+      } else if (lower == "getlasterror") {
+	out.append("n", last_error.n);
+	if (last_error.code) {
+	  out.append("err", last_error.error);
+	  out.append("code", last_error.code);
+	} else {
+	  out.appendNull("err");
+	}
+	if (last_error.updated_existing) out.appendBool("updatedExisting", true);
+	if (not last_error.upserted.isEmpty()) out.appendAs(last_error.upserted.firstElement(), "upserted");
+      } else {
+	boost::lock_guard<boost::mutex> lock(m_data_mutex);
+	std::string ns = db + "." + command.firstElement().str();
+	if (name == "count") {
+	  mongo::BSONObj filter;
+	  if (command["query"].type() == mongo::Object) filter = command["query"].Obj();
+	  std::vector<mongo::BSONObj> found;
+	  find(ns, filter, mongo::BSONObj(), found);
+	  long long n = found.size();
+	  long long skip = command["skip"].numberLong();
+	  long long limit = command["limit"].numberLong();
+	  n = std::max(0LL, n - skip);
+	  if (limit > 0) n = std::min(n, limit);
+	  out.append("n", static_cast<double>(n));
+	} else if (name == "drop") {
+	  if (not m_collections.erase(ns)) {
+	    return BSON("ok" << 0.0 << "errmsg" << "ns not found");
+	  }
+	} else if (name == "dropDatabase") {
+	  std::string prefix = db + ".";
+	  for (Collections::iterator i = m_collections.begin(); i != m_collections.end(); ) {
+	    if (i->first.compare(0, prefix.size(), prefix) == 0) m_collections.erase(i++);
+	    else ++i;
+	  }
+	} else if (name == "insert" or name == "update" or name == "delete") {
+	  write_command(ns, name, command, out);
+	} else if (name == "findAndModify") {
+	  std::string error;
+	  if (not find_and_modify(ns, command, out, error)) {
+	    return BSON("ok" << 0.0 << "errmsg" << error);
+	  }
+	} else {
+	  return BSON("ok" << 0.0 << "errmsg" << "no such cmd: " + name << "code" << 59);
+	}
+      }
+      out.append("ok", 1.0);
+      return out.obj();
+    }
+
+    // The insert, update and delete commands.  Called with m_data_mutex held.
+    void write_command(std::string const& ns, std::string const& name,
+		       mongo::BSONObj const& command, mongo::BSONObjBuilder &out) {
+      char const* field = name == "insert" ? "documents" : name == "update" ? "updates" : "deletes";
+      bool ordered = not command.hasField("ordered") or command["ordered"].trueValue();
+      long long n = 0, modified = 0;
+      mongo::BSONArrayBuilder upserted, errors;
+      bool any_upserted = false, any_errors = false;
+      int index = 0;
+      for (mongo::BSONObjIterator i(command[field].Obj()); i.more(); ++index) {
+	mongo::BSONObj operation = i.next().Obj();
+	WriteResult result;
+	if (name == "insert") {
+	  insert_document(ns, operation, result);
+	} else if (name == "update") {
+	  update_documents(ns, operation["q"].Obj(), operation["u"].Obj(),
+			   operation["upsert"].trueValue(), operation["multi"].trueValue(),
+			   result);
+	} else {
+	  remove_documents(ns, operation["q"].Obj(), operation["limit"].numberLong() == 1, result);
+	}
+	if (result.code) {
+	  errors.append(BSON("index" << index << "code" << result.code << "errmsg" << result.error));
+	  any_errors = true;
+	  if (ordered) break;
+	  continue;
+	}
+	n += result.n;
+	modified += result.modified;
+	if (not result.upserted.isEmpty()) {
+	  mongo::BSONObjBuilder upsert;
+	  upsert.append("index", index);
+	  upsert.appendAs(result.upserted.firstElement(), "_id");
+	  upserted.append(upsert.obj());
+	  any_upserted = true;
+	}
+      }
+      out.append("n", n);
+      if (name == "update") out.append("nModified", modified);
+      if (any_upserted) out.appendArray("upserted", upserted.arr());
+      if (any_errors) out.appendArray("writeErrors", errors.arr());
+    }
+
+    // The findAndModify command.  Called with m_data_mutex held.
+    bool find_and_modify(std::string const& ns, mongo::BSONObj const& command,
+			 mongo::BSONObjBuilder &out, std::string &error) {
+      mongo::BSONObj filter, order, update;
+      if (command["query"].type() == mongo::Object) filter = command["query"].Obj();
+      if (command["sort"].type() == mongo::Object) order = command["sort"].Obj();
+      if (command["update"].type() == mongo::Object) update = command["update"].Obj();
+      bool remove = command["remove"].trueValue();
+      bool return_new = command["new"].trueValue();
+      if (remove == command.hasField("update")) {
+	error = "findAndModify needs exactly one of update and remove";
+	return false;
+      }
+
+      std::vector<mongo::BSONObj> found;
+      find(ns, filter, order, found);
+      mongo::BSONObj value;
+      if (found.empty()) {
+	if (not remove and command["upsert"].trueValue()) {
+	  WriteResult result;
+	  update_documents(ns, filter, update, true, false, result);
+	  if (result.code) {
+	    error = result.error;
+	    return false;
+	  }
+	  if (return_new) value = by_id(ns, result.upserted.firstElement());
+	}
+      } else {
+	mongo::BSONElement id = found.front()["_id"];
+	std::vector<mongo::BSONObj> &collection = m_collections[ns];
+	for (std::vector<mongo::BSONObj>::iterator i = collection.begin(); i != collection.end(); ++i) {
+	  if ((*i)["_id"].woCompare(id, false) != 0) continue;
+	  value = *i;
+	  if (remove) {
+	    collection.erase(i);
+	  } else {
+	    try {
+	      *i = apply_update(*i, update, false);
+	    } catch (std::exception const& e) {
+	      error = e.what();
+	      return false;
+	    }
+	    if (return_new) value = *i;
+	  }
+	  break;
+	}
+      }
+      if (value.isEmpty()) out.appendNull("value");
+      else out.append("value", value);
+      return true;
+    }
+
+    // Called with m_data_mutex held.
+    mongo::BSONObj by_id(std::string const& ns, mongo::BSONElement const& id) const {
+      Collections::const_iterator c = m_collections.find(ns);
+      if (c == m_collections.end()) return mongo::BSONObj();
+      for (std::vector<mongo::BSONObj>::const_iterator i = c->second.begin(); i != c->second.end(); ++i) {
+	if ((*i)["_id"].woCompare(id, false) == 0) return *i;
+      }
+      return mongo::BSONObj();
+    }
+
+    // Finds matching documents, sorted.  Returns how many were examined.
+    // Called with m_data_mutex held.
+    size_t find(std::string const& ns, mongo::BSONObj const& filter,
+		mongo::BSONObj const& order, std::vector<mongo::BSONObj> &found) const {
+      Collections::const_iterator c = m_collections.find(ns);
+      if (c == m_collections.end()) return 0;
+      Matcher matcher(filter);
+      for (std::vector<mongo::BSONObj>::const_iterator i = c->second.begin(); i != c->second.end(); ++i) {
+	if (matcher.matches(*i)) found.push_back(*i);
+      }
+      if (not order.isEmpty()) std::stable_sort(found.begin(), found.end(), Order(order));
+      return c->second.size();
+    }
+
+    // Called with m_data_mutex held.
+    void insert_document(std::string const& ns, mongo::BSONObj const& document,
+			 WriteResult &result) {
+      std::vector<mongo::BSONObj> &collection = m_collections[ns];
+      mongo::BSONElement id = document["_id"];
+      if (id.eoo()) {
+	mongo::BSONObjBuilder builder;
+	builder.append("_id", mongo::OID::gen());
+	builder.appendElements(document);
+	collection.push_back(builder.obj());
+      } else {
+	for (std::vector<mongo::BSONObj>::const_iterator i = collection.begin(); i != collection.end(); ++i) {
+	  if ((*i)["_id"].woCompare(id, false) == 0) {
+	    result.code = 11000;
+	    result.error = "E11000 duplicate key error index: " + ns + ".$_id_";
+	    return;
+	  }
+	}
+	collection.push_back(document.getOwned());
+      }
+      result.n = 1;
+      m_inserted.notify_all();
+    }
+
+    // Called with m_data_mutex held.
+    void update_documents(std::string const& ns, mongo::BSONObj const& selector,
+			  mongo::BSONObj const& update, bool upsert, bool multi,
+			  WriteResult &result) {
+      try {
+	Matcher matcher(selector);
+	std::vector<mongo::BSONObj> &collection = m_collections[ns];
+	for (std::vector<mongo::BSONObj>::iterator i = collection.begin(); i != collection.end(); ++i) {
+	  if (not matcher.matches(*i)) continue;
+	  mongo::BSONObj updated = apply_update(*i, update, false);
+	  if (not updated.equal(*i)) ++result.modified;
+	  *i = updated;
+	  ++result.n;
+	  result.updated_existing = true;
+	  if (not multi) break;
+	}
+	if (result.n == 0 and upsert) {
+	  mongo::BSONObj document = apply_update(upsert_base(selector), update, true);
+	  if (document["_id"].eoo()) {
+	    mongo::BSONObjBuilder builder;
+	    builder.append("_id", mongo::OID::gen());
+	    builder.appendElements(document);
+	    document = builder.obj();
+	  }
+	  insert_document(ns, document, result);
+	  if (result.code) return;
+	  result.n = 1;
+	  result.upserted = document["_id"].wrap();
+	}
+      } catch (std::exception const& e) {
+	result.code = 9;
+	result.error = e.what();
+      }
+    }
+
+    // Called with m_data_mutex held.
+    void remove_documents(std::string const& ns, mongo::BSONObj const& selector,
+			  bool single, WriteResult &result) {
+      try {
+	Collections::iterator c = m_collections.find(ns);
+	if (c == m_collections.end()) return;
+	Matcher matcher(selector);
+	std::vector<mongo::BSONObj> kept;
+	for (std::vector<mongo::BSONObj>::const_iterator i = c->second.begin(); i != c->second.end(); ++i) {
+	  if ((result.n == 0 or not single) and matcher.matches(*i)) ++result.n;
+	  else kept.push_back(*i);
+	}
+	c->second.swap(kept);
+      } catch (std::exception const& e) {
+	result.code = 2;
+	result.error = e.what();
+      }
+    }
+
+    // The equality parts of an upsert selector, which seed the new document.
+    static mongo::BSONObj upsert_base(mongo::BSONObj const& selector) {
+      mongo::BSONObjBuilder builder;
+      for (mongo::BSONObjIterator i(selector); i.more(); ) {
+	mongo::BSONElement element = i.next();
+	if (element.fieldName()[0] == '$' or std::strchr(element.fieldName(), '.')) continue;
+	if (element.type() == mongo::Object and
+	    element.Obj().firstElement().fieldName()[0] == '$') continue;
+	builder.append(element);
+      }
+      return builder.obj();
+    }
+
+    static mongo::BSONObj apply_update(mongo::BSONObj const& document,
+				       mongo::BSONObj const& update, bool inserting) {
+      if (update.isEmpty() or update.firstElement().fieldName()[0] != '$') {
+	mongo::BSONObjBuilder builder;
+	mongo::BSONElement id = document["_id"];
+	if (not id.eoo()) builder.append(id);
+	for (mongo::BSONObjIterator i(update); i.more(); ) {
+	  mongo::BSONElement element = i.next();
+	  if (id.eoo() or std::strcmp(element.fieldName(), "_id") != 0) builder.append(element);
+	}
+	return builder.obj();
+      }
+
+      mongo::BSONObj result = document;
+      for (mongo::BSONObjIterator i(update); i.more(); ) {
+	mongo::BSONElement operation = i.next();
+	std::string op = operation.fieldName();
+	for (mongo::BSONObjIterator j(operation.Obj()); j.more(); ) {
+	  mongo::BSONElement field = j.next();
+	  std::string path = field.fieldName();
+	  if (op == "$set" or (op == "$setOnInsert" and inserting)) {
+	    result = set_path(result, path, field);
+	  } else if (op == "$setOnInsert") {
+	  } else if (op == "$unset") {
+	    result = set_path(result, path, mongo::BSONElement());
+	  } else if (op == "$inc") {
+	    mongo::BSONObj sum = add(result.getFieldDotted(path), field);
+	    result = set_path(result, path, sum.firstElement());
+	  } else if (op == "$push") {
+	    mongo::BSONElement existing = result.getFieldDotted(path);
+	    if (not existing.eoo() and existing.type() != mongo::Array) {
+	      throw std::runtime_error("Cannot apply $push to a non-array field.");
+	    }
+	    mongo::BSONArrayBuilder array;
+	    if (not existing.eoo()) {
+	      for (mongo::BSONObjIterator k(existing.Obj()); k.more(); ) array.append(k.next());
+	    }
+	    array.append(field);
+	    mongo::BSONObjBuilder wrapper;
+	    wrapper.appendArray("", array.arr());
+	    mongo::BSONObj wrapped = wrapper.obj();
+	    result = set_path(result, path, wrapped.firstElement());
+	  } else {
+	    throw std::runtime_error("FakeServer does not support the " + op + " update operator.");
+	  }
+	}
+      }
+      return result;
+    }
+
+    // Sums two numbers, in the narrowest type that holds the result.  The
+    // sum is the only field of the returned object.
+    static mongo::BSONObj add(mongo::BSONElement const& existing,
+			      mongo::BSONElement const& delta) {
+      if (not delta.isNumber() or (not existing.eoo() and not existing.isNumber())) {
+	throw std::runtime_error("Cannot apply $inc to a non-numeric value.");
+      }
+      mongo::BSONObjBuilder builder;
+      if (existing.eoo()) {
+	builder.appendAs(delta, "");
+      } else if (existing.type() == mongo::NumberDouble or delta.type() == mongo::NumberDouble) {
+	builder.append("", existing.numberDouble() + delta.numberDouble());
+      } else {
+	long long sum = existing.numberLong() + delta.numberLong();
+	if (existing.type() == mongo::NumberInt and delta.type() == mongo::NumberInt and
+	    sum >= INT_MIN and sum <= INT_MAX) {
+	  builder.append("", static_cast<int>(sum));
+	} else {
+	  builder.append("", sum);
+	}
+      }
+      return builder.obj();
+    }
+
+    // Sets (or, given eoo, removes) a possibly dotted field.
+    static mongo::BSONObj set_path(mongo::BSONObj const& document, std::string const& path,
+				   mongo::BSONElement const& value) {
+      std::string::size_type dot = path.find('.');
+      std::string head = path.substr(0, dot);
+      mongo::BSONObjBuilder builder;
+      bool found = false;
+      for (mongo::BSONObjIterator i(document); i.more(); ) {
+	mongo::BSONElement element = i.next();
+	if (head != element.fieldName()) {
+	  builder.append(element);
+	  continue;
+	}
+	found = true;
+	if (dot == std::string::npos) {
+	  if (not value.eoo()) builder.appendAs(value, head);
+	} else {
+	  mongo::BSONObj inner = element.type() == mongo::Object ? element.Obj() : mongo::BSONObj();
+	  builder.append(head, set_path(inner, path.substr(dot + 1), value));
+	}
+      }
+      if (not found and not value.eoo()) {
+	if (dot == std::string::npos) builder.appendAs(value, head);
+	else builder.append(head, set_path(mongo::BSONObj(), path.substr(dot + 1), value));
+      }
+      return builder.obj();
+    }
+
+    struct Order {
+      Order(mongo::BSONObj const& spec) : spec(spec) { }
+
+      bool operator()(mongo::BSONObj const& a, mongo::BSONObj const& b) const {
+	for (mongo::BSONObjIterator i(spec); i.more(); ) {
+	  mongo::BSONElement key = i.next();
+	  mongo::BSONElement x = a.getFieldDotted(key.fieldName());
+	  mongo::BSONElement y = b.getFieldDotted(key.fieldName());
+	  int c = x.eoo() ? (y.eoo() ? 0 : -1) : y.eoo() ? 1 : x.woCompare(y, false);
+	  if (c != 0) return key.number() < 0 ? c > 0 : c < 0;
+	}
+	return false;
+      }
+
+      mongo::BSONObj spec;
+    };
+
+    int m_listener;
+    unsigned short m_port;
+
+    mutable boost::mutex m_mutex;
+    unsigned int m_latency_micros;
+    bool m_stopping;
+    std::set<int> m_clients;
+    boost::thread m_acceptor;
+    boost::thread_group m_connections;
+
+    mutable boost::mutex m_data_mutex;
+    boost::condition_variable m_inserted;  // with m_data_mutex
+    Collections m_collections;
+    std::map<long long, Cursor> m_cursors;
+    long long m_next_cursor;
+    int m_next_request;
+    unsigned long long m_requests;
+  };
+
+};
+
+#endif
@@ -0,0 +1,194 @@
+/* identity_map.hh
+   Keeps one decoded instance per document for the length of a unit of work.
+
+*/
+
+#ifndef MONGOXX_IDENTITY_MAP_HH
+#define MONGOXX_IDENTITY_MAP_HH
+
+#include "mapper.hh"
+#include "query.hh"
+#include "session.hh"
+#include "table.hh"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * An IdentityMap resolves documents to shared, already-decoded instances
+   * keyed by their _id.  A document that shows up in several queries is
+   * decoded once, and every query hands back the same object.  Objects that
+   * are changed can be marked dirty and written back together by commit().
+   *
+   * The _id field must be mapped for documents to be tracked; documents
+   * without one are decoded afresh every time.
+   */
+  template <typename T>
+  class IdentityMap {
+  public:
+
+    /**
+     * Constructs an empty IdentityMap.
+     * @param session the session to fetch and commit through
+     * @param collection the name of the collection
+     * @param mapper the mapper for the collection
+     */
+    IdentityMap(Session *session, std::string const& collection,
+		Mapper<T> const* mapper)
+      : m_session(session), m_collection(collection), m_mapper(mapper) { }
+
+    /**
+     * Constructs an empty IdentityMap for a Table.
+     * @param session the session to fetch and commit through
+     * @param table the table to track documents of
+     */
+    IdentityMap(Session *session, Table<T> const& table)
+      : m_session(session), m_collection(table.collection()),
+	m_mapper(table.mapper()) { }
+
+    /**
+     * Runs a query, resolving each document through the map.
+     * @param query the query to run
+     * @return the shared instance for every document, in query order
+     */
+    std::vector<std::tr1::shared_ptr<T> > all(Query<T> const& query) {
+      std::vector<std::tr1::shared_ptr<T> > res;
+      QueryResult<T> result = query.result();
+      for (mongo::BSONObj obj; result.next_bson(obj); ) {
+	res.push_back(resolve(obj));
+      }
+      return res;
+    }
+
+    /**
+     * Runs a query, resolving the first document through the map.
+     * @param query the query to run
+     * @return the shared instance for the first document
+     * @throws query_error if the query has no results
+     */
+    std::tr1::shared_ptr<T> first(Query<T> const& query) {
+      mongo::BSONObj obj;
+      if (not query.limit(1).result().next_bson(obj)) {
+	throw query_error("Query returned no results; cannot return the first element.");
+      }
+      return resolve(obj);
+    }
+
+    /**
+     * Gets the instance with the given _id, fetching it if it is not already
+     * in the map.
+     * @param id the _id to look up
+     * @return the shared instance, or NULL if there is no such document
+     */
+    template <typename K>
+    std::tr1::shared_ptr<T> get(K const& id) {
+      std::tr1::shared_ptr<T> t = find(id);
+      if (t) return t;
+
+      mongo::BSONObjBuilder builder;
+      builder.append("_id", id);
+      mongo::BSONObj obj;
+      if (m_session->execute_query(m_collection, mongo::Query(builder.obj()),
+				   1, 0, m_mapper).next_bson(obj)) {
+	return resolve(obj);
+      }
+      return std::tr1::shared_ptr<T>();
+    }
+
+    /**
+     * Gets the instance with the given _id if it is already in the map.
+     * @param id the _id to look up
+     * @return the shared instance, or NULL if it has not been loaded
+     */
+    template <typename K>
+    std::tr1::shared_ptr<T> find(K const& id) const {
+      mongo::BSONObjBuilder builder;
+      builder.append("_id", id);
+      mongo::BSONObj obj = builder.obj();
+      typename Instances::const_iterator i = m_instances.find(key(obj.firstElement()));
+      return i == m_instances.end() ? std::tr1::shared_ptr<T>() : i->second;
+    }
+
+    /**
+     * Resolves a raw document through the map, decoding it only if its _id
+     * has not been seen before.
+     * @param obj the document
+     * @return the shared instance
+     */
+    std::tr1::shared_ptr<T> resolve(mongo::BSONObj const& obj) {
+      if (not obj.hasField("_id")) {
+	return std::tr1::shared_ptr<T>(new T(m_mapper->from_bson(obj)));
+      }
+      std::string k = key(obj.getField("_id"));
+      typename Instances::const_iterator i = m_instances.find(k);
+      if (i != m_instances.end()) return i->second;
+
+      std::tr1::shared_ptr<T> t(new T(m_mapper->from_bson(obj)));
+      m_instances[k] = t;
+      return t;
+    }
+
+    /**
+     * Marks an instance as changed, to be written back by commit().
+     * @param t the changed instance
+     */
+    void mark_dirty(std::tr1::shared_ptr<T> const& t) {
+      if (m_dirty_set.insert(t.get()).second) {
+	m_dirty.push_back(t);
+      }
+    }
+
+    /**
+     * Writes every dirty instance back to the collection in one batch.
+     * @throws write_error if any instance failed to write; all are retried
+     *   by the next commit()
+     */
+    void commit() {
+      std::vector<T> dirty;
+      dirty.reserve(m_dirty.size());
+      for (typename std::vector<std::tr1::shared_ptr<T> >::const_iterator i = m_dirty.begin(); i != m_dirty.end(); ++i) {
+	dirty.push_back(**i);
+      }
+      Inserter<T>(m_session, m_collection, m_mapper).upsert_all(dirty, false);
+      m_dirty.clear();
+      m_dirty_set.clear();
+    }
+
+    /**
+     * Forgets every instance, dirty or not.
+     */
+    void clear() {
+      m_instances.clear();
+      m_dirty.clear();
+      m_dirty_set.clear();
+    }
+
+    size_t size() const { return m_instances.size(); }
+    size_t dirty() const { return m_dirty.size(); }
+
+  private:
+    typedef std::map<std::string, std::tr1::shared_ptr<T> > Instances;
+
+    // The raw bytes of the _id value, tagged with its type.
+    static std::string key(mongo::BSONElement const& id) {
+      mongo::BSONObj wrapped = id.wrap("");
+      return std::string(wrapped.objdata(), wrapped.objsize());
+    }
+
+    Session *m_session;
+    std::string m_collection;
+    Mapper<T> const* m_mapper;
+
+    Instances m_instances;
+    std::vector<std::tr1::shared_ptr<T> > m_dirty;
+    std::set<T const*> m_dirty_set;
+  };
+
+};
+
+#endif
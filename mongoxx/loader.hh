@@ -0,0 +1,189 @@
+/* loader.hh
+   Coalesces concurrent single-document lookups into batched $in queries.
+
+*/
+
+#ifndef MONGOXX_LOADER_HH
+#define MONGOXX_LOADER_HH
+
+#include "mapper.hh"
+#include "query.hh"
+#include "session.hh"
+#include "table.hh"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A Loader collects point lookups made by many threads within a short
+   * window (or until a batch fills up) and fetches them with a single $in
+   * query.  Concurrent lookups of the same key share one fetch.
+   *
+   * The Loader issues its queries from whichever calling thread happens to
+   * lead a batch, so the Session it is given should be dedicated to it.
+   */
+  template <typename T, typename Key>
+  class Loader {
+  public:
+
+    /**
+     * Constructs a Loader.
+     * @param session the session to fetch through; used only by the Loader
+     * @param collection the name of the collection
+     * @param mapper the mapper for the collection
+     * @param key the mapped member to look documents up by
+     * @param batch_size the most keys to collect before fetching
+     * @param window_ms how long the first key of a batch waits for company
+     */
+    Loader(Session *session, std::string const& collection,
+	   Mapper<T> const* mapper, Key T::*key,
+	   unsigned int batch_size = 100, unsigned int window_ms = 2)
+      : m_session(session), m_collection(collection), m_mapper(mapper),
+	m_key(key), m_batch_size(batch_size), m_window_ms(window_ms),
+	m_collecting(false) { }
+
+    /**
+     * Constructs a Loader for a Table.
+     * @param session the session to fetch through; used only by the Loader
+     * @param table the table to look documents up in
+     * @param key the mapped member to look documents up by
+     * @param batch_size the most keys to collect before fetching
+     * @param window_ms how long the first key of a batch waits for company
+     */
+    Loader(Session *session, Table<T> const& table, Key T::*key,
+	   unsigned int batch_size = 100, unsigned int window_ms = 2)
+      : m_session(session), m_collection(table.collection()),
+	m_mapper(table.mapper()), m_key(key), m_batch_size(batch_size),
+	m_window_ms(window_ms), m_collecting(false) { }
+
+    /**
+     * Looks up the document with the given key.
+     * @param key the key to look up
+     * @return the decoded document
+     * @throws query_error if no document has the key, or the fetch failed
+     */
+    T load(Key const& key) {
+      T t;
+      if (not load(key, t)) {
+	throw query_error("Loader found no document for the requested key.");
+      }
+      return t;
+    }
+
+    /**
+     * Looks up the document with the given key.
+     * @param key the key to look up
+     * @param t the object to decode the document into
+     * @return true if a document was found
+     * @throws query_error if the fetch failed
+     */
+    bool load(Key const& key, T &t) {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+
+      std::tr1::shared_ptr<Slot> slot;
+      typename std::map<Key, std::tr1::shared_ptr<Slot> >::iterator i = m_in_flight.find(key);
+      if (i != m_in_flight.end()) {
+	slot = i->second;
+      } else {
+	slot.reset(new Slot());
+	m_in_flight[key] = slot;
+	m_batch.push_back(key);
+	if (m_batch.size() >= m_batch_size) m_cond.notify_all();
+
+	if (not m_collecting) {
+	  lead(lock);
+	}
+      }
+
+      while (not slot->done) m_cond.wait(lock);
+
+      if (not slot->error.empty()) throw query_error(slot->error);
+      if (slot->found) t = slot->value;
+      return slot->found;
+    }
+
+  private:
+    struct Slot {
+      Slot() : done(false), found(false) { }
+      bool done;
+      bool found;
+      T value;
+      std::string error;
+    };
+
+    // Waits out the batching window, then fetches everything collected.
+    // Called, and returns, with the lock held.
+    void lead(boost::unique_lock<boost::mutex> &lock) {
+      m_collecting = true;
+      boost::system_time deadline = boost::get_system_time() +
+	boost::posix_time::milliseconds(m_window_ms);
+      while (m_batch.size() < m_batch_size) {
+	if (not m_cond.timed_wait(lock, deadline)) break;
+      }
+      std::vector<Key> batch;
+      batch.swap(m_batch);
+      m_collecting = false;
+
+      lock.unlock();
+      std::map<Key, T> found;
+      std::string error;
+      fetch(batch, found, error);
+      lock.lock();
+
+      for (typename std::vector<Key>::const_iterator k = batch.begin(); k != batch.end(); ++k) {
+	typename std::map<Key, std::tr1::shared_ptr<Slot> >::iterator s = m_in_flight.find(*k);
+	if (s == m_in_flight.end()) continue;
+	typename std::map<Key, T>::const_iterator f = found.find(*k);
+	if (f != found.end()) {
+	  s->second->found = true;
+	  s->second->value = f->second;
+	}
+	s->second->error = error;
+	s->second->done = true;
+	m_in_flight.erase(s);
+      }
+      m_cond.notify_all();
+    }
+
+    void fetch(std::vector<Key> const& batch, std::map<Key, T> &found,
+	       std::string &error) {
+      try {
+	boost::lock_guard<boost::mutex> lock(m_session_mutex);
+	QueryResult<T> result = m_session->query(m_collection, m_mapper)
+	  .filter((*m_mapper)[m_key].in(batch)).result();
+	for (T t; result.next(t); ) {
+	  found[t.*m_key] = t;
+	}
+      } catch (std::exception const& e) {
+	error = e.what();
+	if (error.empty()) error = "Loader fetch failed.";
+      }
+    }
+
+    Session *m_session;
+    std::string m_collection;
+    Mapper<T> const* m_mapper;
+    Key T::*m_key;
+    unsigned int m_batch_size;
+    unsigned int m_window_ms;
+
+    boost::mutex m_mutex;
+    boost::condition_variable m_cond;
+    boost::mutex m_session_mutex;
+    bool m_collecting;
+    std::vector<Key> m_batch;
+    std::map<Key, std::tr1::shared_ptr<Slot> > m_in_flight;
+  };
+
+};
+
+#endif
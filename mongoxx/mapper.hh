@@ -126,10 +126,19 @@ namespace mongoxx {
 
     void to_bson(T const& t, mongo::BSONObj &target) const {
       mongo::BSONObjBuilder builder;
+      to_bson(t, builder);
+      target = builder.obj();
+    }
+
+    /**
+     * Appends an object's fields to a builder, so the caller can size it.
+     * @param t the object
+     * @param builder where to append
+     */
+    void to_bson(T const& t, mongo::BSONObjBuilder &builder) const {
       for (typename std::vector<Member*>::const_iterator i = m_fields.begin(); i != m_fields.end(); ++i) {
 	(*i)->to_bson(t, builder);
       }
-      target = builder.obj();
     }
 
     mongo::BSONObj to_bson(T const& t) const {
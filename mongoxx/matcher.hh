@@ -0,0 +1,279 @@
+/* matcher.hh
+   Evaluates Filters on the client, against BSON or mapped objects.
+
+*/
+
+#ifndef MONGOXX_MATCHER_HH
+#define MONGOXX_MATCHER_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "filter.hh"
+#include "mapper.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A Matcher is a Filter compiled for evaluation on the client.  The
+   * filter is taken apart once, into a list of clauses with their operands
+   * resolved (and large $in lists sorted), so testing a document is a walk
+   * down that list with no re-parsing.
+   *
+   *   Matcher adults(mapper[&Person::age] >= 18);
+   *   if (adults.matches(person, mapper)) ...
+   *
+   * It follows the server's rules for the operators Field produces: $ne,
+   * $lt, $lte, $gt, $gte, $in and $nin, plus $eq, $exists, $and, $or and
+   * $nor.  A missing field equals null; an array field matches if any of
+   * its elements does; and ordering comparisons never match across types.
+   */
+  class Matcher {
+  public:
+
+    /**
+     * Compiles a matcher that matches everything.
+     */
+    Matcher() { }
+
+    /**
+     * Compiles a Filter.
+     * @param filter the filter
+     * @throws std::invalid_argument if the filter uses an unknown operator
+     */
+    Matcher(Filter const& filter) {
+      compile(filter.to_bson());
+    }
+
+    /**
+     * Compiles a raw query filter.
+     * @param filter the filter
+     * @throws std::invalid_argument if the filter uses an unknown operator
+     */
+    Matcher(mongo::BSONObj const& filter) {
+      compile(filter);
+    }
+
+    /**
+     * Tests a document.
+     * @param document the document
+     * @return true if the document matches
+     */
+    bool matches(mongo::BSONObj const& document) const {
+      for (std::vector<Clause>::const_iterator c = m_clauses.begin(); c != m_clauses.end(); ++c) {
+	if (not c->matches(document)) return false;
+      }
+      return true;
+    }
+
+    /**
+     * Tests an object, by way of its encoding.
+     * @param t the object
+     * @param mapper the mapper naming its fields
+     * @return true if the object matches
+     */
+    template <typename T>
+    bool matches(T const& t, Mapper<T> const& mapper) const {
+      return m_clauses.empty() or matches(mapper.to_bson(t));
+    }
+
+    /**
+     * Keeps the objects that match, in order.
+     * @param objects the objects to filter
+     * @param mapper the mapper naming their fields
+     * @return the matching objects
+     */
+    template <typename T>
+    std::vector<T> select(std::vector<T> const& objects, Mapper<T> const& mapper) const {
+      std::vector<T> selected;
+      for (typename std::vector<T>::const_iterator i = objects.begin(); i != objects.end(); ++i) {
+	if (matches(*i, mapper)) selected.push_back(*i);
+      }
+      return selected;
+    }
+
+    /**
+     * Compares two values the way the server does for equality: a missing
+     * value equals null, and an array equals anything it contains.
+     */
+    static bool equals(mongo::BSONElement const& value, mongo::BSONElement const& target) {
+      if (value.eoo()) return target.type() == mongo::jstNULL;
+      if (value.woCompare(target, false) == 0) return true;
+      if (value.type() == mongo::Array and target.type() != mongo::Array) {
+	for (mongo::BSONObjIterator i(value.Obj()); i.more(); ) {
+	  if (i.next().woCompare(target, false) == 0) return true;
+	}
+      }
+      return false;
+    }
+
+  private:
+    enum Op { eq, ne, lt, lte, gt, gte, in, nin, exists, all_of, any_of, none_of };
+
+    // Orders elements by value alone, for binary searching $in lists.
+    struct Less {
+      bool operator()(mongo::BSONElement const& a, mongo::BSONElement const& b) const {
+	return a.woCompare(b, false) < 0;
+      }
+    };
+
+    // Past this many values, $in sorts its list and binary searches it.
+    enum { sorted_in_threshold = 8 };
+
+    struct Clause {
+      typedef std::vector<std::tr1::shared_ptr<Matcher const> > Children;
+
+      bool matches(mongo::BSONObj const& document) const {
+	switch (op) {
+	case all_of:
+	  for (Children::const_iterator i = children.begin(); i != children.end(); ++i) {
+	    if (not (*i)->matches(document)) return false;
+	  }
+	  return true;
+	case any_of:
+	case none_of:
+	  for (Children::const_iterator i = children.begin(); i != children.end(); ++i) {
+	    if ((*i)->matches(document)) return op == any_of;
+	  }
+	  return op == none_of;
+	default:
+	  break;
+	}
+	mongo::BSONElement value = dotted ? document.getFieldDotted(path) : document.getField(path);
+	switch (op) {
+	case eq: return equals(value, operand);
+	case ne: return not equals(value, operand);
+	case lt: case lte: case gt: case gte: return compares(value);
+	case in: return contains(value);
+	case nin: return not contains(value);
+	case exists: return value.eoo() != operand.trueValue();
+	default: return false;
+	}
+      }
+
+      bool compares(mongo::BSONElement const& value) const {
+	if (value.eoo()) return false;
+	if (value.type() == mongo::Array) {
+	  for (mongo::BSONObjIterator i(value.Obj()); i.more(); ) {
+	    if (compares(i.next())) return true;
+	  }
+	  return false;
+	}
+	if (value.canonicalType() != operand.canonicalType()) return false;
+	int c = value.woCompare(operand, false);
+	switch (op) {
+	case lt: return c < 0;
+	case lte: return c <= 0;
+	case gt: return c > 0;
+	default: return c >= 0;
+	}
+      }
+
+      bool contains(mongo::BSONElement const& value) const {
+	if (not sorted) {
+	  for (std::vector<mongo::BSONElement>::const_iterator i = values.begin(); i != values.end(); ++i) {
+	    if (equals(value, *i)) return true;
+	  }
+	  return false;
+	}
+	if (value.type() == mongo::Array) {
+	  for (mongo::BSONObjIterator i(value.Obj()); i.more(); ) {
+	    if (std::binary_search(values.begin(), values.end(), i.next(), Less())) return true;
+	  }
+	}
+	if (value.eoo()) return has_null;
+	return std::binary_search(values.begin(), values.end(), value, Less());
+      }
+
+      Op op;
+      std::string path;
+      bool dotted;
+      mongo::BSONElement operand;
+      std::vector<mongo::BSONElement> values;
+      bool sorted;
+      bool has_null;
+      Children children;
+    };
+
+    void compile(mongo::BSONObj const& filter) {
+      // The clauses point into the filter, so keep our own copy of it.
+      m_filter = filter.getOwned();
+      for (mongo::BSONObjIterator i(m_filter); i.more(); ) {
+	mongo::BSONElement element = i.next();
+	char const* name = element.fieldName();
+	if (name[0] == '$') {
+	  Clause clause;
+	  if (std::strcmp(name, "$and") == 0) clause.op = all_of;
+	  else if (std::strcmp(name, "$or") == 0) clause.op = any_of;
+	  else if (std::strcmp(name, "$nor") == 0) clause.op = none_of;
+	  else throw std::invalid_argument(std::string("Matcher does not support ") + name + ".");
+	  for (mongo::BSONObjIterator j(element.Obj()); j.more(); ) {
+	    clause.children.push_back(std::tr1::shared_ptr<Matcher const>(new Matcher(j.next().Obj())));
+	  }
+	  m_clauses.push_back(clause);
+	} else if (element.type() == mongo::Object and
+		   element.Obj().firstElement().fieldName()[0] == '$') {
+	  for (mongo::BSONObjIterator j(element.Obj()); j.more(); ) {
+	    m_clauses.push_back(condition(name, j.next()));
+	  }
+	} else {
+	  Clause clause = field_clause(name, eq);
+	  clause.operand = element;
+	  m_clauses.push_back(clause);
+	}
+      }
+    }
+
+    static Clause field_clause(char const* name, Op op) {
+      Clause clause;
+      clause.op = op;
+      clause.path = name;
+      clause.dotted = std::strchr(name, '.') != 0;
+      clause.sorted = false;
+      clause.has_null = false;
+      return clause;
+    }
+
+    static Clause condition(char const* name, mongo::BSONElement const& operand) {
+      static struct { char const* name; Op op; } const operators[] = {
+	{ "$eq", eq }, { "$ne", ne }, { "$lt", lt }, { "$lte", lte },
+	{ "$gt", gt }, { "$gte", gte }, { "$in", in }, { "$nin", nin },
+	{ "$exists", exists }
+      };
+      for (size_t k = 0; k < sizeof(operators) / sizeof(operators[0]); ++k) {
+	if (std::strcmp(operand.fieldName(), operators[k].name) != 0) continue;
+	Clause clause = field_clause(name, operators[k].op);
+	clause.operand = operand;
+	if (clause.op == in or clause.op == nin) {
+	  if (operand.type() != mongo::Array) {
+	    throw std::invalid_argument(std::string(operators[k].name) + " needs an array.");
+	  }
+	  for (mongo::BSONObjIterator i(operand.Obj()); i.more(); ) {
+	    mongo::BSONElement value = i.next();
+	    if (value.type() == mongo::jstNULL) clause.has_null = true;
+	    clause.values.push_back(value);
+	  }
+	  if (clause.values.size() > size_t(sorted_in_threshold)) {
+	    std::sort(clause.values.begin(), clause.values.end(), Less());
+	    clause.sorted = true;
+	  }
+	}
+	return clause;
+      }
+      throw std::invalid_argument(std::string("Matcher does not support ") +
+				  operand.fieldName() + ".");
+    }
+
+    mongo::BSONObj m_filter;
+    std::vector<Clause> m_clauses;
+  };
+
+};
+
+#endif
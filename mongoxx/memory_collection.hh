@@ -0,0 +1,594 @@
+/* memory_collection.hh
+   Serves a collection's queries from an indexed in-memory copy.
+
+*/
+
+#ifndef MONGOXX_MEMORY_COLLECTION_HH
+#define MONGOXX_MEMORY_COLLECTION_HH
+
+#include "mongo/client/dbclient.h"
+#include "mongo/client/connpool.h"
+
+#include "mapper.hh"
+#include "matcher.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+#include <tr1/unordered_map>
+
+namespace mongoxx {
+
+  /**
+   * The documents one in-memory query matched.  It holds on to the copy of
+   * the collection they live in, so they stay valid however long it lives.
+   */
+  class MemoryCursor {
+  public:
+    MemoryCursor(std::tr1::shared_ptr<void const> const& snapshot,
+		 std::vector<char const*> &documents)
+      : m_snapshot(snapshot), m_position(0) {
+      m_documents.swap(documents);
+    }
+
+    bool more() const { return m_position < m_documents.size(); }
+
+    bool next(mongo::BSONObj &obj) {
+      if (not more()) return false;
+      obj = mongo::BSONObj(m_documents[m_position++]);
+      return true;
+    }
+
+    size_t size() const { return m_documents.size(); }
+
+  private:
+    std::tr1::shared_ptr<void const> m_snapshot;
+    std::vector<char const*> m_documents;
+    size_t m_position;
+  };
+
+  /**
+   * A MemoryCollection holds a full copy of one collection, packed into a
+   * few large buffers, with hash and ordered indexes on chosen fields.  Once
+   * a Session routes the collection to it, every Query on the collection
+   * (filters, ascending/descending, limit and skip) is answered from memory.
+   *
+   *   std::tr1::shared_ptr<MemoryCollection> countries(new MemoryCollection("geo.country"));
+   *   countries->add_hash_index(mapper, &Country::code);
+   *   countries->start_refresh("localhost", 60000);
+   *   session.route_to_memory(countries);
+   *
+   * Each load builds a new copy and swaps it in, so queries never wait for
+   * a refresh and always see a consistent collection.  Writes still go to
+   * the server; a write through a routing Session marks the copy stale,
+   * which makes the background refresher (if there is one) reload early.
+   * Until then, reads may not see the write.
+   */
+  class MemoryCollection {
+  public:
+
+    /**
+     * Counters describing what the collection has been doing.
+     */
+    struct Stats {
+      Stats() : documents(0), bytes(0), refreshes(0), failed_refreshes(0),
+		indexed_queries(0), scanned_queries(0) { }
+      size_t documents;                    ///< documents held now
+      size_t bytes;                        ///< BSON bytes held now
+      unsigned long long refreshes;        ///< successful loads
+      unsigned long long failed_refreshes; ///< background loads that threw
+      unsigned long long indexed_queries;  ///< queries narrowed by an index
+      unsigned long long scanned_queries;  ///< queries that looked at everything
+    };
+
+    /**
+     * Constructs an empty MemoryCollection.
+     * @param collection the full name of the collection it copies
+     * @param filter restricts which documents are copied, on refresh
+     */
+    MemoryCollection(std::string const& collection,
+		     mongo::BSONObj const& filter = mongo::BSONObj())
+      : m_collection(collection), m_filter(filter.getOwned()),
+	m_snapshot(new Snapshot()), m_interval_ms(0), m_stale(false),
+	m_stopping(false) { }
+
+    ~MemoryCollection() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stopping = true;
+      }
+      m_wakeup.notify_all();
+      if (m_thread.joinable()) m_thread.join();
+    }
+
+    std::string const& collection() const { return m_collection; }
+
+    /**
+     * Adds a hash index, for equality and $in filters on a field.
+     * @param field the document field name; may be dotted
+     */
+    void add_hash_index(std::string const& field) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_hashed.insert(field);
+      reindex();
+    }
+
+    /**
+     * Adds an ordered index, for range filters and sorting on a field.
+     * @param field the document field name; may be dotted
+     */
+    void add_ordered_index(std::string const& field) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_ordered.insert(field);
+      reindex();
+    }
+
+    /**
+     * Adds a hash index on a mapped member.
+     * @param mapper the mapper for the collection
+     * @param member the member to index
+     */
+    template <typename T, typename U>
+    void add_hash_index(Mapper<T> const& mapper, U T::*member) {
+      add_hash_index(mapper.lookup_field(member));
+    }
+
+    /**
+     * Adds an ordered index on a mapped member.
+     * @param mapper the mapper for the collection
+     * @param member the member to index
+     */
+    template <typename T, typename U>
+    void add_ordered_index(Mapper<T> const& mapper, U T::*member) {
+      add_ordered_index(mapper.lookup_field(member));
+    }
+
+    /**
+     * Replaces the contents with the given documents.
+     * @param documents the documents, in natural order
+     */
+    void load(std::vector<mongo::BSONObj> const& documents) {
+      std::tr1::shared_ptr<Snapshot> snapshot(new Snapshot());
+      for (std::vector<mongo::BSONObj>::const_iterator i = documents.begin(); i != documents.end(); ++i) {
+	snapshot->add(*i);
+      }
+      install(snapshot);
+    }
+
+    /**
+     * Replaces the contents with everything a cursor returns.
+     * @param cursor a cursor over the collection
+     */
+    void load(mongo::DBClientCursor &cursor) {
+      std::tr1::shared_ptr<Snapshot> snapshot(new Snapshot());
+      while (cursor.more()) snapshot->add(cursor.next());
+      install(snapshot);
+    }
+
+    /**
+     * Reloads the collection from the server in the background, over a
+     * connection of its own.
+     * @param host the server to load from
+     * @param interval_ms how often to reload; 0 to reload only when
+     * marked stale
+     */
+    void start_refresh(std::string const& host, unsigned int interval_ms) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (m_thread.joinable()) return;
+      m_host = host;
+      m_interval_ms = interval_ms;
+      m_stale = true;
+      m_thread = boost::thread(&MemoryCollection::run, this);
+    }
+
+    /**
+     * Notes that the server copy has changed, so the background refresher
+     * reloads now rather than at its next interval.
+     */
+    void mark_stale() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stale = true;
+      }
+      m_wakeup.notify_all();
+    }
+
+    /**
+     * Gets the filter restricting what is loaded.
+     * @return the filter
+     */
+    mongo::BSONObj const& filter() const { return m_filter; }
+
+    /**
+     * Answers a query.
+     * @param query the filter and sort
+     * @param limit the most documents to return; 0 for all
+     * @param skip how many matching documents to skip
+     * @return the matching documents
+     * @throws std::invalid_argument if the filter uses an unknown operator
+     */
+    std::tr1::shared_ptr<MemoryCursor> find(mongo::Query const& query,
+					    unsigned int limit, unsigned int skip) {
+      std::tr1::shared_ptr<Snapshot const> snapshot;
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	snapshot = m_snapshot;
+      }
+
+      mongo::BSONObj filter = query.getFilter();
+      mongo::BSONObj sort = query.getSort();
+      std::vector<unsigned int> ids;
+      bool exact = false;
+      bool indexed = snapshot->candidates(filter, ids, exact);
+
+      if (indexed) {
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+      } else {
+	ids.resize(snapshot->documents.size());
+	for (unsigned int id = 0; id < ids.size(); ++id) ids[id] = id;
+      }
+      if (not exact) {
+	Matcher matcher(filter);
+	std::vector<unsigned int> matched;
+	for (std::vector<unsigned int>::const_iterator i = ids.begin(); i != ids.end(); ++i) {
+	  if (matcher.matches(mongo::BSONObj(snapshot->documents[*i]))) matched.push_back(*i);
+	}
+	ids.swap(matched);
+      }
+
+      if (not sort.isEmpty()) snapshot->sort(ids, sort);
+      if (skip > 0) ids.erase(ids.begin(), ids.begin() + std::min<size_t>(skip, ids.size()));
+      if (limit > 0 and ids.size() > limit) ids.resize(limit);
+
+      std::vector<char const*> documents;
+      documents.reserve(ids.size());
+      for (std::vector<unsigned int>::const_iterator i = ids.begin(); i != ids.end(); ++i) {
+	documents.push_back(snapshot->documents[*i]);
+      }
+
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	++(indexed ? m_stats.indexed_queries : m_stats.scanned_queries);
+      }
+      return std::tr1::shared_ptr<MemoryCursor>(new MemoryCursor(snapshot, documents));
+    }
+
+    /**
+     * Gets a snapshot of the counters.
+     * @return the counters
+     */
+    Stats stats() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      Stats stats = m_stats;
+      stats.documents = m_snapshot->documents.size();
+      stats.bytes = m_snapshot->bytes;
+      return stats;
+    }
+
+  private:
+    // A hash index maps a normalized value to the documents holding it.
+    typedef std::tr1::unordered_map<std::string, std::vector<unsigned int> > HashIndex;
+
+    // An ordered index lists documents by a field's value.  Documents whose
+    // value is an array can't be placed in one spot, so they are kept aside
+    // and always considered.
+    struct OrderedIndex {
+      std::string field;
+      std::vector<unsigned int> order;
+      std::vector<unsigned int> arrays;
+      std::vector<unsigned int> rank;   ///< position of each document in order
+    };
+
+    // One immutable copy of the collection.  Documents are packed into
+    // chunks that never reallocate, so pointers into them stay put.
+    struct Snapshot {
+      enum { chunk_size = 1024 * 1024 };
+
+      Snapshot() : bytes(0) { }
+
+      void add(mongo::BSONObj const& document) {
+	size_t size = document.objsize();
+	if (chunks.empty() or chunks.back()->capacity() - chunks.back()->size() < size) {
+	  chunks.push_back(std::tr1::shared_ptr<std::vector<char> >(new std::vector<char>()));
+	  chunks.back()->reserve(std::max<size_t>(size, chunk_size));
+	}
+	std::vector<char> &chunk = *chunks.back();
+	size_t offset = chunk.size();
+	chunk.insert(chunk.end(), document.objdata(), document.objdata() + size);
+	documents.push_back(&chunk[offset]);
+	bytes += size;
+      }
+
+      void build_hash(std::string const& field) {
+	HashIndex &index = hashed[field];
+	for (unsigned int id = 0; id < documents.size(); ++id) {
+	  mongo::BSONElement value = mongo::BSONObj(documents[id]).getFieldDotted(field);
+	  index[key(value)].push_back(id);
+	  if (value.type() == mongo::Array) {
+	    for (mongo::BSONObjIterator i(value.Obj()); i.more(); ) {
+	      std::vector<unsigned int> &ids = index[key(i.next())];
+	      if (ids.empty() or ids.back() != id) ids.push_back(id);
+	    }
+	  }
+	}
+      }
+
+      void build_ordered(std::string const& field) {
+	OrderedIndex &index = ordered[field];
+	index.field = field;
+	for (unsigned int id = 0; id < documents.size(); ++id) {
+	  mongo::BSONElement value = mongo::BSONObj(documents[id]).getFieldDotted(field);
+	  (value.type() == mongo::Array ? index.arrays : index.order).push_back(id);
+	}
+	std::stable_sort(index.order.begin(), index.order.end(), ByField(this, field));
+	index.rank.assign(documents.size(), index.order.size());
+	for (unsigned int r = 0; r < index.order.size(); ++r) index.rank[index.order[r]] = r;
+      }
+
+      // Narrows a filter to candidate documents with an index.  Returns
+      // false if no index applies.  Sets exact if every candidate is known
+      // to match.
+      bool candidates(mongo::BSONObj const& filter, std::vector<unsigned int> &ids,
+		      bool &exact) const {
+	for (mongo::BSONObjIterator i(filter); i.more(); ) {
+	  mongo::BSONElement condition = i.next();
+	  std::string field = condition.fieldName();
+	  if (field[0] == '$') continue;
+	  bool operators = condition.type() == mongo::Object and
+	    condition.Obj().firstElement().fieldName()[0] == '$';
+
+	  std::map<std::string, HashIndex>::const_iterator h = hashed.find(field);
+	  if (h != hashed.end()) {
+	    if (not operators) {
+	      lookup(h->second, condition, ids);
+	      exact = filter.nFields() == 1 and condition.type() != mongo::Array;
+	      return true;
+	    }
+	    mongo::BSONObj ops = condition.Obj();
+	    if (ops.nFields() == 1 and ops.hasField("$in")) {
+	      for (mongo::BSONObjIterator j(ops["$in"].Obj()); j.more(); ) {
+		lookup(h->second, j.next(), ids);
+	      }
+	      return true;
+	    }
+	  }
+
+	  std::map<std::string, OrderedIndex>::const_iterator o = ordered.find(field);
+	  if (o != ordered.end() and operators) {
+	    std::vector<unsigned int>::const_iterator begin = o->second.order.begin();
+	    std::vector<unsigned int>::const_iterator end = o->second.order.end();
+	    bool bounded = false;
+	    for (mongo::BSONObjIterator j(condition.Obj()); j.more(); ) {
+	      mongo::BSONElement bound = j.next();
+	      char const* op = bound.fieldName();
+	      ByField by(this, field);
+	      if (std::strcmp(op, "$gt") == 0 or std::strcmp(op, "$gte") == 0) {
+		begin = std::max(begin, std::lower_bound(begin, end, bound, by));
+		bounded = true;
+	      } else if (std::strcmp(op, "$lt") == 0 or std::strcmp(op, "$lte") == 0) {
+		end = std::min(end, std::upper_bound(begin, end, bound, by));
+		bounded = true;
+	      }
+	    }
+	    if (bounded) {
+	      if (begin < end) ids.insert(ids.end(), begin, end);
+	      ids.insert(ids.end(), o->second.arrays.begin(), o->second.arrays.end());
+	      return true;
+	    }
+	  }
+	}
+	return false;
+      }
+
+      void lookup(HashIndex const& index, mongo::BSONElement const& value,
+		  std::vector<unsigned int> &ids) const {
+	HashIndex::const_iterator found = index.find(key(value));
+	if (found != index.end()) ids.insert(ids.end(), found->second.begin(), found->second.end());
+      }
+
+      void sort(std::vector<unsigned int> &ids, mongo::BSONObj const& spec) const {
+	std::map<std::string, OrderedIndex>::const_iterator o =
+	  ordered.find(spec.firstElement().fieldName());
+	if (spec.nFields() == 1 and o != ordered.end()) {
+	  // Sort by position in the index, which is integer compares only.
+	  std::stable_sort(ids.begin(), ids.end(), ByRank(o->second.rank));
+	  if (spec.firstElement().number() < 0) std::reverse(ids.begin(), ids.end());
+	  return;
+	}
+	std::stable_sort(ids.begin(), ids.end(), BySpec(this, spec));
+      }
+
+      std::vector<std::tr1::shared_ptr<std::vector<char> > > chunks;
+      std::vector<char const*> documents;
+      size_t bytes;
+      std::map<std::string, HashIndex> hashed;
+      std::map<std::string, OrderedIndex> ordered;
+    };
+
+    // Normalizes a value for hashing, so that values the server calls
+    // equal (5 and 5.0; null and missing) share a key.
+    static std::string key(mongo::BSONElement const& value) {
+      std::string key;
+      if (value.eoo() or value.type() == mongo::jstNULL or value.type() == mongo::Undefined) {
+	key = "0";
+      } else if (value.isNumber()) {
+	double d = value.numberDouble();
+	long long n = value.numberLong();
+	bool integral = value.type() != mongo::NumberDouble;
+	if (not integral and d == std::floor(d) and std::fabs(d) < 9.2e18) {
+	  n = static_cast<long long>(d);
+	  integral = true;
+	}
+	if (integral) {
+	  key = "n";
+	  key.append(reinterpret_cast<char const*>(&n), sizeof(n));
+	} else {
+	  key = "d";
+	  key.append(reinterpret_cast<char const*>(&d), sizeof(d));
+	}
+      } else {
+	key.push_back(static_cast<char>('A' + value.canonicalType()));
+	key.append(value.value(), value.valuesize());
+      }
+      return key;
+    }
+
+    // Orders documents by one field, missing values first.
+    struct ByField {
+      ByField(Snapshot const* snapshot, std::string const& field)
+	: snapshot(snapshot), field(field) { }
+
+      mongo::BSONElement value(unsigned int id) const {
+	return mongo::BSONObj(snapshot->documents[id]).getFieldDotted(field);
+      }
+      static int compare(mongo::BSONElement const& a, mongo::BSONElement const& b) {
+	if (a.eoo()) return b.eoo() ? 0 : -1;
+	if (b.eoo()) return 1;
+	return a.woCompare(b, false);
+      }
+
+      bool operator()(unsigned int a, unsigned int b) const {
+	return compare(value(a), value(b)) < 0;
+      }
+      bool operator()(unsigned int a, mongo::BSONElement const& b) const {
+	return compare(value(a), b) < 0;
+      }
+      bool operator()(mongo::BSONElement const& a, unsigned int b) const {
+	return compare(a, value(b)) < 0;
+      }
+
+      Snapshot const* snapshot;
+      std::string field;
+    };
+
+    // Orders documents by a sort specification.
+    struct BySpec {
+      BySpec(Snapshot const* snapshot, mongo::BSONObj const& spec)
+	: snapshot(snapshot), spec(spec) { }
+
+      bool operator()(unsigned int a, unsigned int b) const {
+	mongo::BSONObj x(snapshot->documents[a]), y(snapshot->documents[b]);
+	for (mongo::BSONObjIterator i(spec); i.more(); ) {
+	  mongo::BSONElement key = i.next();
+	  int c = ByField::compare(x.getFieldDotted(key.fieldName()),
+				   y.getFieldDotted(key.fieldName()));
+	  if (c != 0) return key.number() < 0 ? c > 0 : c < 0;
+	}
+	return false;
+      }
+
+      Snapshot const* snapshot;
+      mongo::BSONObj spec;
+    };
+
+    // Orders documents by their position in an ordered index.
+    struct ByRank {
+      ByRank(std::vector<unsigned int> const& rank) : rank(rank) { }
+
+      bool operator()(unsigned int a, unsigned int b) const {
+	return rank[a] < rank[b];
+      }
+
+      std::vector<unsigned int> const& rank;
+    };
+
+    // Indexes a freshly loaded copy and swaps it in.
+    void install(std::tr1::shared_ptr<Snapshot> const& snapshot) {
+      std::set<std::string> hashed, ordered;
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	hashed = m_hashed;
+	ordered = m_ordered;
+      }
+      index(*snapshot, hashed, ordered);
+
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (hashed != m_hashed or ordered != m_ordered) {
+	// An index was added while we were building; build it too.
+	index(*snapshot, m_hashed, m_ordered);
+      }
+      m_snapshot = snapshot;
+      ++m_stats.refreshes;
+    }
+
+    static void index(Snapshot &snapshot, std::set<std::string> const& hashed,
+		      std::set<std::string> const& ordered) {
+      for (std::set<std::string>::const_iterator i = hashed.begin(); i != hashed.end(); ++i) {
+	if (not snapshot.hashed.count(*i)) snapshot.build_hash(*i);
+      }
+      for (std::set<std::string>::const_iterator i = ordered.begin(); i != ordered.end(); ++i) {
+	if (not snapshot.ordered.count(*i)) snapshot.build_ordered(*i);
+      }
+    }
+
+    // Rebuilds the current copy's indexes.  Called with m_mutex held.
+    void reindex() {
+      std::tr1::shared_ptr<Snapshot> snapshot(new Snapshot(*m_snapshot));
+      index(*snapshot, m_hashed, m_ordered);
+      m_snapshot = snapshot;
+    }
+
+    void run() {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (not m_stopping) {
+	if (not m_stale and m_interval_ms == 0) {
+	  while (not m_stopping and not m_stale) m_wakeup.wait(lock);
+	  if (m_stopping) break;
+	} else if (not m_stale) {
+	  boost::system_time deadline = boost::get_system_time() +
+	    boost::posix_time::milliseconds(m_interval_ms);
+	  while (not m_stopping and not m_stale and m_wakeup.timed_wait(lock, deadline)) { }
+	  if (m_stopping) break;
+	}
+	m_stale = false;
+	std::string host = m_host;
+	lock.unlock();
+
+	bool failed = false;
+	try {
+	  mongo::ScopedDbConnection connection(host);
+	  std::auto_ptr<mongo::DBClientCursor> cursor =
+	    connection->query(m_collection, mongo::Query(m_filter));
+	  if (cursor.get()) load(*cursor);
+	  connection.done();
+	} catch (std::exception const&) {
+	  failed = true;
+	}
+
+	lock.lock();
+	if (failed) ++m_stats.failed_refreshes;
+      }
+    }
+
+    std::string m_collection;
+    mongo::BSONObj m_filter;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_wakeup;
+    std::tr1::shared_ptr<Snapshot const> m_snapshot;
+    std::set<std::string> m_hashed;
+    std::set<std::string> m_ordered;
+    Stats m_stats;
+    std::string m_host;
+    unsigned int m_interval_ms;
+    bool m_stale;
+    bool m_stopping;
+    boost::thread m_thread;
+  };
+
+};
+
+#endif
@@ -15,9 +15,31 @@
 #include "bson_decoder.hh"
 #include "mapper.hh"
 #include "filter.hh"
+#include "matcher.hh"
+#include "cancellation.hh"
 #include "query.hh"
 #include "table.hh"
+#include "batch_sizer.hh"
+#include "cache.hh"
+#include "memory_collection.hh"
+#include "stats.hh"
+#include "observer.hh"
+#include "write_concern.hh"
 #include "session.hh"
+#include "loader.hh"
+#include "identity_map.hh"
+#include "counter_buffer.hh"
+#include "sharded_counter.hh"
+#include "slow_query.hh"
+#include "dump.hh"
+#include "queue.hh"
+#include "thread_pool.hh"
+#include "parallel_scan.hh"
+#include "async.hh"
+#include "pipeline.hh"
+#include "tail.hh"
+#include "work_queue.hh"
+#include "spool.hh"
 
 namespace mongoxx {
 
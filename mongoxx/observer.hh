@@ -0,0 +1,118 @@
+/* observer.hh
+   Hooks for watching every operation a Session sends to the server.
+
+*/
+
+#ifndef MONGOXX_OBSERVER_HH
+#define MONGOXX_OBSERVER_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "stats.hh"
+
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace mongoxx {
+
+  /**
+   * Describes one operation.  Everything is borrowed from the caller, so
+   * building one never allocates; copy out anything an Observer wants to
+   * keep past its callback.
+   */
+  struct OperationInfo {
+    OperationInfo(char const* operation, std::string const& collection)
+      : operation(operation), collection(&collection), query(0), document(0),
+	limit(0), skip(0), documents(0), bytes_sent(0), bytes_received(0),
+	elapsed_micros(0), failed(false) { }
+
+    char const* operation;          ///< "query", "getMore", "count", "insert", "update",
+				    ///< "upsert", "remove", "findAndModify", "memory"
+				    ///< or "pipeline"
+    std::string const* collection;  ///< the full name of the collection
+    mongo::Query const* query;      ///< the filter and sort, if the operation has one
+    mongo::BSONObj const* document; ///< the inserted document or update, if there is one
+    unsigned int limit;             ///< the query limit, for queries
+    unsigned int skip;              ///< the query skip, for queries
+    size_t documents;               ///< documents sent or received
+    size_t bytes_sent;              ///< bytes of BSON sent to the server
+    size_t bytes_received;          ///< bytes of BSON received, when known
+    unsigned long long elapsed_micros; ///< time taken; zero until finished
+    bool failed;                    ///< true if the operation threw
+  };
+
+  /**
+   * An Observer is told when each operation starts and finishes.  Callbacks
+   * run on the thread making the call, while it waits; keep them quick.
+   * Exceptions thrown by an Observer are swallowed.
+   */
+  class Observer {
+  public:
+    virtual ~Observer() { }
+
+    /**
+     * Called just before an operation is sent.
+     * @param info what is about to happen
+     */
+    virtual void started(OperationInfo const& info) { }
+
+    /**
+     * Called once an operation has finished, successfully or not.
+     * @param info what happened, including elapsed_micros
+     */
+    virtual void finished(OperationInfo const& info) = 0;
+  };
+
+  /**
+   * Times an operation for its scope, recording it to the statistics and
+   * announcing it to observers.  When there is neither, it costs two tests.
+   */
+  class Instrument {
+  public:
+    Instrument(StatsRecorder *stats, std::vector<Observer*> const& observers,
+	       OperationInfo &info)
+      : m_stats(stats), m_observers(observers), m_info(info), m_start(0),
+	m_active(stats or not observers.empty()) {
+      if (not m_active) return;
+      if (m_info.bytes_sent == 0) {
+	if (m_info.query) m_info.bytes_sent += m_info.query->obj.objsize();
+	if (m_info.document) m_info.bytes_sent += m_info.document->objsize();
+      }
+      for (std::vector<Observer*>::const_iterator i = m_observers.begin(); i != m_observers.end(); ++i) {
+	try {
+	  (*i)->started(m_info);
+	} catch (...) { }
+      }
+      m_start = now_micros();
+    }
+
+    ~Instrument() {
+      if (not m_active) return;
+      m_info.elapsed_micros = now_micros() - m_start;
+      m_info.failed = std::uncaught_exception();
+      if (m_stats) {
+	m_stats->record(*m_info.collection, m_info.operation,
+			m_info.elapsed_micros, m_info.documents,
+			m_info.bytes_sent, m_info.bytes_received);
+      }
+      for (std::vector<Observer*>::const_iterator i = m_observers.begin(); i != m_observers.end(); ++i) {
+	try {
+	  (*i)->finished(m_info);
+	} catch (...) { }
+      }
+    }
+
+    bool active() const { return m_active; }
+
+  private:
+    StatsRecorder *m_stats;
+    std::vector<Observer*> const& m_observers;
+    OperationInfo &m_info;
+    unsigned long long m_start;
+    bool m_active;
+  };
+
+};
+
+#endif
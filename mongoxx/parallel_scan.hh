@@ -0,0 +1,263 @@
+/* parallel_scan.hh
+   Scans a collection over several connections at once, split by key range.
+
+*/
+
+#ifndef MONGOXX_PARALLEL_SCAN_HH
+#define MONGOXX_PARALLEL_SCAN_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "filter.hh"
+#include "mapper.hh"
+#include "query.hh"
+#include "queue.hh"
+#include "session.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A ParallelScan reads everything a Query matches as several key ranges
+   * at once, one cursor per range, each on its own connection.  Documents
+   * are decoded on a pool of threads and handed out through a queue, or to
+   * a callback running on the pool.
+   *
+   *   std::tr1::shared_ptr<ParallelScan<Person> > scan =
+   *     session.query(table).parallel_scan(8);
+   *   for (Person person; scan->next(person); ) ...
+   *
+   * The split points come from sampling the matches in key order (a count,
+   * then one skip per point), so the ranges hold about the same number of
+   * documents.  The split field should be indexed.  The ranges only
+   * split values of one type, the first sampled; the first range also
+   * takes every document whose value is of another type, or who lacks
+   * the field, so nothing is missed, but a field of many types balances
+   * poorly.
+   * Documents arrive in no particular order, and the Query's sort, limit
+   * and skip are ignored.
+   */
+  template <typename T>
+  class ParallelScan {
+  public:
+
+    /**
+     * Plans a scan.  Sampling the split points happens here, through the
+     * given Session; the reading itself happens on connections of its own.
+     * @param session the session to sample through and take the host from
+     * @param collection the full name of the collection
+     * @param mapper the mapper to decode with
+     * @param filter restricts what is scanned
+     * @param ranges how many ranges (and connections) to split into
+     * @param field the field to split on
+     * @param decoders how many decoding threads; 0 for one per range
+     * @param capacity how many documents may wait between stages
+     */
+    ParallelScan(Session *session, std::string const& collection,
+		 Mapper<T> const* mapper, Filter const& filter,
+		 unsigned int ranges, std::string const& field = "_id",
+		 unsigned int decoders = 0, size_t capacity = 1000)
+      : m_host(session->host()), m_collection(collection), m_mapper(mapper),
+	m_decoders(decoders ? decoders : (ranges ? ranges : 1)),
+	m_raw(capacity), m_output(capacity), m_queue_sink(&m_output), m_sink(0),
+	m_started(false), m_fetching(0), m_decoding(0), m_documents(0) {
+      split(session, filter, ranges, field);
+    }
+
+    ~ParallelScan() {
+      cancel();
+    }
+
+    /**
+     * Gets the filter each range's cursor runs.
+     * @return one filter per range
+     */
+    std::vector<mongo::BSONObj> const& ranges() const { return m_ranges; }
+
+    /**
+     * Gets the next document, starting the scan if need be.
+     * @param t where to store the object
+     * @return false once every range is exhausted
+     * @throws query_error if any range or decode failed
+     */
+    bool next(T &t) {
+      if (not m_started) start(&m_queue_sink);
+      if (m_output.pop(t)) return true;
+      finish();
+      return false;
+    }
+
+    /**
+     * Runs the whole scan, calling a function on each object from the
+     * decoding threads.  The function is shared, so must be thread safe.
+     * @param f called as f(t) for each object
+     * @return how many objects were delivered
+     * @throws query_error if any range or decode failed
+     * @throws std::logic_error if the scan was already started
+     */
+    template <typename F>
+    size_t run(F &f) {
+      if (m_started) throw std::logic_error("ParallelScan has already been started.");
+      CallbackSink<T, F> sink(f);
+      start(&sink);
+      finish();
+      return m_documents;
+    }
+
+    /**
+     * Stops the scan, dropping whatever hasn't been delivered.  A range
+     * waiting on the server finishes that round trip first.
+     */
+    void cancel() {
+      m_raw.cancel();
+      m_output.cancel();
+      m_threads.join_all();
+    }
+
+    /**
+     * Gets how many documents have been decoded so far.
+     */
+    size_t documents() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_documents;
+    }
+
+  private:
+    void split(Session *session, Filter const& filter, unsigned int ranges,
+	       std::string const& field) {
+      mongo::BSONObj base = filter.to_bson();
+      std::vector<mongo::BSONObj> points;
+      unsigned long long count = ranges > 1 ? session->count(m_collection, base) : 0;
+      for (unsigned int k = 1; k < ranges and count > 0; ++k) {
+	std::tr1::shared_ptr<mongo::DBClientCursor> cursor =
+	  session->execute_query(m_collection, mongo::Query(base).sort(field, 1), 1,
+				 (unsigned int)(count * k / ranges));
+	if (not cursor or not cursor->more()) break;
+	mongo::BSONObj sample = cursor->next();
+	mongo::BSONElement value = sample.getFieldDotted(field);
+	if (value.eoo()) continue;
+	// Ranges can't span types, so split only the first type seen.
+	if (not points.empty() and points.front().firstElement().canonicalType() != value.canonicalType()) break;
+	mongo::BSONObjBuilder point;
+	point.appendAs(value, "");
+	// Duplicate keys would make an empty range.
+	if (not points.empty() and points.back().firstElement().woCompare(value, false) == 0) continue;
+	points.push_back(point.obj());
+      }
+
+      for (size_t k = 0; k <= points.size(); ++k) {
+	if (points.empty()) {
+	  m_ranges.push_back(base.getOwned());
+	  break;
+	}
+	mongo::BSONObj range;
+	if (k > 0) {
+	  mongo::BSONObjBuilder bounds;
+	  bounds.appendAs(points[k - 1].firstElement(), "$gte");
+	  if (k < points.size()) bounds.appendAs(points[k].firstElement(), "$lt");
+	  range = BSON(field << bounds.obj());
+	} else {
+	  // The first range is everything the rest don't take: not just lower
+	  // values, but other types and missing fields, which no $lt matches.
+	  mongo::BSONObjBuilder rest;
+	  rest.appendAs(points[0].firstElement(), "$gte");
+	  range = BSON("$nor" << BSON_ARRAY(BSON(field << rest.obj())));
+	}
+	// $and, since the filter may already constrain the field.
+	if (not base.isEmpty()) range = BSON("$and" << BSON_ARRAY(base << range));
+	m_ranges.push_back(range.getOwned());
+      }
+    }
+
+    void start(Sink<T> *sink) {
+      m_started = true;
+      m_sink = sink;
+      m_fetching = m_ranges.size();
+      m_decoding = m_decoders;
+      for (size_t k = 0; k < m_ranges.size(); ++k) {
+	m_threads.add_thread(new boost::thread(&ParallelScan::fetch, this, k));
+      }
+      for (unsigned int k = 0; k < m_decoders; ++k) {
+	m_threads.add_thread(new boost::thread(&ParallelScan::decode, this));
+      }
+    }
+
+    void finish() {
+      m_threads.join_all();
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (not m_error.empty()) throw query_error("Parallel scan failed: " + m_error);
+    }
+
+    void fetch(size_t range) {
+      try {
+	Session session(m_host);
+	std::tr1::shared_ptr<mongo::DBClientCursor> cursor =
+	  session.execute_query(m_collection, mongo::Query(m_ranges[range]), 0, 0);
+	if (not cursor) throw query_error("no cursor for range " + m_ranges[range].toString());
+	while (cursor->more()) {
+	  if (not m_raw.push(cursor->nextSafe().getOwned())) break;
+	}
+      } catch (std::exception const& e) {
+	fail(e.what());
+      }
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (--m_fetching == 0) m_raw.close();
+    }
+
+    void decode() {
+      try {
+	for (mongo::BSONObj obj; m_raw.pop(obj); ) {
+	  T t;
+	  m_mapper->from_bson(obj, t);
+	  if (not m_sink->deliver(t)) break;
+	  boost::lock_guard<boost::mutex> lock(m_mutex);
+	  ++m_documents;
+	}
+      } catch (std::exception const& e) {
+	fail(e.what());
+      }
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (--m_decoding == 0) m_output.close();
+    }
+
+    void fail(std::string const& message) {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (m_error.empty()) m_error = message;
+      }
+      m_raw.cancel();
+      m_output.cancel();
+    }
+
+    ParallelScan(ParallelScan const&);
+    ParallelScan& operator=(ParallelScan const&);
+
+    std::string m_host;
+    std::string m_collection;
+    Mapper<T> const* m_mapper;
+    unsigned int m_decoders;
+    std::vector<mongo::BSONObj> m_ranges;
+    BoundedQueue<mongo::BSONObj> m_raw;
+    BoundedQueue<T> m_output;
+    QueueSink<T> m_queue_sink;
+    Sink<T> *m_sink;
+    bool m_started;
+    boost::thread_group m_threads;
+    mutable boost::mutex m_mutex;
+    size_t m_fetching;
+    unsigned int m_decoding;
+    size_t m_documents;
+    std::string m_error;
+  };
+
+};
+
+#endif
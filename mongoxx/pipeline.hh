@@ -0,0 +1,357 @@
+/* pipeline.hh
+   Sends several queries and writes down one connection before waiting for
+   any of the replies.
+
+*/
+
+#ifndef MONGOXX_PIPELINE_HH
+#define MONGOXX_PIPELINE_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "mapper.hh"
+#include "memory_collection.hh"
+#include "observer.hh"
+#include "query.hh"
+#include "session.hh"
+#include "update.hh"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A Pipeline batches up independent queries and writes, then sends them
+   * all on the Session's connection before reading any reply, so the lot
+   * costs about one round trip instead of one each.
+   *
+   *   Pipeline pipeline = session.pipeline();
+   *   pipeline.add(people).add(places).execute();
+   *   QueryResult<Person> found = pipeline.result(0, people);
+   *
+   * Queries, findAndModifys among them, are numbered from zero in the
+   * order they were added, not counting writes.  Writes go out in order
+   * with the queries, so a query added after a write sees it.  Only the
+   * first batch of each query is pipelined; later batches are fetched as
+   * the QueryResults are read.  Queries on a collection routed to memory
+   * are answered from memory.
+   */
+  class Pipeline {
+  public:
+    explicit Pipeline(Session *session) : m_session(session), m_executed(false) { }
+
+    /**
+     * Adds a query.
+     * @param query the query
+     * @return this pipeline
+     */
+    template <typename T>
+    Pipeline& add(Query<T> const& query) {
+      Entry entry(read, query.collection());
+      entry.query = query.query();
+      entry.limit = query.m_limit;
+      entry.skip = query.m_skip;
+      entry.deadline_ms = query.m_deadline_ms;
+      entry.token = query.m_token;
+      m_queries.push_back(m_entries.size());
+      m_entries.push_back(entry);
+      return *this;
+    }
+
+    /**
+     * Adds an update of what a query matches.
+     * @param query the query selecting what to update
+     * @param update the update
+     * @param multi update every match, not just the first
+     * @return this pipeline
+     */
+    template <typename T>
+    Pipeline& add(Query<T> const& query, Update const& update, bool multi = false) {
+      Entry entry(write_update, query.collection());
+      entry.query = mongo::Query(query.filters().to_bson());
+      entry.document = update.to_bson();
+      entry.multi = multi;
+      m_entries.push_back(entry);
+      return *this;
+    }
+
+    /**
+     * Adds a Query::find_and_modify().  It is numbered with the queries;
+     * read what it found with modified().
+     * @param query the query selecting what to modify
+     * @param update the update
+     * @param options whether to upsert, remove, or return the new document
+     * @return this pipeline
+     */
+    template <typename T>
+    Pipeline& find_and_modify(Query<T> const& query, Update const& update,
+			      ModifyOptions const& options = ModifyOptions()) {
+      return find_and_modify(query.collection(), query.filters().to_bson(), query.sort(),
+			     update.to_bson(), options);
+    }
+
+    /**
+     * Adds a Session::find_and_modify().  It is numbered with the queries;
+     * read what it found with modified().
+     * @param collection the full name of the collection, "db.collection"
+     * @param filter selects the document
+     * @param sort picks between several matches; empty for any
+     * @param update the update; ignored when removing
+     * @param options whether to upsert, remove, or return the new document
+     * @return this pipeline
+     */
+    Pipeline& find_and_modify(std::string const& collection, mongo::BSONObj const& filter,
+			      mongo::BSONObj const& sort, mongo::BSONObj const& update,
+			      ModifyOptions const& options = ModifyOptions()) {
+      std::string db, name;
+      Session::split_namespace(collection, db, name);
+      Entry entry(read_modify, collection);
+      entry.query = mongo::Query(Session::find_and_modify_command(name, filter, sort, update, options));
+      entry.limit = 1;
+      m_queries.push_back(m_entries.size());
+      m_entries.push_back(entry);
+      return *this;
+    }
+
+    /**
+     * Adds an insert.
+     * @param collection the full name of the collection
+     * @param mapper the mapper to encode with
+     * @param t the object
+     * @return this pipeline
+     */
+    template <typename T>
+    Pipeline& insert(std::string const& collection, Mapper<T> const* mapper, T const& t) {
+      Entry entry(write_insert, collection);
+      entry.document = mapper->to_bson(t);
+      m_entries.push_back(entry);
+      return *this;
+    }
+
+    /**
+     * Sends everything, then waits for the first batch of every query.
+     * Writes to a collection under an acknowledged WriteConcern go out as
+     * write commands, and are acknowledged as the replies are read; the
+     * others are sent and forgotten.
+     * @throws query_error if a query failed
+     * @throws write_error listing the acknowledged writes that failed, by
+     *   their position among everything added
+     * @throws std::logic_error if the pipeline was already executed
+     */
+    void execute() {
+      if (m_executed) throw std::logic_error("Pipeline has already been executed.");
+      m_executed = true;
+      if (m_entries.empty()) return;
+
+      // Held writes are sent, and their replies read, before anything
+      // else goes down the connection: nothing below may wait for a reply
+      // while the pipelined ones are still on the way.
+      for (std::vector<Entry>::const_iterator i = m_entries.begin(); i != m_entries.end(); ++i) {
+	m_session->flush(i->collection);
+      }
+
+      OperationInfo info("pipeline", m_entries.front().collection);
+      info.documents = m_entries.size();
+      Instrument op(m_session->m_stats.get(), m_session->m_observers, info);
+      mongo::DBClientBase *connection = m_session->m_connection.get();
+      for (std::vector<Entry>::iterator i = m_entries.begin(); i != m_entries.end(); ++i) {
+	std::string db, name;
+	Session::split_namespace(i->collection, db, name);
+	if (i->kind != read) m_session->invalidate(i->collection);
+	switch (i->kind) {
+	case read:
+	  if (MemoryCollection *copy = m_session->memory(i->collection)) {
+	    i->memory = copy->find(i->query, i->limit, i->skip);
+	  } else {
+	    i->cursor.reset(new mongo::DBClientCursor(connection, i->collection, i->query.obj,
+						      i->limit, i->skip, 0, 0, 0));
+	    i->sent_micros = now_micros();
+	    i->cursor->initLazy();
+	  }
+	  break;
+	case read_modify:
+	  i->cursor.reset(new mongo::DBClientCursor(connection, db + ".$cmd", i->query.obj,
+						    i->limit, 0, 0, 0, 0));
+	  i->cursor->initLazy();
+	  break;
+	case write_insert:
+	case write_update:
+	  if (m_session->write_concern(i->collection).acknowledged()) {
+	    i->cursor.reset(new mongo::DBClientCursor(connection, db + ".$cmd", write_command(*i, name),
+						      1, 0, 0, 0, 0));
+	    i->cursor->initLazy();
+	  } else if (i->kind == write_insert) {
+	    connection->insert(i->collection, i->document);
+	  } else {
+	    connection->update(i->collection, i->query, i->document, false, i->multi);
+	  }
+	  break;
+	}
+      }
+
+      // Every reply is read, even after a failure; one left on the socket
+      // would be taken as the answer to the Session's next request.
+      std::string failure;
+      std::vector<WriteError> errors;
+      std::string message;
+      for (std::vector<Entry>::iterator i = m_entries.begin(); i != m_entries.end(); ++i) {
+	if (not i->cursor) continue;
+	try {
+	  bool retry = false;
+	  if (not i->cursor->initLazyFinish(retry)) {
+	    if (failure.empty()) failure = "Pipelined query on '" + i->collection + "' failed.";
+	    continue;
+	  }
+	  if (i->kind == read) continue;
+	  if (not i->cursor->more()) {
+	    if (failure.empty()) failure = "Pipelined command on '" + i->collection + "' had no reply.";
+	    continue;
+	  }
+	  mongo::BSONObj reply = i->cursor->nextSafe().getOwned();
+	  i->cursor.reset();
+	  if (i->kind == read_modify) {
+	    i->document = reply;
+	    continue;
+	  }
+	  size_t position = i - m_entries.begin();
+	  if (not reply["ok"].trueValue()) {
+	    errors.push_back(WriteError(position, reply["code"].numberInt(), reply["errmsg"].str(), i->document));
+	    if (message.empty()) message = reply["errmsg"].str();
+	  } else if (Session::write_errors(reply, std::vector<mongo::BSONObj>(), 0, errors, message)) {
+	    errors.back().index = position;
+	    errors.back().document = i->document;
+	  }
+	} catch (std::exception const& e) {
+	  if (failure.empty()) failure = "Pipelined request on '" + i->collection + "' failed: " + e.what();
+	}
+      }
+      if (not failure.empty()) throw query_error(failure);
+      if (not errors.empty()) throw write_error("Pipelined write failed: " + message, errors);
+    }
+
+    /**
+     * Gets how many queries have been added.
+     */
+    size_t size() const { return m_queries.size(); }
+
+    /**
+     * Gets the result of one of the queries.
+     * @param index which query, counting from zero in the order added
+     * @param mapper the mapper to decode with
+     * @return the result
+     * @throws std::logic_error if the pipeline hasn't been executed
+     * @throws std::out_of_range if there is no such query
+     */
+    template <typename T>
+    QueryResult<T> result(size_t index, Mapper<T> const* mapper) const {
+      if (not m_executed) throw std::logic_error("Pipeline has not been executed.");
+      if (index >= m_queries.size()) throw std::out_of_range("No such query in the pipeline.");
+      Entry const& entry = m_entries[m_queries[index]];
+      if (entry.kind == read_modify) throw std::logic_error("That is a findAndModify; use modified().");
+      if (entry.memory) {
+	return QueryResult<T>(entry.memory, mapper, m_session->m_stats,
+			      m_session->m_observers, entry.collection);
+      }
+      QueryResult<T> result(entry.cursor, mapper, m_session->m_stats,
+			    m_session->m_observers, entry.collection);
+      // As Query::result() does, so later batches keep to the deadline
+      // and the token, and server errors are thrown.
+      if (entry.deadline_ms or entry.token) {
+	result.limit(entry.deadline_ms ? entry.sent_micros + entry.deadline_ms * 1000ULL : 0,
+		     entry.token.get(), m_session->host(), entry.collection);
+      }
+      return result;
+    }
+
+    /**
+     * Gets the result of one of the queries, decoded with its mapper.
+     * @param index which query, counting from zero in the order added
+     * @param query the query that was added there
+     * @return the result
+     */
+    template <typename T>
+    QueryResult<T> result(size_t index, Query<T> const& query) const {
+      return result(index, query.mapper());
+    }
+
+    /**
+     * Gets the document one of the findAndModifys found.
+     * @param index which query, counting from zero in the order added
+     * @param document where to store the document
+     * @return false if nothing matched (and nothing was upserted)
+     * @throws write_error if the server refused the findAndModify
+     * @throws std::logic_error if the pipeline hasn't been executed, or
+     *   that query isn't a findAndModify
+     * @throws std::out_of_range if there is no such query
+     */
+    bool modified(size_t index, mongo::BSONObj &document) const {
+      if (not m_executed) throw std::logic_error("Pipeline has not been executed.");
+      if (index >= m_queries.size()) throw std::out_of_range("No such query in the pipeline.");
+      Entry const& entry = m_entries[m_queries[index]];
+      if (entry.kind != read_modify) throw std::logic_error("That is not a findAndModify; use result().");
+      return Session::modified(entry.document, document);
+    }
+
+    /**
+     * Gets the object one of the findAndModifys found.
+     * @param index which query, counting from zero in the order added
+     * @param mapper the mapper to decode with
+     * @param t where to store the object
+     * @return false if nothing matched (and nothing was upserted)
+     */
+    template <typename T>
+    bool modified(size_t index, Mapper<T> const* mapper, T &t) const {
+      mongo::BSONObj document;
+      if (not modified(index, document)) return false;
+      mapper->from_bson(document, t);
+      return true;
+    }
+
+  private:
+    enum Kind { read, read_modify, write_insert, write_update };
+
+    struct Entry {
+      Entry(Kind kind, std::string const& collection)
+	: kind(kind), collection(collection), limit(0), skip(0), multi(false),
+	  deadline_ms(0), sent_micros(0) { }
+      Kind kind;
+      std::string collection;
+      mongo::Query query;
+      mongo::BSONObj document;
+      unsigned int limit;
+      unsigned int skip;
+      bool multi;
+      unsigned int deadline_ms;
+      unsigned long long sent_micros;
+      std::tr1::shared_ptr<CancellationToken> token;
+      std::tr1::shared_ptr<mongo::DBClientCursor> cursor;
+      std::tr1::shared_ptr<MemoryCursor> memory;
+    };
+
+    // The write command sending one pipelined write.
+    static mongo::BSONObj write_command(Entry const& entry, std::string const& name) {
+      if (entry.kind == write_insert) {
+	return Session::write_command("insert", name, BSON_ARRAY(entry.document), true);
+      }
+      return Session::write_command("update", name,
+				    BSON_ARRAY(BSON("q" << entry.query.getFilter() << "u" << entry.document
+						    << "upsert" << false << "multi" << entry.multi)),
+				    true);
+    }
+
+    Session *m_session;
+    bool m_executed;
+    std::vector<Entry> m_entries;
+    std::vector<size_t> m_queries;
+  };
+
+  inline Pipeline Session::pipeline() {
+    return Pipeline(this);
+  }
+
+};
+
+#endif
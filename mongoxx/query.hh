@@ -10,38 +10,100 @@
 #include "session.hh"
 #include "filter.hh"
 #include "update.hh"
+#include "stats.hh"
+#include "observer.hh"
+#include "cancellation.hh"
+#include "batch_sizer.hh"
 
+#include <cstring>
 #include <string>
 #include <stdexcept>
 #include <tr1/memory>
 
 namespace mongoxx {
   class Session;
+  class Pipeline;
+  template <typename T> class ParallelScan;
+  template <typename T> class Tail;
 
   class query_error : public std::runtime_error {
   public:
     explicit query_error(std::string const &message) : runtime_error(message) { }
   };
 
+  /**
+   * Thrown when a query runs past its deadline.
+   */
+  class timeout_error : public query_error {
+  public:
+    explicit timeout_error(std::string const &message) : query_error(message) { }
+  };
+
+  /**
+   * Thrown when a query's CancellationToken is cancelled.
+   */
+  class cancelled_error : public query_error {
+  public:
+    explicit cancelled_error(std::string const &message) : query_error(message) { }
+  };
+
   template <typename T>
   class QueryResult {
   public:
     QueryResult(std::tr1::shared_ptr<mongo::DBClientCursor> const& cursor, Mapper<T> const* mapper)
       : m_cursor(cursor), m_mapper(mapper) { }
 
+    /**
+     * Constructs a QueryResult that reports its fetches and decoding.
+     * @param cursor the cursor to read
+     * @param mapper the mapper to decode with
+     * @param stats where to record statistics; may be NULL
+     * @param observers who to tell about getMore round trips
+     * @param collection the name of the collection the cursor reads
+     */
+    QueryResult(std::tr1::shared_ptr<mongo::DBClientCursor> const& cursor, Mapper<T> const* mapper,
+		std::tr1::shared_ptr<StatsRecorder> const& stats,
+		std::vector<Observer*> const& observers,
+		std::string const& collection)
+      : m_cursor(cursor), m_mapper(mapper) {
+      if (stats or not observers.empty()) {
+	m_tracking.reset(new Tracking(stats, observers, collection));
+      }
+    }
+
+    /**
+     * Constructs a QueryResult over documents held in memory.
+     * @param cursor the documents a MemoryCollection matched
+     * @param mapper the mapper to decode with
+     * @param stats where to record decoding statistics; may be NULL
+     * @param observers passed along for symmetry; memory reads have no getMore
+     * @param collection the name of the collection
+     */
+    QueryResult(std::tr1::shared_ptr<MemoryCursor> const& cursor, Mapper<T> const* mapper,
+		std::tr1::shared_ptr<StatsRecorder> const& stats,
+		std::vector<Observer*> const& observers,
+		std::string const& collection)
+      : m_memory(cursor), m_mapper(mapper) {
+      if (stats or not observers.empty()) {
+	m_tracking.reset(new Tracking(stats, observers, collection));
+      }
+    }
+
     T first() const {
-      if (m_cursor->more()) {
-	mongo::BSONObj obj = m_cursor->next();
-	return m_mapper->from_bson(obj);
+      mongo::BSONObj obj;
+      if (fetch(obj)) {
+	T t;
+	decode(obj, t);
+	return t;
       }
       throw query_error("Query returned no results; cannot return the first element.");
     }
     T one() const { return first(); }
 
     bool next(T &t) const {
-      if (m_cursor->more()) {
-	mongo::BSONObj obj = m_cursor->next();
-	m_mapper->from_bson(obj, t);
+      mongo::BSONObj obj;
+      if (fetch(obj)) {
+	decode(obj, t);
 	return true;
       }
       return false;
@@ -53,13 +115,24 @@ namespace mongoxx {
       return next(t);
     }
 
+    /**
+     * Fetches the next document without decoding it.
+     * @param obj where to store the document
+     * @return true if there was another document
+     */
+    bool next_bson(mongo::BSONObj &obj) const {
+      return fetch(obj);
+    }
+
     bool more() const {
-      return m_cursor->more();
+      return m_memory ? m_memory->more() : m_cursor->more();
     }
     T next() const {
-      if (m_cursor->more()) {
-	mongo::BSONObj obj = m_cursor->next();
-	return m_mapper->from_bson(obj);
+      mongo::BSONObj obj;
+      if (fetch(obj)) {
+	T t;
+	decode(obj, t);
+	return t;
       }
       throw query_error("Query results are empty; cannot return any more results.");
     }
@@ -71,8 +144,160 @@ namespace mongoxx {
     }
 
   private:
+    template <typename U> friend class Query;
+    friend class Pipeline;
+    friend class Session;
+
+    // Lets a sizer pick the size of every later batch.
+    void size_batches(std::tr1::shared_ptr<BatchSizer> const& sizer) {
+      if (m_cursor) m_sizer = sizer;
+    }
+
+    // The deadline and cancellation token of a limited query, shared
+    // between copies.  The server cursor is watched by the token until
+    // the last copy goes away.
+    struct Limits {
+      Limits() : deadline_micros(0), cursor_id(0) { }
+      ~Limits() {
+	if (token and cursor_id) token->unwatch(cursor_id);
+      }
+      unsigned long long deadline_micros;
+      std::tr1::shared_ptr<CancellationToken> token;
+      long long cursor_id;
+      std::string collection;
+    };
+
+    void limit(unsigned long long deadline_micros, CancellationToken const* token,
+	       std::string const& host, std::string const& collection) {
+      if (m_memory or not m_cursor) return;
+      m_limits.reset(new Limits());
+      m_limits->deadline_micros = deadline_micros;
+      m_limits->collection = collection;
+      if (token) {
+	m_limits->token.reset(new CancellationToken(*token));
+	long long cursor_id = m_cursor->getCursorId();
+	if (cursor_id != 0) {
+	  if (not token->watch(host, cursor_id)) {
+	    m_cursor->kill();
+	    throw cancelled_error("Query on '" + collection + "' was cancelled.");
+	  }
+	  m_limits->cursor_id = cursor_id;
+	}
+      }
+    }
+
+    // Called before going back to the server for another batch.
+    void check_limits() const {
+      if (m_limits->token and m_limits->token->cancelled()) {
+	m_cursor->kill();
+	throw cancelled_error("Query on '" + m_limits->collection + "' was cancelled.");
+      }
+      if (m_limits->deadline_micros and now_micros() >= m_limits->deadline_micros) {
+	m_cursor->kill();
+	throw timeout_error("Query on '" + m_limits->collection + "' ran past its deadline.");
+      }
+    }
+
+    // Turns a server error document into an exception.
+    void check_error(mongo::BSONObj const& obj) const {
+      if (std::strcmp(obj.firstElement().fieldName(), "$err") != 0) return;
+      // 50 is the server's ExceededTimeLimit.
+      if (obj["code"].numberInt() == 50) {
+	throw timeout_error("Query on '" + m_limits->collection + "' ran past its deadline.");
+      }
+      throw query_error(obj["$err"].str());
+    }
+
+    // Shared between copies, so that a copy carries on where another left
+    // off.  Only allocated when statistics or observers are on.
+    struct Tracking {
+      Tracking(std::tr1::shared_ptr<StatsRecorder> const& stats,
+	       std::vector<Observer*> const& observers,
+	       std::string const& collection)
+	: stats(stats), observers(observers), collection(collection),
+	  batches(1) { }
+      std::tr1::shared_ptr<StatsRecorder> stats;
+      std::vector<Observer*> observers;
+      std::string collection;
+      unsigned int batches;
+    };
+
+    bool fetch(mongo::BSONObj &obj) const {
+      if (m_memory) return m_memory->next(obj);
+      if (not m_limits) return fetch_next(obj);
+
+      if (m_cursor->objsLeftInBatch() == 0 and m_cursor->getCursorId() != 0) check_limits();
+      bool more;
+      try {
+	more = fetch_next(obj);
+      } catch (std::exception const&) {
+	// A cancel() kills the cursor out from under us; say so.
+	if (m_limits->token and m_limits->token->cancelled()) {
+	  throw cancelled_error("Query on '" + m_limits->collection + "' was cancelled.");
+	}
+	throw;
+      }
+      if (more) check_error(obj);
+      return more;
+    }
+
+    bool fetch_next(mongo::BSONObj &obj) const {
+      if (not m_tracking and not m_sizer) {
+	if (not m_cursor->more()) return false;
+	obj = m_cursor->next();
+	return true;
+      }
+
+      if (m_cursor->objsLeftInBatch() == 0 and m_cursor->getCursorId() != 0) {
+	// more() is about to go back to the server.
+	if (not get_more()) return false;
+      } else if (not m_cursor->more()) {
+	return false;
+      }
+      obj = m_cursor->next();
+      if (m_tracking and m_tracking->stats) {
+	m_tracking->stats->received(m_tracking->collection,
+				    m_tracking->batches > 1 ? "getMore" : "query",
+				    0, obj.objsize());
+      }
+      return true;
+    }
+
+    // Fetches another batch, sized and reported as asked.
+    bool get_more() const {
+      if (m_sizer) m_cursor->setBatchSize(std::max(2, int(m_sizer->size())));
+      unsigned long long start = m_sizer ? now_micros() : 0;
+      bool more;
+      if (m_tracking) {
+	OperationInfo info("getMore", m_tracking->collection);
+	{
+	  Instrument op(m_tracking->stats.get(), m_tracking->observers, info);
+	  more = m_cursor->more();
+	  info.documents = more ? m_cursor->objsLeftInBatch() : 0;
+	}
+	++m_tracking->batches;
+      } else {
+	more = m_cursor->more();
+      }
+      if (m_sizer and more) m_sizer->record(m_cursor->objsLeftInBatch(), now_micros() - start);
+      return more;
+    }
+
+    void decode(mongo::BSONObj const& obj, T &t) const {
+      if (not m_tracking) {
+	m_mapper->from_bson(obj, t);
+	return;
+      }
+      ScopedOperation timer(m_tracking->stats.get(), m_tracking->collection, "decode");
+      m_mapper->from_bson(obj, t);
+    }
+
     std::tr1::shared_ptr<mongo::DBClientCursor> m_cursor;
+    std::tr1::shared_ptr<MemoryCursor> m_memory;
     Mapper<T> const* m_mapper;
+    std::tr1::shared_ptr<Tracking> m_tracking;
+    std::tr1::shared_ptr<Limits> m_limits;
+    std::tr1::shared_ptr<BatchSizer> m_sizer;
   };
 
   template <typename T>
@@ -80,23 +305,110 @@ namespace mongoxx {
   public:
     Query(Session *session, std::string const& collection, Mapper<T> const* mapper)
       : m_session(session), m_collection(collection), m_mapper(mapper),
-	m_limit(0), m_skip(0), m_sort_direction(0) { }
+	m_limit(0), m_skip(0), m_sort_direction(0), m_deadline_ms(0) { }
+
+    std::string const& collection() const { return m_collection; }
+    Mapper<T> const* mapper() const { return m_mapper; }
+    Filter const& filters() const { return m_filters; }
+
+    /**
+     * Copies this query onto another Session, such as a worker's.
+     * @param session the session the copy runs on
+     * @return the copy
+     */
+    Query bind(Session *session) const {
+      Query q(*this);
+      q.m_session = session;
+      return q;
+    }
+
+    /**
+     * Bounds how long the query may take.  The server is asked to give up
+     * after the same time ($maxTimeMS), and the result throws
+     * timeout_error, killing its cursor, rather than go back to the server
+     * once the time is up.  A single round trip is bounded only by the
+     * server and by the Session's socket timeout.
+     * @param ms the time allowed, in milliseconds, from result(); 0 for none
+     */
+    Query deadline(unsigned int ms) const {
+      Query q(*this);
+      q.m_deadline_ms = ms;
+      return q;
+    }
+
+    /**
+     * Lets a CancellationToken stop the query's results.
+     * @param token the token
+     */
+    Query cancel_with(CancellationToken const& token) const {
+      Query q(*this);
+      q.m_token.reset(new CancellationToken(token));
+      return q;
+    }
 
     QueryResult<T> result() const {
-      return m_session->execute_query(m_collection, query(), m_limit, m_skip,
-				      m_mapper);
+      if (not limited()) {
+	return m_session->execute_query(m_collection, query(), m_limit, m_skip,
+					m_mapper);
+      }
+      if (m_token and m_token->cancelled()) {
+	throw cancelled_error("Query on '" + m_collection + "' was cancelled.");
+      }
+      unsigned long long start = now_micros();
+      QueryResult<T> result = m_session->execute_query(m_collection, query(), m_limit, m_skip,
+						       m_mapper);
+      result.limit(m_deadline_ms ? start + m_deadline_ms * 1000ULL : 0, m_token.get(),
+		   m_session->host(), m_collection);
+      return result;
     }
 
     T first() const {
+      if (m_session->cache() and not limited()) {
+	std::vector<T> res = limit(1).all();
+	if (res.empty()) {
+	  throw query_error("Query returned no results; cannot return the first element.");
+	}
+	return res.front();
+      }
       return limit(1).result().first();
     }
 
     T one() const {
-      return limit(1).result().one();
+      return first();
     }
 
     std::vector<T> all() const {
-      return result().all();
+      if (limited()) return result().all();
+      return m_session->query_all(m_collection, query(), m_limit, m_skip,
+				  m_mapper);
+    }
+
+    /**
+     * Plans a scan of everything this query matches, split into key ranges
+     * read over separate connections and decoded on a pool of threads.
+     * Sort, limit and skip don't apply.  See ParallelScan.
+     * @param ranges how many ranges (and connections) to use
+     * @param field the indexed field to split on
+     * @return the scan, not yet started
+     */
+    std::tr1::shared_ptr<ParallelScan<T> > parallel_scan(unsigned int ranges,
+							 std::string const& field = "_id") const {
+      return std::tr1::shared_ptr<ParallelScan<T> >(
+	new ParallelScan<T>(m_session, m_collection, m_mapper, m_filters, ranges, field));
+    }
+
+    /**
+     * Follows this query's capped collection, delivering new matches as
+     * they are inserted.  Sort, limit and skip don't apply.  See Tail.
+     * @param after a position from Tail::last() to carry on from; empty to
+     *   start with what is already there
+     * @param field the field positions are taken from
+     * @return the tail, not yet started
+     */
+    std::tr1::shared_ptr<Tail<T> > tail(mongo::BSONObj const& after = mongo::BSONObj(),
+					std::string const& field = "_id") const {
+      return std::tr1::shared_ptr<Tail<T> >(
+	new Tail<T>(m_session->host(), m_collection, m_mapper, m_filters, after, field));
     }
 
     void remove_all() const {
@@ -108,9 +420,9 @@ namespace mongoxx {
     }
 
     Query filter(Filter const& by) const {
-      return Query(m_session, m_collection, m_mapper,
-		   (m_filters, by), m_limit, m_skip,
-		   m_sort_by, m_sort_direction);
+      Query q(*this);
+      q.m_filters = (m_filters, by);
+      return q;
     }
 
     void update(Update const& update) const {
@@ -121,48 +433,106 @@ namespace mongoxx {
       return update(Update("$set", remove_id(m_mapper->to_bson(t))));
     }
 
+    /**
+     * Updates the first object this query matches, in its sort order, and
+     * returns it, atomically and in one round trip.  Where two clients race
+     * for the same object, only one of them gets it.
+     * @param update the update
+     * @param options whether to upsert, and which version to return
+     * @return the object, as found or as updated
+     * @throws query_error if nothing matched (and nothing was upserted)
+     */
+    T find_and_modify(Update const& update, ModifyOptions const& options = ModifyOptions()) const {
+      T t;
+      if (not find_and_modify(update, t, options)) {
+	throw query_error("Query matched nothing; cannot find and modify.");
+      }
+      return t;
+    }
+
+    /**
+     * Updates the first object this query matches, in its sort order, and
+     * returns it, atomically and in one round trip.
+     * @param update the update
+     * @param t where to store the object, as found or as updated
+     * @param options whether to upsert, and which version to return
+     * @return false if nothing matched (and nothing was upserted)
+     */
+    bool find_and_modify(Update const& update, T &t,
+			 ModifyOptions const& options = ModifyOptions()) const {
+      mongo::BSONObj found;
+      if (not m_session->find_and_modify(m_collection, m_filters.to_bson(), sort(),
+					 update.to_bson(), options, found)) {
+	return false;
+      }
+      m_mapper->from_bson(found, t);
+      return true;
+    }
+
+    /**
+     * Removes the first object this query matches, in its sort order, and
+     * returns it, atomically and in one round trip.
+     * @param t where to store the object
+     * @return false if nothing matched
+     */
+    bool find_and_remove(T &t) const {
+      ModifyOptions options;
+      options.remove = true;
+      mongo::BSONObj found;
+      if (not m_session->find_and_modify(m_collection, m_filters.to_bson(), sort(),
+					 mongo::BSONObj(), options, found)) {
+	return false;
+      }
+      m_mapper->from_bson(found, t);
+      return true;
+    }
+
     Query skip(unsigned int N) const {
-      return Query(m_session, m_collection, m_mapper, m_filters, m_limit, N,
-		   m_sort_by, m_sort_direction);
+      Query q(*this);
+      q.m_skip = N;
+      return q;
     }
 
     Query limit(unsigned int N) const {
-      return Query(m_session, m_collection, m_mapper, m_filters, N, m_skip,
-		   m_sort_by, m_sort_direction);
+      Query q(*this);
+      q.m_limit = N;
+      return q;
     }
 
     template <typename U>
     Query ascending(U T::*field) const {
-      return Query(m_session, m_collection, m_mapper, m_filters, m_limit,
-		   m_skip, m_mapper->lookup_field(field), 1);
+      return sorted(m_mapper->lookup_field(field), 1);
     }
 
     template <typename U>
     Query descending(U T::*field) const {
-      return Query(m_session, m_collection, m_mapper, m_filters, m_limit,
-		   m_skip, m_mapper->lookup_field(field), -1);
+      return sorted(m_mapper->lookup_field(field), -1);
     }
 
     template <typename U>
     Query ascending(U (T::*getter)()) const {
-      return Query(m_session, m_collection, m_mapper, m_filters, m_limit,
-		   m_skip, m_mapper->lookup_field(getter), 1);
+      return sorted(m_mapper->lookup_field(getter), 1);
     }
 
     template <typename U>
     Query descending(U (T::*getter)()) const {
-      return Query(m_session, m_collection, m_mapper, m_filters, m_limit,
-		   m_skip, m_mapper->lookup_field(getter), -1);
+      return sorted(m_mapper->lookup_field(getter), -1);
     }
 		   
 
   private:
-    Query(Session *session, std::string const& collection, Mapper<T> const* mapper,
-	  Filter const& filters, unsigned int limit, unsigned int skip,
-	  std::string sort_by, int sort_direction)
-      : m_session(session), m_collection(collection), m_mapper(mapper),
-	m_filters(filters), m_limit(limit), m_skip(skip),
-	m_sort_by(sort_by), m_sort_direction(sort_direction) { }
+    friend class Pipeline;
+
+    Query sorted(std::string const& sort_by, int sort_direction) const {
+      Query q(*this);
+      q.m_sort_by = sort_by;
+      q.m_sort_direction = sort_direction;
+      return q;
+    }
+
+    bool limited() const {
+      return m_deadline_ms != 0 or m_token;
+    }
 
     Session *m_session;
     std::string m_collection;
@@ -172,24 +542,31 @@ namespace mongoxx {
     unsigned int m_skip;
     std::string m_sort_by;
     int m_sort_direction;
+    unsigned int m_deadline_ms;
+    std::tr1::shared_ptr<CancellationToken> m_token;
 
     mongo::Query query() const {
       mongo::Query query(m_filters.to_bson());
       if (m_sort_direction != 0) {
 	query.sort(m_sort_by, m_sort_direction);
       }
+      if (m_deadline_ms != 0) {
+	query.maxTimeMs(m_deadline_ms);
+      }
       return query;
     }
 
+    mongo::BSONObj sort() const {
+      if (m_sort_direction == 0) return mongo::BSONObj();
+      mongo::BSONObjBuilder sort;
+      sort.append(m_sort_by, m_sort_direction);
+      return sort.obj();
+    }
+
     mongo::BSONObj remove_id(mongo::BSONObj const& base) const {
+      mongo::BSONObjBuilder id;
       mongo::BSONObjBuilder builder;
-      mongo::BSONObj filter = m_filters.to_bson();
-      std::set<std::string> fields;
-      base.getFieldNames(fields);
-      for (std::set<std::string>::const_iterator i = fields.begin(); i != fields.end(); ++i) {
-	if (*i == "_id") continue;
-	builder.append(base[*i]);
-      }
+      split_id(base, id, builder);
       return builder.obj();
     }
 
@@ -0,0 +1,161 @@
+/* queue.hh
+   A bounded, closable queue for handing work between threads, and sinks
+   for a background thread to deliver into.
+
+*/
+
+#ifndef MONGOXX_QUEUE_HH
+#define MONGOXX_QUEUE_HH
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <deque>
+
+namespace mongoxx {
+
+  /**
+   * A BoundedQueue passes values from producer threads to consumer threads.
+   * Producers block while it is full, which keeps a fast producer from
+   * running far ahead of a slow consumer.  Once closed, it refuses new
+   * values and consumers drain what is left.
+   *
+   *   BoundedQueue<mongo::BSONObj> queue(1000);
+   *   // producers: queue.push(obj); ... queue.close();
+   *   // consumers: for (mongo::BSONObj obj; queue.pop(obj); ) ...
+   */
+  template <typename T>
+  class BoundedQueue {
+  public:
+
+    /**
+     * Constructs an empty queue.
+     * @param capacity the most values it holds before push() blocks
+     */
+    explicit BoundedQueue(size_t capacity)
+      : m_capacity(capacity ? capacity : 1), m_closed(false) { }
+
+    /**
+     * Adds a value, waiting for room if the queue is full.
+     * @param t the value
+     * @return false, dropping the value, if the queue is closed
+     */
+    bool push(T const& t) {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (m_values.size() >= m_capacity and not m_closed) m_not_full.wait(lock);
+      if (m_closed) return false;
+      m_values.push_back(t);
+      m_not_empty.notify_one();
+      return true;
+    }
+
+    /**
+     * Takes the oldest value, waiting for one if the queue is empty.
+     * @param t where to store the value
+     * @return false if the queue is closed and empty
+     */
+    bool pop(T &t) {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (m_values.empty() and not m_closed) m_not_empty.wait(lock);
+      if (m_values.empty()) return false;
+      t = m_values.front();
+      m_values.pop_front();
+      m_not_full.notify_one();
+      return true;
+    }
+
+    /**
+     * Stops accepting values, and wakes everyone waiting.
+     */
+    void close() {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_closed = true;
+      m_not_empty.notify_all();
+      m_not_full.notify_all();
+    }
+
+    /**
+     * Closes the queue and drops what is in it, so consumers stop at once.
+     */
+    void cancel() {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_closed = true;
+      m_values.clear();
+      m_not_empty.notify_all();
+      m_not_full.notify_all();
+    }
+
+    bool closed() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_closed;
+    }
+
+    size_t size() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_values.size();
+    }
+
+  private:
+    BoundedQueue(BoundedQueue const&);
+    BoundedQueue& operator=(BoundedQueue const&);
+
+    size_t m_capacity;
+    bool m_closed;
+    std::deque<T> m_values;
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_not_empty;
+    boost::condition_variable m_not_full;
+  };
+
+  /**
+   * Somewhere a background thread hands each object it produces: a queue
+   * for a consumer, or a callback.
+   */
+  template <typename T>
+  struct Sink {
+    virtual ~Sink() { }
+    /**
+     * Hands over an object.
+     * @return false if the sink takes no more
+     */
+    virtual bool deliver(T const& t) = 0;
+  };
+
+  template <typename T>
+  struct QueueSink : public Sink<T> {
+    QueueSink(BoundedQueue<T> *queue) : queue(queue) { }
+    bool deliver(T const& t) { return queue->push(t); }
+    BoundedQueue<T> *queue;
+  };
+
+  template <typename T, typename F>
+  struct CallbackSink : public Sink<T> {
+    CallbackSink(F &f) : f(&f) { }
+    bool deliver(T const& t) { (*f)(t); return true; }
+    F *f;
+  };
+
+  /**
+   * Waits out a background thread's retry interval, waking early if it is
+   * told to stop.
+   * @param mutex guards stopping
+   * @param wakeup notified when stopping is set
+   * @param stopping the thread's stop flag
+   * @param ms how long to wait
+   * @return false if stopping
+   */
+  inline bool wait_to_retry(boost::mutex &mutex, boost::condition_variable &wakeup,
+			    bool const& stopping, unsigned int ms) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::system_time until = boost::get_system_time() + boost::posix_time::milliseconds(ms);
+    while (not stopping) {
+      if (not wakeup.timed_wait(lock, until)) break;
+    }
+    return not stopping;
+  }
+
+};
+
+#endif
@@ -10,20 +10,107 @@
 #include "mongo/client/dbclient.h"
 #include "mongo/client/connpool.h"
 
+#include "batch_sizer.hh"
+#include "cache.hh"
+#include "memory_collection.hh"
+#include "stats.hh"
+#include "observer.hh"
+#include "thread_pool.hh"
+#include "update.hh"
+#include "write_concern.hh"
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 #include <tr1/memory>
 
 namespace mongoxx {
+  class Pipeline;
   template <typename T> class Mapper;
   template <typename T> class Inserter;
   template <typename T> class Query;
   template <typename T> class QueryResult;
+  template <typename T> class SpoolingInserter;
   template <typename T> class Table;
 
+  /**
+   * One document's failure within a batched write.
+   */
+  struct WriteError {
+    WriteError(size_t index, int code, std::string const& message,
+	       mongo::BSONObj const& document = mongo::BSONObj())
+      : index(index), code(code), message(message), document(document) { }
+    size_t index;             ///< position of the document within the batch
+    int code;                 ///< the server's error code
+    std::string message;      ///< the server's error message
+    mongo::BSONObj document;  ///< the failed document or operation, where known
+  };
+
+  /**
+   * Thrown when the server reports that a batched write failed.
+   */
+  class write_error : public std::runtime_error {
+  public:
+    explicit write_error(std::string const &message,
+			 std::vector<WriteError> const& errors = std::vector<WriteError>())
+      : runtime_error(message), m_errors(errors) { }
+    ~write_error() throw() { }
+
+    /**
+     * Gets the failures of individual documents.
+     * @return the failed documents, in batch order
+     */
+    std::vector<WriteError> const& errors() const { return m_errors; }
+
+  private:
+    std::vector<WriteError> m_errors;
+  };
+
+  /**
+   * Splits a document into its _id and the rest of its fields in one pass.
+   * @param object the document to split
+   * @param id receives the _id field, if there is one
+   * @param rest receives every other field
+   */
+  inline void split_id(mongo::BSONObj const& object, mongo::BSONObjBuilder &id,
+		       mongo::BSONObjBuilder &rest) {
+    for (mongo::BSONObjIterator i(object); i.more(); ) {
+      mongo::BSONElement element = i.next();
+      if (std::strcmp(element.fieldName(), "_id") == 0) {
+	id.append(element);
+      } else {
+	rest.append(element);
+      }
+    }
+  }
+
   class Session {
   public:
-    Session(std::string const& host) : m_host(host), m_connection(host) { }
+    /**
+     * Connects to a server.
+     * @param host the server
+     * @param socket_timeout_ms how long any one read from the server may
+     *   take before it fails, in milliseconds; 0 waits forever.  A read
+     *   that times out leaves the connection broken, so the Session should
+     *   be thrown away.
+     */
+    Session(std::string const& host, unsigned int socket_timeout_ms = 0)
+      : m_host(host), m_connection(host, socket_timeout_ms / 1000.0) { }
     ~Session() {
+      try {
+	flush();
+      } catch (...) {
+	// Too late to tell anyone; call flush() first to find out.
+      }
       // ScopedDbConnection prints a warning message when it goes out of scope
       // if you do not call .done().
       // I'm sure there's a very good reason for this, I just can't conceive of
@@ -32,6 +119,11 @@ namespace mongoxx {
     }
 
 
+    /**
+     * Gets the server this Session talks to, for opening more connections.
+     */
+    std::string const& host() const { return m_host; }
+
     template <typename T>
     Query<T> query(std::string const& collection, Mapper<T> const* mapper) {
       return Query<T>(this, collection, mapper);
@@ -42,6 +134,12 @@ namespace mongoxx {
       return Query<T>(this, table.collection(), table.mapper());
     }
 
+    /**
+     * Starts a batch of queries and writes to send without waiting on each
+     * reply.  See Pipeline, in pipeline.hh.
+     */
+    Pipeline pipeline();
+
     template <typename T>
     Inserter<T> inserter(std::string const& collection, Mapper<T> const* mapper) {
       return Inserter<T>(this, collection, mapper);
@@ -52,43 +150,682 @@ namespace mongoxx {
       return Inserter<T>(this, table.collection(), table.mapper());
     }
 
+    /**
+     * Turns on the query result cache.  Results of Query::all(), first() and
+     * one() are served from the cache until they expire, are evicted, or a
+     * write through this Session touches their collection.
+     * @param max_documents the most decoded documents to hold at once
+     * @param ttl_ms how long a result may be served, in milliseconds
+     */
+    void enable_cache(size_t max_documents, unsigned int ttl_ms) {
+      m_cache.reset(new QueryCache(max_documents, ttl_ms));
+    }
+
+    /**
+     * Turns off the query result cache, dropping its contents.
+     */
+    void disable_cache() {
+      m_cache.reset();
+    }
+
+    /**
+     * Gets the query result cache.
+     * @return the cache, or NULL if it is turned off
+     */
+    QueryCache* cache() const { return m_cache.get(); }
+
+    /**
+     * Gets the query result cache counters.
+     * @return the counters; all zero if the cache is turned off
+     */
+    QueryCache::Stats cache_stats() const {
+      return m_cache ? m_cache->stats() : QueryCache::Stats();
+    }
+
+    /**
+     * Turns on statistics collection.  While it is off, the only cost to an
+     * operation is a pointer test.
+     */
+    void enable_stats() {
+      if (not m_stats) m_stats.reset(new StatsRecorder());
+    }
+
+    /**
+     * Turns off statistics collection, dropping what was collected.
+     */
+    void disable_stats() {
+      m_stats.reset();
+    }
+
+    /**
+     * Gets the statistics recorder.
+     * @return the recorder, or NULL if statistics are turned off
+     */
+    StatsRecorder* recorder() const { return m_stats.get(); }
+
+    /**
+     * Gets a snapshot of the statistics collected so far.
+     * @return the statistics; empty if they are turned off
+     */
+    SessionStats stats() const {
+      return m_stats ? m_stats->snapshot() : SessionStats();
+    }
+
+    /**
+     * Zeroes the statistics collected so far.
+     */
+    void reset_stats() {
+      if (m_stats) m_stats->reset();
+    }
+
+    /**
+     * Registers an Observer to be told about every operation.  The Session
+     * does not take ownership.
+     * @param observer the observer to add
+     */
+    void add_observer(Observer *observer) {
+      m_observers.push_back(observer);
+    }
+
+    /**
+     * Unregisters an Observer.
+     * @param observer the observer to remove
+     */
+    void remove_observer(Observer *observer) {
+      m_observers.erase(std::remove(m_observers.begin(), m_observers.end(), observer),
+			m_observers.end());
+    }
+
+    std::vector<Observer*> const& observers() const { return m_observers; }
+
+    /**
+     * Serves every query on a collection from a MemoryCollection instead of
+     * the server.  Writes still go to the server, and mark the copy stale.
+     * @param memory the in-memory copy; routes the collection it names
+     */
+    void route_to_memory(std::tr1::shared_ptr<MemoryCollection> const& memory) {
+      m_memory[memory->collection()] = memory;
+    }
+
+    /**
+     * Sends queries on a collection back to the server.
+     * @param collection the full name of the collection
+     */
+    void unroute(std::string const& collection) {
+      m_memory.erase(collection);
+    }
+
+    /**
+     * Gets the in-memory copy a collection is routed to.
+     * @param collection the full name of the collection
+     * @return the copy, or NULL if the collection goes to the server
+     */
+    MemoryCollection* memory(std::string const& collection) const {
+      if (m_memory.empty()) return 0;
+      std::map<std::string, std::tr1::shared_ptr<MemoryCollection> >::const_iterator i =
+	m_memory.find(collection);
+      return i == m_memory.end() ? 0 : i->second.get();
+    }
+
+    /**
+     * Reloads a routed collection's in-memory copy through this Session.
+     * @param collection the full name of the collection
+     * @throws std::invalid_argument if the collection isn't routed to memory
+     */
+    void refresh(std::string const& collection) {
+      MemoryCollection *copy = memory(collection);
+      if (not copy) {
+	throw std::invalid_argument("Collection '" + collection + "' is not held in memory.");
+      }
+      std::tr1::shared_ptr<mongo::DBClientCursor> cursor =
+	execute_query(collection, mongo::Query(copy->filter()), 0, 0);
+      if (cursor) copy->load(*cursor);
+    }
+
+    /**
+     * Sets how writes are acknowledged on every collection without a
+     * WriteConcern of its own.  Sends any writes held back first.
+     * @param concern the write concern
+     */
+    void write_concern(WriteConcern const& concern) {
+      flush();
+      m_concern = concern;
+    }
+
+    /**
+     * Sets how writes to one collection are acknowledged.  Sends any of
+     * its writes held back first.
+     * @param collection the full name of the collection
+     * @param concern the write concern
+     */
+    void write_concern(std::string const& collection, WriteConcern const& concern) {
+      flush(collection);
+      m_concerns[collection] = concern;
+    }
+
+    /**
+     * Gets how writes to a collection are acknowledged.
+     * @param collection the full name of the collection
+     */
+    WriteConcern const& write_concern(std::string const& collection) const {
+      std::map<std::string, WriteConcern>::const_iterator i = m_concerns.find(collection);
+      return i == m_concerns.end() ? m_concern : i->second;
+    }
+
+    /**
+     * Sizes the batches of writes to a collection with a BatchSizer: the
+     * chunks of Inserter::insert_all(), and the batches of acknowledged
+     * and batched writes.
+     * @param collection the full name of the collection
+     * @param sizer the sizer; NULL to go back to fixed sizes
+     */
+    void size_writes(std::string const& collection, std::tr1::shared_ptr<BatchSizer> const& sizer) {
+      if (sizer) m_write_sizers[collection] = sizer;
+      else m_write_sizers.erase(collection);
+    }
+
+    /**
+     * Sizes the batches queries on a collection fetch with a BatchSizer,
+     * the first batch and every getMore.
+     * @param collection the full name of the collection
+     * @param sizer the sizer; NULL to let the server choose
+     */
+    void size_reads(std::string const& collection, std::tr1::shared_ptr<BatchSizer> const& sizer) {
+      if (sizer) m_read_sizers[collection] = sizer;
+      else m_read_sizers.erase(collection);
+    }
+
+    /**
+     * Gets the sizer for writes to a collection.
+     * @return the sizer, or NULL for fixed sizes
+     */
+    BatchSizer* write_sizer(std::string const& collection) const {
+      return find_sizer(m_write_sizers, collection).get();
+    }
+
+    /**
+     * Gets the sizer for reads from a collection.
+     * @return the sizer, or NULL to let the server choose
+     */
+    BatchSizer* read_sizer(std::string const& collection) const {
+      return find_sizer(m_read_sizers, collection).get();
+    }
+
+    /**
+     * Sends every write held back by WriteConcern::every(), and waits for
+     * the server to acknowledge them.
+     * @throws write_error listing the writes that failed
+     */
+    void flush() {
+      while (not m_held.empty()) flush(m_held.begin()->first);
+    }
+
+    /**
+     * Sends the writes to one collection held back by WriteConcern::every().
+     * @param collection the full name of the collection
+     * @throws write_error listing the writes that failed
+     */
+    void flush(std::string const& collection) {
+      if (m_held.empty()) return;
+      std::map<std::string, Held>::iterator i = m_held.find(collection);
+      if (i == m_held.end()) return;
+      Held held;
+      std::swap(held, i->second);
+      m_held.erase(i);
+      send_writes(collection, held.command, held.operation, held.operations, false);
+    }
+
     template <typename T>
     QueryResult<T> execute_query(std::string const& collection,
 				 mongo::Query const& query,
 				 unsigned int limit, unsigned int skip,
 				 Mapper<T> const* mapper) {
-      return QueryResult<T>(execute_query(collection, query, limit, skip),
-			    mapper);
+      if (MemoryCollection *copy = memory(collection)) {
+	OperationInfo info("memory", collection);
+	info.query = &query;
+	info.limit = limit;
+	info.skip = skip;
+	Instrument op(m_stats.get(), m_observers, info);
+	std::tr1::shared_ptr<MemoryCursor> cursor = copy->find(query, limit, skip);
+	info.documents = cursor->size();
+	return QueryResult<T>(cursor, mapper, m_stats, m_observers, collection);
+      }
+      QueryResult<T> result(execute_query(collection, query, limit, skip),
+			    mapper, m_stats, m_observers, collection);
+      std::tr1::shared_ptr<BatchSizer> sizer = find_sizer(m_read_sizers, collection);
+      if (sizer) result.size_batches(sizer);
+      return result;
+    }
+
+    template <typename T>
+    std::vector<T> query_all(std::string const& collection,
+			     mongo::Query const& query,
+			     unsigned int limit, unsigned int skip,
+			     Mapper<T> const* mapper) {
+      if (not m_cache or memory(collection)) {
+	return execute_query(collection, query, limit, skip, mapper).all();
+      }
+      std::string key = QueryCache::key(collection, query, limit, skip, mapper);
+      std::vector<T> res;
+      if (not m_cache->get(key, collection, res)) {
+	res = execute_query(collection, query, limit, skip, mapper).all();
+	m_cache->put(key, collection, res);
+      }
+      return res;
+    }
+
+    /**
+     * Counts the documents matching a filter.
+     * @param collection the full name of the collection
+     * @param filter the filter
+     * @return how many documents match
+     */
+    unsigned long long count(std::string const& collection, mongo::BSONObj const& filter) {
+      flush(collection);
+      OperationInfo info("count", collection);
+      mongo::Query query(filter);
+      info.query = &query;
+      Instrument op(m_stats.get(), m_observers, info);
+      unsigned long long n = m_connection->count(collection, filter);
+      info.documents = 1;
+      return n;
     }
 
     void insert(std::string const& collection, mongo::BSONObj const& object) {
+      insert(collection, object, write_concern(collection));
+    }
+
+    void insert(std::string const& collection, mongo::BSONObj const& object,
+		WriteConcern const& concern) {
+      invalidate(collection);
+      if (concern.acknowledged()) {
+	write(collection, "insert", "insert", std::vector<mongo::BSONObj>(1, object), true, concern);
+	return;
+      }
+      flush(collection);
+      OperationInfo info("insert", collection);
+      info.document = &object;
+      info.documents = 1;
+      Instrument op(m_stats.get(), m_observers, info);
       m_connection->insert(collection, object);
     }
 
+    /**
+     * Inserts many documents in one message.
+     * @param collection the full name of the collection
+     * @param objects the documents, in order
+     * @param ordered if false, the server carries on past a failed document
+     */
+    void insert(std::string const& collection, std::vector<mongo::BSONObj> const& objects,
+		bool ordered = true) {
+      insert(collection, objects, ordered, write_concern(collection));
+    }
+
+    void insert(std::string const& collection, std::vector<mongo::BSONObj> const& objects,
+		bool ordered, WriteConcern const& concern) {
+      if (objects.empty()) return;
+      invalidate(collection);
+      if (concern.acknowledged()) {
+	write(collection, "insert", "insert", objects, ordered, concern);
+	return;
+      }
+      flush(collection);
+      BatchSizer *sizer = write_sizer(collection);
+      OperationInfo info("insert", collection);
+      info.documents = objects.size();
+      for (std::vector<mongo::BSONObj>::const_iterator i = objects.begin(); i != objects.end(); ++i) {
+	info.bytes_sent += i->objsize();
+      }
+      Instrument op(m_stats.get(), m_observers, info);
+      unsigned long long start = sizer ? now_micros() : 0;
+      int flags = ordered ? 0 : int(mongo::InsertOption_ContinueOnError);
+      // Split where the documents would outgrow a message, as send_writes
+      // does for the write commands.
+      std::vector<mongo::BSONObj>::const_iterator begin = objects.begin();
+      while (begin != objects.end()) {
+	std::vector<mongo::BSONObj>::const_iterator end = begin;
+	for (int bytes = 0; end != objects.end(); ++end) {
+	  if (end != begin and bytes + end->objsize() > max_write_bytes) break;
+	  bytes += end->objsize();
+	}
+	if (begin == objects.begin() and end == objects.end()) {
+	  m_connection->insert(collection, objects, flags);
+	} else {
+	  m_connection->insert(collection, std::vector<mongo::BSONObj>(begin, end), flags);
+	}
+	begin = end;
+      }
+      // Unacknowledged, so this only times handing the batch to the socket;
+      // that still slows when the server stops reading.
+      if (sizer) sizer->record(objects.size(), now_micros() - start);
+    }
+
     void remove_all(std::string const& collection, mongo::Query const& query) {
+      invalidate(collection);
+      WriteConcern const& concern = write_concern(collection);
+      if (concern.acknowledged()) {
+	write(collection, "delete", "remove",
+	      std::vector<mongo::BSONObj>(1, BSON("q" << query.getFilter() << "limit" << 0)),
+	      true, concern);
+	return;
+      }
+      flush(collection);
+      OperationInfo info("remove", collection);
+      info.query = &query;
+      Instrument op(m_stats.get(), m_observers, info);
       m_connection->remove(collection, query, false);
     }
 
     void remove_one(std::string const& collection, mongo::Query const& query) {
+      invalidate(collection);
+      WriteConcern const& concern = write_concern(collection);
+      if (concern.acknowledged()) {
+	write(collection, "delete", "remove",
+	      std::vector<mongo::BSONObj>(1, BSON("q" << query.getFilter() << "limit" << 1)),
+	      true, concern);
+	return;
+      }
+      flush(collection);
+      OperationInfo info("remove", collection);
+      info.query = &query;
+      info.limit = 1;
+      Instrument op(m_stats.get(), m_observers, info);
       m_connection->remove(collection, query, true);
     }
 
     std::tr1::shared_ptr<mongo::DBClientCursor>
     execute_query(std::string const& collection, mongo::Query const& query, unsigned int limit, unsigned int skip) {
-      return std::tr1::shared_ptr<mongo::DBClientCursor>(m_connection->query(collection, query, limit, skip).release());
+      flush(collection);
+      BatchSizer *sizer = read_sizer(collection);
+      OperationInfo info("query", collection);
+      info.query = &query;
+      info.limit = limit;
+      info.skip = skip;
+      Instrument op(m_stats.get(), m_observers, info);
+      unsigned long long start = sizer ? now_micros() : 0;
+      std::tr1::shared_ptr<mongo::DBClientCursor> cursor(
+	m_connection->query(collection, query, limit, skip, 0, 0, sizer ? read_batch(*sizer) : 0).release());
+      if (op.active() and cursor) info.documents = cursor->objsLeftInBatch();
+      if (sizer and cursor) sizer->record(cursor->objsLeftInBatch(), now_micros() - start);
+      return cursor;
     }
 
-    void execute_update(std::string const& collection, mongo::Query const& query, mongo::BSONObj const& update) {
-      m_connection->update(collection, query, update);
+    void execute_update(std::string const& collection, mongo::Query const& query, mongo::BSONObj const& update,
+			bool multi = false) {
+      invalidate(collection);
+      WriteConcern const& concern = write_concern(collection);
+      if (concern.acknowledged()) {
+	write(collection, "update", "update",
+	      std::vector<mongo::BSONObj>(1, BSON("q" << query.getFilter() << "u" << update
+						  << "upsert" << false << "multi" << multi)),
+	      true, concern);
+	return;
+      }
+      flush(collection);
+      OperationInfo info("update", collection);
+      info.query = &query;
+      info.document = &update;
+      info.documents = 1;
+      Instrument op(m_stats.get(), m_observers, info);
+      m_connection->update(collection, query, update, false, multi);
     }
 
     void execute_upsert(std::string const& collection, mongo::Query const& query, mongo::BSONObj const& update) {
+      execute_upsert(collection, query, update, write_concern(collection));
+    }
+
+    void execute_upsert(std::string const& collection, mongo::Query const& query, mongo::BSONObj const& update,
+			WriteConcern const& concern) {
+      invalidate(collection);
+      if (concern.acknowledged()) {
+	write(collection, "update", "upsert",
+	      std::vector<mongo::BSONObj>(1, BSON("q" << query.getFilter() << "u" << update
+						  << "upsert" << true << "multi" << false)),
+	      true, concern);
+	return;
+      }
+      flush(collection);
+      OperationInfo info("upsert", collection);
+      info.query = &query;
+      info.document = &update;
+      info.documents = 1;
+      Instrument op(m_stats.get(), m_observers, info);
       m_connection->update(collection, query, update, true /* upsert */);
     }
+
+    /**
+     * Sends many upserts through the server's batched update command.
+     * @param collection the full name of the collection, "db.collection"
+     * @param upserts (filter, update) pairs, in order
+     * @param ordered if true, stop at the first failure
+     * @throws write_error listing every upsert that failed, by position
+     */
+    void execute_upserts(std::string const& collection,
+			 std::vector<std::pair<mongo::BSONObj, mongo::BSONObj> > const& upserts,
+			 bool ordered = true) {
+      invalidate(collection);
+      flush(collection);
+      std::vector<mongo::BSONObj> operations;
+      operations.reserve(upserts.size());
+      for (size_t k = 0; k < upserts.size(); ++k) {
+	operations.push_back(BSON("q" << upserts[k].first << "u" << upserts[k].second
+				  << "upsert" << true << "multi" << false));
+      }
+      send_writes(collection, "update", "upsert", operations, ordered);
+    }
+
+    /**
+     * Finds a document and updates or removes it, atomically, in one round
+     * trip.
+     * @param collection the full name of the collection, "db.collection"
+     * @param filter selects the document
+     * @param sort picks between several matches; empty for any
+     * @param update the update; ignored when removing
+     * @param options whether to upsert, remove, or return the new document
+     * @param found where to store the document
+     * @return false if nothing matched (and nothing was upserted)
+     * @throws write_error if the server refused
+     */
+    bool find_and_modify(std::string const& collection, mongo::BSONObj const& filter,
+			 mongo::BSONObj const& sort, mongo::BSONObj const& update,
+			 ModifyOptions const& options, mongo::BSONObj &found) {
+      invalidate(collection);
+      flush(collection);
+      std::string db, name;
+      split_namespace(collection, db, name);
+      mongo::BSONObj info;
+      {
+	OperationInfo op_info("findAndModify", collection);
+	mongo::Query query(filter);
+	op_info.query = &query;
+	op_info.document = &update;
+	op_info.limit = 1;
+	Instrument op(m_stats.get(), m_observers, op_info);
+	m_connection->runCommand(db, find_and_modify_command(name, filter, sort, update, options), info);
+	if (info["value"].type() == mongo::Object) op_info.documents = 1;
+      }
+      return modified(info, found);
+    }
  
+    // The server's limits on a single batched write command.
+    static size_t const max_write_batch = 1000;
+    static int const max_write_bytes = 15 * 1024 * 1024;
+
   private:
+    friend class Pipeline;
+
+    // Writes held back for one collection, all for one write command.
+    struct Held {
+      Held() : operation("insert") { }
+      std::string command;
+      char const* operation;
+      std::vector<mongo::BSONObj> operations;
+    };
+
+    // Sends acknowledged writes, or holds them back under every(n).
+    void write(std::string const& collection, std::string const& command, char const* operation,
+	       std::vector<mongo::BSONObj> const& operations, bool ordered,
+	       WriteConcern const& concern) {
+      if (concern.mode != WriteConcern::every_n) {
+	flush(collection);
+	send_writes(collection, command, operation, operations, ordered);
+	return;
+      }
+      std::map<std::string, Held>::iterator i = m_held.find(collection);
+      if (i != m_held.end() and i->second.command != command) {
+	flush(collection);
+	i = m_held.end();
+      }
+      if (i == m_held.end()) {
+	i = m_held.insert(std::make_pair(collection, Held())).first;
+	i->second.command = command;
+      }
+      // Upserts and updates share a command; report the lot as updates.
+      i->second.operation = i->second.operations.empty() or i->second.operation == operation
+	? operation : "update";
+      i->second.operations.insert(i->second.operations.end(), operations.begin(), operations.end());
+      if (i->second.operations.size() >= concern.n) flush(collection);
+    }
+
+    // Sends writes through the server's insert, update or delete command,
+    // as many per message as the server allows, and waits for each reply.
+    // Throws write_error listing every failure, by position in operations.
+    void send_writes(std::string const& collection, std::string const& command, char const* operation,
+		     std::vector<mongo::BSONObj> const& operations, bool ordered) {
+      std::string db, name;
+      split_namespace(collection, db, name);
+
+      BatchSizer *sizer = write_sizer(collection);
+      std::vector<WriteError> errors;
+      std::string message;
+      size_t start = 0;
+      while (start < operations.size()) {
+	// Not std::min: it would take the static constant by reference, and
+	// so need a definition of it.
+	size_t limit = max_write_batch;
+	if (sizer and sizer->size() < limit) limit = sizer->size();
+	mongo::BSONArrayBuilder batch;
+	size_t end = start;
+	int bytes = 0;
+	for (; end < operations.size() and end - start < limit; ++end) {
+	  int size = operations[end].objsize();
+	  if (end > start and bytes + size > max_write_bytes) break;
+	  bytes += size;
+	  batch.append(operations[end]);
+	}
+
+	mongo::BSONObj info;
+	{
+	  OperationInfo op_info(operation, collection);
+	  op_info.documents = end - start;
+	  op_info.bytes_sent = bytes;
+	  Instrument op(m_stats.get(), m_observers, op_info);
+	  unsigned long long sent = sizer ? now_micros() : 0;
+	  m_connection->runCommand(db, write_command(command, name, batch.arr(), ordered), info);
+	  if (sizer) sizer->record(end - start, now_micros() - sent);
+	}
+	if (not info["ok"].trueValue()) {
+	  throw write_error(std::string("Batched ") + operation + " failed: " + info["errmsg"].str(), errors);
+	}
+	if (write_errors(info, operations, start, errors, message) and ordered) break;
+	start = end;
+      }
+      if (not errors.empty()) {
+	throw write_error(std::string("Batched ") + operation + " failed: " + message, errors);
+      }
+    }
+
+    static mongo::BSONObj write_command(std::string const& command, std::string const& name,
+					mongo::BSONArray const& operations, bool ordered) {
+      char const* field = command == "insert" ? "documents" : command == "update" ? "updates" : "deletes";
+      mongo::BSONObjBuilder request;
+      request.append(command, name);
+      request.appendArray(field, operations);
+      request.appendBool("ordered", ordered);
+      return request.obj();
+    }
+
+    // Adds the failures a write command reports to errors, numbered from
+    // start within operations, and returns how many there were.
+    static size_t write_errors(mongo::BSONObj const& reply, std::vector<mongo::BSONObj> const& operations,
+			       size_t start, std::vector<WriteError> &errors, std::string &message) {
+      if (not reply.hasField("writeErrors")) return 0;
+      std::vector<mongo::BSONElement> failed = reply["writeErrors"].Array();
+      for (std::vector<mongo::BSONElement>::const_iterator i = failed.begin(); i != failed.end(); ++i) {
+	mongo::BSONObj error = i->Obj();
+	size_t index = start + error["index"].numberInt();
+	errors.push_back(WriteError(index, error["code"].numberInt(), error["errmsg"].str(),
+				    index < operations.size() ? operations[index] : mongo::BSONObj()));
+	if (message.empty()) message = error["errmsg"].str();
+      }
+      return failed.size();
+    }
+
+    static void split_namespace(std::string const& collection, std::string &db, std::string &name) {
+      std::string::size_type dot = collection.find('.');
+      db = collection.substr(0, dot);
+      name = dot == std::string::npos ? collection : collection.substr(dot + 1);
+    }
+
+    static mongo::BSONObj find_and_modify_command(std::string const& name, mongo::BSONObj const& filter,
+						  mongo::BSONObj const& sort, mongo::BSONObj const& update,
+						  ModifyOptions const& options) {
+      mongo::BSONObjBuilder command;
+      command.append("findAndModify", name);
+      command.append("query", filter);
+      if (not sort.isEmpty()) command.append("sort", sort);
+      if (options.remove) {
+	command.appendBool("remove", true);
+      } else {
+	command.append("update", update);
+	if (options.return_new) command.appendBool("new", true);
+	if (options.upsert) command.appendBool("upsert", true);
+      }
+      if (not options.fields.isEmpty()) command.append("fields", options.fields);
+      return command.obj();
+    }
+
+    // Pulls the document out of a findAndModify reply.
+    static bool modified(mongo::BSONObj const& reply, mongo::BSONObj &found) {
+      if (not reply["ok"].trueValue()) {
+	std::vector<WriteError> errors(1, WriteError(0, reply["code"].numberInt(), reply["errmsg"].str()));
+	throw write_error("findAndModify failed: " + reply["errmsg"].str(), errors);
+      }
+      if (reply["value"].type() != mongo::Object) return false;
+      found = reply["value"].Obj().getOwned();
+      return true;
+    }
+
+    typedef std::map<std::string, std::tr1::shared_ptr<BatchSizer> > Sizers;
+
+    // A batch size of one asks the server for a single batch and no
+    // cursor, so reads never go below two.
+    static int read_batch(BatchSizer const& sizer) {
+      return std::max(2, int(sizer.size()));
+    }
+
+    static std::tr1::shared_ptr<BatchSizer> find_sizer(Sizers const& sizers, std::string const& collection) {
+      if (sizers.empty()) return std::tr1::shared_ptr<BatchSizer>();
+      Sizers::const_iterator i = sizers.find(collection);
+      return i == sizers.end() ? std::tr1::shared_ptr<BatchSizer>() : i->second;
+    }
+
+    void invalidate(std::string const& collection) {
+      if (m_cache) m_cache->invalidate(collection);
+      if (MemoryCollection *copy = memory(collection)) copy->mark_stale();
+    }
+
     std::string m_host;
     mongo::ScopedDbConnection m_connection;
+    std::tr1::shared_ptr<QueryCache> m_cache;
+    std::tr1::shared_ptr<StatsRecorder> m_stats;
+    std::vector<Observer*> m_observers;
+    WriteConcern m_concern;
+    std::map<std::string, WriteConcern> m_concerns;
+    std::map<std::string, Held> m_held;
+    Sizers m_write_sizers;
+    Sizers m_read_sizers;
+    std::map<std::string, std::tr1::shared_ptr<MemoryCollection> > m_memory;
   };
 
 
@@ -98,39 +835,261 @@ namespace mongoxx {
     Inserter(Session *session, std::string const& collection, Mapper<T> const* mapper)
       : m_session(session), m_collection(collection), m_mapper(mapper) { }
 
+    /**
+     * Sets how this inserter's writes are acknowledged, in place of the
+     * Session's concern for the collection.  Each chunk of insert_all() is
+     * one batch.
+     * @param concern the write concern
+     * @return this inserter
+     */
+    Inserter& write_concern(WriteConcern const& concern) {
+      m_concern.reset(new WriteConcern(concern));
+      return *this;
+    }
+
     Inserter& insert(T const& t) {
       mongo::BSONObj object;
-      m_mapper->to_bson(t, object);
-      m_session->insert(m_collection, object);
+      encode(t, object);
+      m_session->insert(m_collection, object, concern());
       return *this;
     }
 
+    /**
+     * Starts inserting from a thread of its own, spilling to a local spool
+     * file whenever the server falls behind.  See SpoolingInserter.
+     * @param spool_path the spool file
+     * @param threshold how many documents wait in memory before spilling
+     * @return the inserter, already sending
+     */
+    std::tr1::shared_ptr<SpoolingInserter<T> > spooling(std::string const& spool_path,
+							size_t threshold = 10000) const {
+      return std::tr1::shared_ptr<SpoolingInserter<T> >(
+	new SpoolingInserter<T>(m_session->host(), m_collection, m_mapper, spool_path, threshold));
+    }
+
     Inserter& upsert(T const& t) {
+      std::pair<mongo::BSONObj, mongo::BSONObj> split = upsert_parts(t);
+      m_session->execute_upsert(m_collection,
+				mongo::Query(split.first), split.second, concern());
+      return *this;
+    }
+
+    /**
+     * Inserts many objects, encoding and sending them a chunk at a time.
+     * @param ts the objects to insert
+     * @param ordered if false, the server carries on past a failed document
+     * @param chunk how many objects go in each insert message; the
+     *   Session's write sizer for the collection, if any, picks instead
+     * @throws write_error, under an acknowledged WriteConcern, listing every
+     *   object that failed by its position in ts
+     */
+    Inserter& insert_all(std::vector<T> const& ts, bool ordered = true,
+			 size_t chunk = Session::max_write_batch) {
+      BatchSizer *sizer = m_session->write_sizer(m_collection);
+      Chunk encoded;
+      Failures failures;
+      for (size_t begin = 0; begin < ts.size(); begin += chunk) {
+	if (sizer) chunk = sizer->size();
+	if (chunk == 0) chunk = 1;
+	encoded.begin = begin;
+	encoded.end = std::min(ts.size(), begin + chunk);
+	encode_chunk(&ts, &encoded, 0);
+	send(encoded, ordered, failures);
+      }
+      failures.check();
+      return *this;
+    }
+
+    /**
+     * Inserts many objects, encoding chunks of them in parallel on a pool
+     * while this thread sends the chunks already encoded.  At most two
+     * chunks per pool thread are held encoded at once.
+     * @param ts the objects to insert
+     * @param pool the threads to encode on
+     * @param ordered if true, chunks are sent in input order and a failure
+     *   stops the insert; if false, chunks are sent as they are encoded and
+     *   the server carries on past a failed document
+     * @param chunk how many objects go in each insert message; the
+     *   Session's write sizer for the collection, if any, picks instead,
+     *   once for the whole insert
+     * @throws std::runtime_error if an object fails to encode
+     * @throws write_error, under an acknowledged WriteConcern, listing every
+     *   object that failed by its position in ts
+     */
+    Inserter& insert_all(std::vector<T> const& ts, ThreadPool &pool, bool ordered = true,
+			 size_t chunk = Session::max_write_batch) {
+      if (BatchSizer *sizer = m_session->write_sizer(m_collection)) chunk = sizer->size();
+      if (chunk == 0) chunk = 1;
+      Pipeline pipeline((ts.size() + chunk - 1) / chunk);
+      for (size_t k = 0; k < pipeline.chunks.size(); ++k) {
+	pipeline.chunks[k].begin = k * chunk;
+	pipeline.chunks[k].end = std::min(ts.size(), (k + 1) * chunk);
+      }
+
+      size_t window = 2 * pool.size();
+      size_t submitted = 0;
+      Failures failures;
+      for (size_t sent = 0; sent < pipeline.chunks.size(); ++sent) {
+	for (; submitted < pipeline.chunks.size() and submitted < sent + window; ++submitted) {
+	  {
+	    boost::lock_guard<boost::mutex> lock(pipeline.mutex);
+	    ++pipeline.pending;
+	  }
+	  pool.submit(boost::bind(&Inserter::encode_chunk, this, &ts,
+				  &pipeline.chunks[submitted], &pipeline));
+	}
+
+	Chunk *ready = 0;
+	{
+	  boost::unique_lock<boost::mutex> lock(pipeline.mutex);
+	  while (not ready) {
+	    if (ordered) {
+	      if (pipeline.chunks[sent].done) ready = &pipeline.chunks[sent];
+	    } else {
+	      for (size_t k = 0; k < submitted and not ready; ++k) {
+		if (pipeline.chunks[k].done and not pipeline.chunks[k].sent) ready = &pipeline.chunks[k];
+	      }
+	    }
+	    if (not ready) pipeline.encoded.wait(lock);
+	  }
+	  ready->sent = true;
+	}
+	if (not ready->error.empty()) {
+	  throw std::runtime_error("Failed to encode for bulk insert: " + ready->error);
+	}
+	send(*ready, ordered, failures);
+	std::vector<mongo::BSONObj>().swap(ready->documents);
+      }
+      failures.check();
+      return *this;
+    }
+
+    /**
+     * Upserts many objects through the server's batched update command,
+     * rather than with one round trip each.
+     * @param ts the objects to upsert, matched on their _id
+     * @param ordered if true, stop at the first failure
+     * @throws write_error listing every object that failed, by position;
+     *   these are acknowledged whatever the WriteConcern
+     */
+    Inserter& upsert_all(std::vector<T> const& ts, bool ordered = true) {
+      std::vector<std::pair<mongo::BSONObj, mongo::BSONObj> > upserts;
+      upserts.reserve(ts.size());
+      for (typename std::vector<T>::const_iterator i = ts.begin(); i != ts.end(); ++i) {
+	upserts.push_back(upsert_parts(*i));
+      }
+      m_session->execute_upserts(m_collection, upserts, ordered);
+      return *this;
+    }
+
+  private:
+    // One run of objects to encode, and the documents they became.
+    struct Chunk {
+      Chunk() : begin(0), end(0), done(false), sent(false) { }
+      size_t begin;
+      size_t end;
+      std::vector<mongo::BSONObj> documents;
+      bool done;
+      bool sent;
+      std::string error;
+    };
+
+    // The chunks of one parallel insert_all().  The destructor waits for
+    // encoding still in flight, since it writes into the chunks.
+    struct Pipeline {
+      Pipeline(size_t chunks) : chunks(chunks), pending(0) { }
+      ~Pipeline() {
+	boost::unique_lock<boost::mutex> lock(mutex);
+	while (pending > 0) encoded.wait(lock);
+      }
+      std::vector<Chunk> chunks;
+      size_t pending;
+      boost::mutex mutex;
+      boost::condition_variable encoded;
+    };
+
+    // Encodes a chunk into builders sized from the first object, so most
+    // documents are built without growing their buffer.
+    void encode_chunk(std::vector<T> const* ts, Chunk *chunk, Pipeline *pipeline) const {
+      std::vector<mongo::BSONObj> documents;
+      std::string error;
+      try {
+	ScopedOperation op(m_session->recorder(), m_collection, "encode", chunk->end - chunk->begin);
+	documents.reserve(chunk->end - chunk->begin);
+	int size_hint = 512;
+	for (size_t i = chunk->begin; i < chunk->end; ++i) {
+	  mongo::BSONObjBuilder builder(size_hint);
+	  m_mapper->to_bson((*ts)[i], builder);
+	  documents.push_back(builder.obj());
+	  if (i == chunk->begin) size_hint = documents.back().objsize() + 64;
+	}
+      } catch (std::exception const& e) {
+	error = e.what();
+      }
+      if (not pipeline) {
+	chunk->documents.swap(documents);
+	if (not error.empty()) throw std::runtime_error("Failed to encode for bulk insert: " + error);
+	return;
+      }
+      boost::lock_guard<boost::mutex> lock(pipeline->mutex);
+      chunk->documents.swap(documents);
+      chunk->error = error;
+      chunk->done = true;
+      --pipeline->pending;
+      pipeline->encoded.notify_all();
+    }
+
+    // Acknowledged failures across the chunks of one insert_all().
+    struct Failures {
+      void check() const {
+	if (not errors.empty()) throw write_error(message, errors);
+      }
+      std::vector<WriteError> errors;
+      std::string message;
+    };
+
+    // Inserts a chunk, renumbering any failures to their place in the
+    // whole insert.  Only ordered inserts stop at a failed chunk.  Writes
+    // held back by every(n) fail in groups of their own, unrenumbered.
+    void send(Chunk const& chunk, bool ordered, Failures &failures) {
+      try {
+	m_session->insert(m_collection, chunk.documents, ordered, concern());
+      } catch (write_error const& e) {
+	if (e.errors().empty() or concern().mode != WriteConcern::per_batch) throw;
+	if (failures.message.empty()) failures.message = e.what();
+	for (std::vector<WriteError>::const_iterator i = e.errors().begin(); i != e.errors().end(); ++i) {
+	  failures.errors.push_back(*i);
+	  failures.errors.back().index += chunk.begin;
+	}
+	if (ordered) failures.check();
+      }
+    }
+
+    WriteConcern const& concern() const {
+      return m_concern ? *m_concern : m_session->write_concern(m_collection);
+    }
+
+    // The filter on _id, and a $set of everything else.
+    std::pair<mongo::BSONObj, mongo::BSONObj> upsert_parts(T const& t) const {
       mongo::BSONObj object;
-      m_mapper->to_bson(t, object);
-      // Unfortunately, we now need to split apart the 'id' and the rest.
+      encode(t, object);
       mongo::BSONObjBuilder filter;
       mongo::BSONObjBuilder update;
-      std::set<std::string> fields;
-      object.getFieldNames(fields);
-      for (std::set<std::string>::const_iterator i = fields.begin(); i != fields.end(); ++i) {
-	if (*i == "_id") {
-	  filter.append(object[*i]);
-	} else {
-	  update.append(object[*i]);
-	}
-      }
+      split_id(object, filter, update);
       mongo::BSONObjBuilder update2;
       update2.append("$set", update.obj());
-      m_session->execute_upsert(m_collection,
-				mongo::Query(filter.obj()), update2.obj());
-      return *this;
+      return std::make_pair(filter.obj(), update2.obj());
+    }
+
+    void encode(T const& t, mongo::BSONObj &object) const {
+      ScopedOperation op(m_session->recorder(), m_collection, "encode");
+      m_mapper->to_bson(t, object);
     }
 
-  private:
     Session *m_session;
     std::string m_collection;
     Mapper<T> const* m_mapper;
+    std::tr1::shared_ptr<WriteConcern const> m_concern;
   };
 
 };
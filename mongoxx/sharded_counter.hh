@@ -0,0 +1,129 @@
+/* sharded_counter.hh
+   Spreads a hot global counter over several documents.
+
+*/
+
+#ifndef MONGOXX_SHARDED_COUNTER_HH
+#define MONGOXX_SHARDED_COUNTER_HH
+
+#include "mapper.hh"
+#include "query.hh"
+#include "session.hh"
+
+#include <boost/functional/hash.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+namespace mongoxx {
+
+  /**
+   * A ShardedCounter keeps a single logical counter in several documents,
+   * { _id: "<name>:<shard>", counter: "<name>", value: <n> }, so that
+   * increments from many writers land on different documents.  Reading the
+   * counter fetches every shard in one query and adds them up.
+   *
+   * The shard count may be changed between runs; reads sum whatever shards
+   * exist for the counter.
+   */
+  class ShardedCounter {
+  public:
+
+    /**
+     * How an increment picks its shard.
+     */
+    enum Placement {
+      by_thread,  ///< each thread always writes the same shard
+      random      ///< each increment writes a random shard
+    };
+
+    /**
+     * Constructs a ShardedCounter.
+     * @param session the session to write and read through
+     * @param collection the name of the collection holding the shards
+     * @param name the name of the counter
+     * @param shards the number of shard documents to spread writes over
+     * @param placement how increments pick their shard
+     */
+    ShardedCounter(Session *session, std::string const& collection,
+		   std::string const& name, unsigned int shards = 16,
+		   Placement placement = by_thread)
+      : m_session(session), m_collection(collection), m_name(name),
+	m_shards(shards == 0 ? 1 : shards), m_placement(placement) {
+      m_mapper.add_field("_id", &Shard::id);
+      m_mapper.add_field("counter", &Shard::counter);
+      m_mapper.add_field("value", &Shard::value);
+    }
+
+    /**
+     * Adds to the counter.
+     * @param delta the amount to add
+     */
+    void increment(long long delta = 1) {
+      std::ostringstream id;
+      id << m_name << ':' << shard();
+      m_session->execute_upsert(m_collection,
+				(m_mapper[&Shard::id] == id.str()).to_bson(),
+				(m_mapper[&Shard::counter] = m_name,
+				 m_mapper[&Shard::value] += delta).to_bson());
+    }
+
+    /**
+     * Reads the counter by adding up every shard.
+     * @return the current total
+     */
+    long long value() const {
+      long long total = 0;
+      QueryResult<Shard> result = m_session->query(m_collection, &m_mapper)
+	.filter(m_mapper[&Shard::counter] == m_name).result();
+      for (Shard shard; result.next(shard); ) {
+	total += shard.value;
+      }
+      return total;
+    }
+
+    /**
+     * Removes every shard, resetting the counter to zero.
+     */
+    void reset() {
+      m_session->query(m_collection, &m_mapper)
+	.filter(m_mapper[&Shard::counter] == m_name).remove_all();
+    }
+
+    std::string const& name() const { return m_name; }
+    unsigned int shards() const { return m_shards; }
+
+  private:
+    struct Shard {
+      std::string id;
+      std::string counter;
+      long long value;
+    };
+
+    unsigned int shard() const {
+      if (m_placement == by_thread) {
+	boost::hash<boost::thread::id> hasher;
+	return hasher(boost::this_thread::get_id()) % m_shards;
+      }
+      static boost::thread_specific_ptr<unsigned int> seed;
+      if (not seed.get()) {
+	boost::hash<boost::thread::id> hasher;
+	seed.reset(new unsigned int(hasher(boost::this_thread::get_id())));
+      }
+      return rand_r(seed.get()) % m_shards;
+    }
+
+    Session *m_session;
+    std::string m_collection;
+    std::string m_name;
+    unsigned int m_shards;
+    Placement m_placement;
+    Mapper<Shard> m_mapper;
+  };
+
+};
+
+#endif
@@ -0,0 +1,258 @@
+/* slow_query.hh
+   Logs slow queries by shape, and optionally explains them in the background.
+
+*/
+
+#ifndef MONGOXX_SLOW_QUERY_HH
+#define MONGOXX_SLOW_QUERY_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "observer.hh"
+#include "session.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A SlowQueryLog is an Observer that writes a line for every query slower
+   * than a threshold.  Each line gives the query's shape: its filter with
+   * the values stripped, plus its sort, limit and skip.
+   *
+   * With explain turned on, the first slow query of each shape (and then at
+   * most one per shape per interval) is re-run with $explain on a background
+   * connection.  The plan summary is logged and kept for plans().
+   *
+   *   SlowQueryLog slow(100);
+   *   slow.enable_explain("localhost");
+   *   session.add_observer(&slow);
+   */
+  class SlowQueryLog : public Observer {
+  public:
+
+    /**
+     * What the server said about how it ran a query shape.
+     */
+    struct Plan {
+      Plan() : nscanned(0), nreturned(0), millis(0) { }
+      std::string collection;
+      std::string shape;
+      std::string index;       ///< the index used, or empty for a collection scan
+      long long nscanned;      ///< documents or index keys examined
+      long long nreturned;     ///< documents returned
+      long long millis;        ///< server time spent on the explain
+    };
+
+    /**
+     * Constructs a SlowQueryLog.
+     * @param threshold_ms queries taking longer than this are logged
+     * @param out where to write the log
+     */
+    SlowQueryLog(unsigned int threshold_ms, std::ostream &out = std::clog)
+      : m_threshold_micros(threshold_ms * 1000ULL), m_out(out),
+	m_explain_interval_ms(0), m_stopping(false) { }
+
+    ~SlowQueryLog() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stopping = true;
+      }
+      m_wakeup.notify_all();
+      if (m_thread.joinable()) m_thread.join();
+    }
+
+    /**
+     * Turns on background explains.
+     * @param host the server to explain against, through its own connection
+     * @param interval_ms the least time between explains of the same shape
+     */
+    void enable_explain(std::string const& host, unsigned int interval_ms = 60000) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (m_thread.joinable()) return;
+      m_host = host;
+      m_explain_interval_ms = interval_ms;
+      m_thread = boost::thread(&SlowQueryLog::run, this);
+    }
+
+    void finished(OperationInfo const& info) {
+      if (info.elapsed_micros < m_threshold_micros) return;
+      if (std::strcmp(info.operation, "query") != 0 or not info.query) return;
+
+      std::string shape = SlowQueryLog::shape(*info.query, info.limit, info.skip);
+      {
+	boost::lock_guard<boost::mutex> lock(m_out_mutex);
+	m_out << "slow query: " << info.elapsed_micros / 1000 << "ms "
+	      << *info.collection << " " << shape << std::endl;
+      }
+
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (not m_thread.joinable()) return;
+      boost::system_time now = boost::get_system_time();
+      std::string key = *info.collection + " " + shape;
+      std::map<std::string, boost::system_time>::iterator last = m_last_explain.find(key);
+      if (last != m_last_explain.end() and
+	  now < last->second + boost::posix_time::milliseconds(m_explain_interval_ms)) {
+	return;
+      }
+      m_last_explain[key] = now;
+      Pending pending;
+      pending.collection = *info.collection;
+      pending.shape = shape;
+      pending.query = info.query->obj.getOwned();
+      m_pending.push_back(pending);
+      m_wakeup.notify_all();
+    }
+
+    /**
+     * Gets the most recent plan for every shape explained so far.
+     * @return plans keyed by collection and shape
+     */
+    std::map<std::string, Plan> plans() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_plans;
+    }
+
+    /**
+     * Normalizes a query to its shape: the filter with every value replaced
+     * by 1, plus the sort, limit and skip.
+     * @param query the query
+     * @param limit the query limit
+     * @param skip the query skip
+     * @return the shape, as JSON
+     */
+    static std::string shape(mongo::Query const& query, unsigned int limit,
+			     unsigned int skip) {
+      mongo::BSONObjBuilder builder;
+      builder.append("filter", strip(query.getFilter()));
+      mongo::BSONObj sort = query.getSort();
+      if (not sort.isEmpty()) builder.append("sort", sort);
+      if (limit) builder.append("limit", static_cast<int>(limit));
+      if (skip) builder.append("skip", static_cast<int>(skip));
+      return builder.obj().jsonString();
+    }
+
+  private:
+    struct Pending {
+      std::string collection;
+      std::string shape;
+      mongo::BSONObj query;
+    };
+
+    static mongo::BSONObj strip(mongo::BSONObj const& filter) {
+      mongo::BSONObjBuilder builder;
+      for (mongo::BSONObjIterator i(filter); i.more(); ) {
+	mongo::BSONElement element = i.next();
+	if (element.type() == mongo::Object) {
+	  builder.append(element.fieldName(), strip(element.Obj()));
+	} else {
+	  builder.append(element.fieldName(), 1);
+	}
+      }
+      return builder.obj();
+    }
+
+    static Plan summarize(mongo::BSONObj const& explain) {
+      Plan plan;
+      if (explain.hasField("cursor")) {
+	// Servers before 3.0.
+	std::string cursor = explain["cursor"].str();
+	if (cursor.compare(0, 12, "BtreeCursor ") == 0) plan.index = cursor.substr(12);
+	plan.nscanned = explain["nscanned"].numberLong();
+	plan.nreturned = explain["n"].numberLong();
+	plan.millis = explain["millis"].numberLong();
+      } else if (explain.hasField("executionStats")) {
+	mongo::BSONObj stats = explain["executionStats"].Obj();
+	plan.nscanned = stats["totalDocsExamined"].numberLong();
+	plan.nreturned = stats["nReturned"].numberLong();
+	plan.millis = stats["executionTimeMillis"].numberLong();
+	if (explain.hasField("queryPlanner")) {
+	  mongo::BSONObj stage = explain["queryPlanner"].Obj()["winningPlan"].Obj();
+	  while (true) {
+	    if (stage.hasField("indexName")) {
+	      plan.index = stage["indexName"].str();
+	      break;
+	    }
+	    if (not stage.hasField("inputStage")) break;
+	    stage = stage["inputStage"].Obj();
+	  }
+	}
+      }
+      return plan;
+    }
+
+    void run() {
+      std::tr1::shared_ptr<Session> session;
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (true) {
+	while (not m_stopping and m_pending.empty()) m_wakeup.wait(lock);
+	if (m_stopping) return;
+	Pending pending = m_pending.front();
+	m_pending.pop_front();
+	lock.unlock();
+
+	Plan plan;
+	bool explained = false;
+	try {
+	  if (not session) session.reset(new Session(m_host));
+	  mongo::Query query(pending.query);
+	  query.explain();
+	  std::tr1::shared_ptr<mongo::DBClientCursor> cursor =
+	    session->execute_query(pending.collection, query, 0, 0);
+	  if (cursor and cursor->more()) {
+	    plan = summarize(cursor->next());
+	    explained = true;
+	  }
+	} catch (std::exception const& e) {
+	  session.reset();
+	  boost::lock_guard<boost::mutex> out_lock(m_out_mutex);
+	  m_out << "slow query: explain failed for " << pending.collection
+		<< " " << pending.shape << ": " << e.what() << std::endl;
+	}
+
+	if (explained) {
+	  plan.collection = pending.collection;
+	  plan.shape = pending.shape;
+	  boost::lock_guard<boost::mutex> out_lock(m_out_mutex);
+	  m_out << "slow query plan: " << plan.collection << " " << plan.shape
+		<< " index=" << (plan.index.empty() ? "<none>" : plan.index)
+		<< " nscanned=" << plan.nscanned
+		<< " nreturned=" << plan.nreturned
+		<< " millis=" << plan.millis << std::endl;
+	}
+
+	lock.lock();
+	if (explained) m_plans[plan.collection + " " + plan.shape] = plan;
+      }
+    }
+
+    unsigned long long m_threshold_micros;
+    std::ostream &m_out;
+    boost::mutex m_out_mutex;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_wakeup;
+    std::string m_host;
+    unsigned int m_explain_interval_ms;
+    bool m_stopping;
+    std::deque<Pending> m_pending;
+    std::map<std::string, boost::system_time> m_last_explain;
+    std::map<std::string, Plan> m_plans;
+    boost::thread m_thread;
+  };
+
+};
+
+#endif
@@ -0,0 +1,552 @@
+/* spool.hh
+   An append-only, memory-mapped file of documents waiting to be written,
+   and an inserter that spills into one when the server falls behind.
+
+*/
+
+#ifndef MONGOXX_SPOOL_HH
+#define MONGOXX_SPOOL_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "mapper.hh"
+#include "queue.hh"
+#include "session.hh"
+#include "write_concern.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mongoxx {
+
+  class spool_error : public std::runtime_error {
+  public:
+    explicit spool_error(std::string const &message) : runtime_error(message) { }
+  };
+
+  /**
+   * A Spool is a queue of documents kept in a memory-mapped file, so it
+   * survives the process.  Documents are appended at the tail as plain
+   * BSON and consumed from the head; the head's offset lives in a small
+   * header, and reopening the file carries on from there.  Once everything
+   * is consumed the file is reused from the start.  Each document is
+   * followed by its length and a CRC-32 of its bytes, so a record only
+   * partly written back before a crash is recognised as torn.
+   *
+   *   Spool spool("people.spool");
+   *   spool.append(document);
+   *   ...
+   *   std::vector<mongo::BSONObj> batch;
+   *   spool.read(batch, 1000);
+   *   send(batch);
+   *   spool.consume(batch.size());
+   *
+   * Appends are memory copies; the kernel writes them back when it likes,
+   * so a process crash loses nothing, and sync() bounds what a machine
+   * crash can lose.  A Spool is not thread-safe.
+   */
+  class Spool {
+  public:
+
+    /**
+     * Opens a spool, creating it if need be, and finds the documents still
+     * waiting in it.
+     * @param path the spool file
+     * @param grow_bytes how much the file grows by when it fills
+     * @throws spool_error if the file can't be opened, or isn't a spool
+     */
+    explicit Spool(std::string const& path, size_t grow_bytes = 16 * 1024 * 1024)
+      : m_path(path), m_grow(grow_bytes < 4096 ? 4096 : grow_bytes), m_data(0), m_size(0),
+	m_tail(header_size), m_count(0) {
+      m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (m_fd < 0) fail("open");
+      try {
+	struct stat st;
+	if (::fstat(m_fd, &st) != 0) fail("stat");
+	bool fresh = st.st_size == 0;
+	if (not fresh and st.st_size < header_size) throw spool_error("Spool '" + m_path + "' is truncated.");
+	map(fresh ? m_grow : st.st_size);
+	if (fresh) {
+	  std::memcpy(m_data, magic(), 8);
+	  set_head(header_size);
+	} else if (std::memcmp(m_data, magic(), 8) != 0) {
+	  throw spool_error("'" + m_path + "' is not a spool.");
+	}
+	recover();
+      } catch (...) {
+	if (m_data) ::munmap(m_data, m_size);
+	::close(m_fd);
+	throw;
+      }
+    }
+
+    ~Spool() {
+      ::msync(m_data, m_size, MS_SYNC);
+      ::munmap(m_data, m_size);
+      ::close(m_fd);
+    }
+
+    /**
+     * Adds a document at the tail.
+     * @param document the document
+     * @throws spool_error if the file can't grow
+     */
+    void append(mongo::BSONObj const& document) {
+      size_t size = document.objsize();
+      if (m_tail + size + trailer_size > m_size) {
+	size_t wanted = m_size + m_grow;
+	while (wanted < m_tail + size + trailer_size) wanted += m_grow;
+	remap(wanted);
+      }
+      std::memcpy(m_data + m_tail, document.objdata(), size);
+      uint32_t trailer[2] = { static_cast<uint32_t>(size), crc32(document.objdata(), size) };
+      std::memcpy(m_data + m_tail + size, trailer, trailer_size);
+      m_tail += size + trailer_size;
+      ++m_count;
+    }
+
+    /**
+     * Copies documents from the head, without consuming them.
+     * @param documents where to append them
+     * @param max the most to copy
+     * @return how many were copied
+     */
+    size_t read(std::vector<mongo::BSONObj> &documents, size_t max) const {
+      size_t offset = head(), n = 0;
+      for (; n < max and n < m_count; ++n) {
+	mongo::BSONObj document(m_data + offset);
+	documents.push_back(document.getOwned());
+	offset += stored_size(offset);
+      }
+      return n;
+    }
+
+    /**
+     * Drops documents from the head, once they have been dealt with.
+     * @param n how many
+     */
+    void consume(size_t n) {
+      if (n > m_count) n = m_count;
+      size_t offset = head();
+      for (size_t k = 0; k < n; ++k) offset += stored_size(offset);
+      set_head(offset);
+      m_count -= n;
+      if (m_count == 0) {
+	// Everything after the head reads as empty, so the zeroing can be
+	// interrupted safely; only then does the head move back.
+	std::memset(m_data + header_size, 0, m_tail - header_size);
+	set_head(header_size);
+	m_tail = header_size;
+      }
+    }
+
+    /**
+     * Waits for the file to reach the disk.
+     * @throws spool_error if it can't be written
+     */
+    void sync() {
+      if (::msync(m_data, m_size, MS_SYNC) != 0) fail("msync");
+    }
+
+    std::string const& path() const { return m_path; }
+
+    /**
+     * Gets how many documents are waiting.
+     */
+    size_t size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+
+    /**
+     * Gets how many bytes the waiting documents take in the file.
+     */
+    size_t bytes() const { return m_tail - head(); }
+
+  private:
+    // The header is the magic number and the head's offset, native 64-bit;
+    // each record's trailer is its length and CRC, native 32-bit.
+    enum { header_size = 16, trailer_size = 8 };
+
+    static char const* magic() { return "MXSPOOL2"; }
+
+    // The CRC-32 used by zlib and Ethernet.
+    struct CrcTable {
+      CrcTable() {
+	for (uint32_t n = 0; n < 256; ++n) {
+	  uint32_t c = n;
+	  for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+	  entries[n] = c;
+	}
+      }
+      uint32_t entries[256];
+    };
+
+    static uint32_t crc32(char const* data, size_t size) {
+      static CrcTable const table;
+      uint32_t crc = 0xffffffffU;
+      for (size_t k = 0; k < size; ++k) {
+	crc = table.entries[(crc ^ static_cast<unsigned char>(data[k])) & 0xff] ^ (crc >> 8);
+      }
+      return crc ^ 0xffffffffU;
+    }
+
+    size_t head() const {
+      uint64_t offset;
+      std::memcpy(&offset, m_data + 8, sizeof(offset));
+      return offset;
+    }
+
+    void set_head(size_t offset) {
+      uint64_t word = offset;
+      std::memcpy(m_data + 8, &word, sizeof(word));
+    }
+
+    // The space taken by a record already known to be whole.
+    size_t stored_size(size_t offset) const {
+      int32_t size;
+      std::memcpy(&size, m_data + offset, sizeof(size));
+      return size + trailer_size;
+    }
+
+    // The space taken by the record at an offset, or 0 if there isn't a
+    // whole one: its trailer must repeat its length, and its CRC match.
+    size_t record_size(size_t offset) const {
+      if (m_size - offset < 5 + trailer_size) return 0;
+      int32_t size;
+      std::memcpy(&size, m_data + offset, sizeof(size));
+      if (size < 5 or static_cast<size_t>(size) > m_size - offset - trailer_size) return 0;
+      if (m_data[offset + size - 1] != 0) return 0;
+      uint32_t trailer[2];
+      std::memcpy(trailer, m_data + offset + size, trailer_size);
+      if (trailer[0] != static_cast<uint32_t>(size) or trailer[1] != crc32(m_data + offset, size)) return 0;
+      return size + trailer_size;
+    }
+
+    // Walks the records from the head to find the tail.  A record torn by
+    // a crash, one whose trailer is missing or doesn't match, ends the
+    // spool; whatever follows it is lost.
+    void recover() {
+      size_t offset = head();
+      if (offset < header_size or offset > m_size) throw spool_error("Spool '" + m_path + "' is corrupt.");
+      m_count = 0;
+      for (size_t size; (size = record_size(offset)) != 0; offset += size) ++m_count;
+      m_tail = offset;
+      // Clear whatever is left past a torn record, so that later appends
+      // can't line up with an old record there and bring it back.
+      for (size_t k = m_tail; k < m_size; ++k) {
+	if (m_data[k] != 0) {
+	  std::memset(m_data + k, 0, m_size - k);
+	  break;
+	}
+      }
+      if (m_count == 0 and head() != header_size) consume(0);
+    }
+
+    void map(size_t size) {
+      if (::ftruncate(m_fd, size) != 0) fail("ftruncate");
+      void *data = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+      if (data == MAP_FAILED) fail("mmap");
+      m_data = static_cast<char*>(data);
+      m_size = size;
+    }
+
+    void remap(size_t size) {
+      ::munmap(m_data, m_size);
+      m_data = 0;
+      map(size);
+    }
+
+    void fail(std::string const& what) const {
+      throw spool_error("Spool '" + m_path + "': " + what + " failed: " + std::strerror(errno));
+    }
+
+    Spool(Spool const&);
+    Spool& operator=(Spool const&);
+
+    std::string m_path;
+    size_t m_grow;
+    int m_fd;
+    char *m_data;
+    size_t m_size;
+    size_t m_tail;
+    size_t m_count;
+  };
+
+  /**
+   * A SpoolingInserter takes inserts without ever waiting on the server.
+   * Documents are encoded at once and queued in memory for a background
+   * thread, with a connection of its own, to send in batches.  If the
+   * server falls behind and the queue passes a threshold, the queue and
+   * everything after it spill into a Spool on local disk instead, and the
+   * thread replays the spool, in order, as the server catches up; then
+   * the queue takes over again.  Producers see a memory copy either way.
+   *
+   *   std::tr1::shared_ptr<SpoolingInserter<Event> > events =
+   *     session.inserter(table).spooling("events.spool");
+   *   events->insert(event);
+   *
+   * The spool survives a crash, and a new SpoolingInserter on the same
+   * file replays what was left.  The in-memory queue doesn't, though it is
+   * spilled on a clean stop(); a threshold of 0 spools everything.
+   * Delivery is at least once: a document sent just before a crash is
+   * sent again, so documents are given an _id if they lack one, and a
+   * duplicate _id on the server counts as delivered.
+   */
+  template <typename T>
+  class SpoolingInserter {
+  public:
+
+    /**
+     * Counters describing how the inserter is doing.
+     */
+    struct Stats {
+      Stats() : queued(0), spooled(0), sent(0), failed(0), retries(0) { }
+      unsigned long long queued;   ///< documents queued in memory
+      unsigned long long spooled;  ///< documents written to the spool
+      unsigned long long sent;     ///< documents the server acknowledged
+      unsigned long long failed;   ///< documents the server refused
+      unsigned long long retries;  ///< batches resent after a connection error
+    };
+
+    /**
+     * Opens the spool and starts sending, beginning with anything left in
+     * the spool from before.
+     * @param host the server
+     * @param collection the full name of the collection
+     * @param mapper the mapper to encode with
+     * @param spool_path the spool file
+     * @param threshold how many documents the memory queue holds before
+     *   spilling to the spool
+     * @param batch how many documents go in each insert
+     * @param retry_ms how long to wait after a connection error
+     * @throws spool_error if the spool can't be opened
+     */
+    SpoolingInserter(std::string const& host, std::string const& collection,
+		     Mapper<T> const* mapper, std::string const& spool_path,
+		     size_t threshold = 10000, size_t batch = 1000, unsigned int retry_ms = 100)
+      : m_host(host), m_collection(collection), m_mapper(mapper), m_spool(spool_path),
+	m_threshold(threshold), m_batch(batch ? batch : 1), m_retry_ms(retry_ms),
+	m_generation(0), m_stopping(false) {
+      m_thread = boost::thread(&SpoolingInserter::run, this);
+    }
+
+    ~SpoolingInserter() {
+      try {
+	stop();
+      } catch (std::exception const&) {
+	// Nowhere to report it; call stop() yourself to find out.
+      }
+    }
+
+    /**
+     * Queues an object for insertion.
+     * @param t the object
+     * @throws spool_error if the spool can't grow
+     * @throws std::logic_error once stopped
+     */
+    void insert(T const& t) {
+      mongo::BSONObjBuilder builder;
+      m_mapper->to_bson(t, builder);
+      insert(builder.obj());
+    }
+
+    /**
+     * Queues a document for insertion.
+     * @param document the document
+     * @throws spool_error if the spool can't grow
+     * @throws std::logic_error once stopped
+     */
+    void insert(mongo::BSONObj const& document) {
+      mongo::BSONObj owned = with_id(document);
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (m_stopping) throw std::logic_error("SpoolingInserter has been stopped.");
+	if (m_spool.empty() and m_queue.size() < m_threshold) {
+	  m_queue.push_back(owned);
+	  ++m_stats.queued;
+	} else {
+	  spill();
+	  m_spool.append(owned);
+	  ++m_stats.spooled;
+	}
+      }
+      m_wakeup.notify_all();
+    }
+
+    /**
+     * Waits for everything queued so far to reach the server.
+     * @param timeout_ms how long to wait, in milliseconds
+     * @return true if nothing is left waiting
+     */
+    bool flush(unsigned int timeout_ms) {
+      boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (not m_queue.empty() or not m_spool.empty()) {
+	if (not m_drained.timed_wait(lock, deadline)) return m_queue.empty() and m_spool.empty();
+      }
+      return true;
+    }
+
+    /**
+     * Stops sending, spills whatever is still queued in memory to the
+     * spool, and syncs it, so a later SpoolingInserter picks up where this
+     * one left off.  A batch being sent is finished first.
+     * @throws spool_error if the spool can't be written
+     */
+    void stop() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stopping = true;
+      }
+      m_wakeup.notify_all();
+      if (m_thread.joinable()) m_thread.join();
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      spill();
+      m_spool.sync();
+    }
+
+    /**
+     * Gets how many documents are waiting, in memory and in the spool.
+     */
+    size_t backlog() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_queue.size() + m_spool.size();
+    }
+
+    Stats stats() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_stats;
+    }
+
+  private:
+    static mongo::BSONObj with_id(mongo::BSONObj const& document) {
+      if (document.hasField("_id")) return document.getOwned();
+      mongo::BSONObjBuilder builder;
+      builder.append("_id", mongo::OID::gen());
+      builder.appendElements(document);
+      return builder.obj();
+    }
+
+    // Moves the memory queue into the spool, which is empty whenever the
+    // queue isn't, so order is kept.  A batch being sent from the queue
+    // moves with it; the generation tells the sender.  Call with the lock
+    // held.
+    void spill() {
+      if (m_queue.empty()) return;
+      for (std::deque<mongo::BSONObj>::const_iterator i = m_queue.begin(); i != m_queue.end(); ++i) {
+	m_spool.append(*i);
+      }
+      m_stats.spooled += m_queue.size();
+      m_queue.clear();
+      ++m_generation;
+    }
+
+    // Sends batches from the queue, or else the spool, removing each once
+    // the server has it.
+    void run() {
+      std::auto_ptr<Session> session;
+      for (;;) {
+	std::vector<mongo::BSONObj> batch;
+	bool spooled;
+	unsigned long long generation;
+	{
+	  boost::unique_lock<boost::mutex> lock(m_mutex);
+	  while (not m_stopping and m_queue.empty() and m_spool.empty()) m_wakeup.wait(lock);
+	  if (m_stopping) break;
+	  spooled = m_queue.empty();
+	  if (spooled) {
+	    m_spool.read(batch, m_batch);
+	  } else {
+	    size_t n = std::min(m_batch, m_queue.size());
+	    batch.assign(m_queue.begin(), m_queue.begin() + n);
+	  }
+	  generation = m_generation;
+	}
+	if (not send(session, batch)) break;
+	{
+	  boost::lock_guard<boost::mutex> lock(m_mutex);
+	  if (spooled or generation != m_generation) m_spool.consume(batch.size());
+	  else m_queue.erase(m_queue.begin(), m_queue.begin() + batch.size());
+	}
+	m_drained.notify_all();
+      }
+    }
+
+    // Sends one batch, retrying through connection errors.  False if
+    // stopped first.
+    bool send(std::auto_ptr<Session> &session, std::vector<mongo::BSONObj> const& batch) {
+      for (;;) {
+	try {
+	  if (not session.get()) session.reset(new Session(m_host));
+	  session->insert(m_collection, batch, false, WriteConcern::batched());
+	  delivered(batch.size(), 0);
+	  return true;
+	} catch (write_error const& e) {
+	  if (not e.errors().empty()) {
+	    size_t failed = 0;
+	    for (std::vector<WriteError>::const_iterator i = e.errors().begin(); i != e.errors().end(); ++i) {
+	      if (i->code != duplicate_key) ++failed;
+	    }
+	    delivered(batch.size() - failed, failed);
+	    return true;
+	  }
+	  session.reset();
+	} catch (std::exception const&) {
+	  session.reset();
+	}
+	{
+	  boost::lock_guard<boost::mutex> lock(m_mutex);
+	  ++m_stats.retries;
+	}
+	if (not wait_to_retry(m_mutex, m_wakeup, m_stopping, m_retry_ms)) return false;
+      }
+    }
+
+    void delivered(size_t sent, size_t failed) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_stats.sent += sent;
+      m_stats.failed += failed;
+    }
+
+    enum { duplicate_key = 11000 };
+
+    SpoolingInserter(SpoolingInserter const&);
+    SpoolingInserter& operator=(SpoolingInserter const&);
+
+    std::string m_host;
+    std::string m_collection;
+    Mapper<T> const* m_mapper;
+    Spool m_spool;
+    std::deque<mongo::BSONObj> m_queue;
+    size_t m_threshold;
+    size_t m_batch;
+    unsigned int m_retry_ms;
+    unsigned long long m_generation;
+    bool m_stopping;
+    Stats m_stats;
+    boost::thread m_thread;
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_wakeup;
+    boost::condition_variable m_drained;
+  };
+
+};
+
+#endif
@@ -0,0 +1,272 @@
+/* stats.hh
+   Latency histograms and throughput counters for Session operations.
+
+*/
+
+#ifndef MONGOXX_STATS_HH
+#define MONGOXX_STATS_HH
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mongoxx {
+
+  /**
+   * Reads the monotonic clock.
+   * @return microseconds since some fixed point in the past
+   */
+  inline unsigned long long now_micros() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000ULL + ts.tv_nsec / 1000;
+  }
+
+  /**
+   * A Histogram counts values in log-linear buckets, in the style of an HDR
+   * histogram: values below 32 are counted exactly, and above that every
+   * power of two is split into 16 buckets, so any reported percentile is
+   * within about 6% of the true value.  Recording is constant time and the
+   * histogram never allocates after construction.
+   */
+  class Histogram {
+  public:
+    Histogram() : m_counts(bucket_count, 0), m_count(0), m_sum(0),
+		  m_min(0), m_max(0) { }
+
+    /**
+     * Counts a value.
+     * @param value the value to count
+     */
+    void record(unsigned long long value) {
+      ++m_counts[bucket(value)];
+      if (m_count == 0 or value < m_min) m_min = value;
+      if (value > m_max) m_max = value;
+      ++m_count;
+      m_sum += value;
+    }
+
+    /**
+     * Adds every value counted by another histogram.
+     * @param other the histogram to add
+     */
+    void merge(Histogram const& other) {
+      if (other.m_count == 0) return;
+      for (size_t i = 0; i < bucket_count; ++i) m_counts[i] += other.m_counts[i];
+      if (m_count == 0 or other.m_min < m_min) m_min = other.m_min;
+      if (other.m_max > m_max) m_max = other.m_max;
+      m_count += other.m_count;
+      m_sum += other.m_sum;
+    }
+
+    /**
+     * Estimates a percentile.
+     * @param p the percentile, from 0 to 100
+     * @return the highest value in the bucket holding the percentile
+     */
+    unsigned long long percentile(double p) const {
+      if (m_count == 0) return 0;
+      unsigned long long rank = static_cast<unsigned long long>(p / 100.0 * m_count + 0.5);
+      if (rank < 1) rank = 1;
+      if (rank > m_count) rank = m_count;
+      unsigned long long seen = 0;
+      for (size_t i = 0; i < bucket_count; ++i) {
+	seen += m_counts[i];
+	if (seen >= rank) {
+	  unsigned long long high = highest(i);
+	  return high > m_max ? m_max : (high < m_min ? m_min : high);
+	}
+      }
+      return m_max;
+    }
+
+    unsigned long long count() const { return m_count; }
+    unsigned long long sum() const { return m_sum; }
+    unsigned long long min() const { return m_min; }
+    unsigned long long max() const { return m_max; }
+    double mean() const { return m_count == 0 ? 0.0 : double(m_sum) / m_count; }
+
+  private:
+    static size_t const linear = 32;
+    static size_t const sub_buckets = 16;
+    static size_t const bucket_count = linear + 59 * sub_buckets;
+
+    static size_t bucket(unsigned long long value) {
+      if (value < linear) return value;
+      int msb = 63 - __builtin_clzll(value);
+      int shift = msb - 4;
+      return linear + (shift - 1) * sub_buckets + ((value >> shift) - sub_buckets);
+    }
+
+    static unsigned long long highest(size_t bucket) {
+      if (bucket < linear) return bucket;
+      size_t shift = (bucket - linear) / sub_buckets + 1;
+      unsigned long long top = (bucket - linear) % sub_buckets + sub_buckets;
+      return ((top + 1) << shift) - 1;
+    }
+
+    std::vector<unsigned long long> m_counts;
+    unsigned long long m_count;
+    unsigned long long m_sum;
+    unsigned long long m_min;
+    unsigned long long m_max;
+  };
+
+  /**
+   * What a Session knows about one kind of operation on one collection.
+   * Latencies are in microseconds.  For "encode" and "decode" the latency is
+   * time spent in the Mapper rather than on the network.
+   */
+  struct OperationStats {
+    OperationStats() : documents(0), bytes_sent(0), bytes_received(0) { }
+
+    void merge(OperationStats const& other) {
+      latency.merge(other.latency);
+      documents += other.documents;
+      bytes_sent += other.bytes_sent;
+      bytes_received += other.bytes_received;
+    }
+
+    Histogram latency;
+    unsigned long long documents;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+  };
+
+  /**
+   * A snapshot of a Session's statistics, per collection and operation.
+   * Operations are "query", "getMore", "insert", "update", "upsert",
+   * "remove", "encode" and "decode".
+   */
+  class SessionStats {
+  public:
+    typedef std::pair<std::string, std::string> Key;
+    typedef std::map<Key, OperationStats> Operations;
+
+    /**
+     * Gets the statistics for one operation on one collection.
+     * @param collection the name of the collection
+     * @param operation the name of the operation
+     * @return the statistics; empty if the operation never ran
+     */
+    OperationStats operation(std::string const& collection,
+			     std::string const& operation) const {
+      Operations::const_iterator i = m_operations.find(Key(collection, operation));
+      return i == m_operations.end() ? OperationStats() : i->second;
+    }
+
+    /**
+     * Gets the statistics for one operation across all collections.
+     * @param operation the name of the operation
+     * @return the merged statistics
+     */
+    OperationStats total(std::string const& operation) const {
+      OperationStats res;
+      for (Operations::const_iterator i = m_operations.begin(); i != m_operations.end(); ++i) {
+	if (i->first.second == operation) res.merge(i->second);
+      }
+      return res;
+    }
+
+    Operations const& operations() const { return m_operations; }
+
+  private:
+    friend class StatsRecorder;
+    Operations m_operations;
+  };
+
+  /**
+   * Collects statistics for a Session.  Safe to record into from several
+   * threads at once.
+   */
+  class StatsRecorder {
+  public:
+
+    /**
+     * Records one operation.
+     * @param collection the name of the collection
+     * @param operation the name of the operation
+     * @param micros how long it took
+     * @param documents how many documents it carried
+     * @param bytes_sent how many bytes of BSON went to the server
+     * @param bytes_received how many bytes of BSON came back
+     */
+    void record(std::string const& collection, char const* operation,
+		unsigned long long micros, size_t documents,
+		size_t bytes_sent, size_t bytes_received) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      OperationStats &stats = m_stats.m_operations[SessionStats::Key(collection, operation)];
+      stats.latency.record(micros);
+      stats.documents += documents;
+      stats.bytes_sent += bytes_sent;
+      stats.bytes_received += bytes_received;
+    }
+
+    /**
+     * Records documents arriving without timing anything.
+     * @param collection the name of the collection
+     * @param operation the name of the operation they arrived from
+     * @param documents how many documents arrived, if not already counted
+     * @param bytes_received how many bytes of BSON arrived
+     */
+    void received(std::string const& collection, char const* operation,
+		  size_t documents, size_t bytes_received) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      OperationStats &stats = m_stats.m_operations[SessionStats::Key(collection, operation)];
+      stats.documents += documents;
+      stats.bytes_received += bytes_received;
+    }
+
+    SessionStats snapshot() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_stats;
+    }
+
+    void reset() {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_stats = SessionStats();
+    }
+
+  private:
+    mutable boost::mutex m_mutex;
+    SessionStats m_stats;
+  };
+
+  /**
+   * Times an operation for its scope and records it on the way out.  Does
+   * nothing at all when given no recorder.
+   */
+  class ScopedOperation {
+  public:
+    ScopedOperation(StatsRecorder *stats, std::string const& collection,
+		    char const* operation, size_t documents = 1,
+		    size_t bytes_sent = 0)
+      : m_stats(stats), m_collection(collection), m_operation(operation),
+	m_documents(documents), m_bytes_sent(bytes_sent),
+	m_start(stats ? now_micros() : 0) { }
+
+    ~ScopedOperation() {
+      if (m_stats) {
+	m_stats->record(m_collection, m_operation, now_micros() - m_start,
+			m_documents, m_bytes_sent, 0);
+      }
+    }
+
+  private:
+    StatsRecorder *m_stats;
+    std::string const& m_collection;
+    char const* m_operation;
+    size_t m_documents;
+    size_t m_bytes_sent;
+    unsigned long long m_start;
+  };
+
+};
+
+#endif
@@ -4,7 +4,7 @@
 */
 
 #ifndef MONGOXX_TABLE_HH
-#define MONOGXX_TABLE_HH
+#define MONGOXX_TABLE_HH
 
 #include "field.hh"
 #include "mapper.hh"
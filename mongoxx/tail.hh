@@ -0,0 +1,262 @@
+/* tail.hh
+   Follows a capped collection with a tailable cursor, delivering documents
+   as they are inserted.
+
+*/
+
+#ifndef MONGOXX_TAIL_HH
+#define MONGOXX_TAIL_HH
+
+#include "mongo/client/dbclient.h"
+#include "mongo/client/connpool.h"
+
+#include "filter.hh"
+#include "mapper.hh"
+#include "queue.hh"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tr1/memory>
+
+namespace mongoxx {
+
+  /**
+   * A Tail follows a capped collection the way tail -f follows a file.  A
+   * background thread, on a connection of its own, holds a tailable,
+   * await-data cursor open, so each new document arrives as soon as it is
+   * inserted with no polling.  Objects are decoded there and handed out
+   * through a bounded queue, or to a callback on that thread.
+   *
+   *   std::tr1::shared_ptr<Tail<Event> > events = session.query(table).tail();
+   *   for (Event event; events->next(event); ) ...
+   *
+   * If the cursor dies (the connection drops, or the collection wraps
+   * past it) the Tail re-queries for documents after the last one it saw,
+   * by a field that grows in insertion order; _id does, for ObjectIds made
+   * by one client.  The last position can be saved and handed to a new
+   * Tail to carry on after a restart.
+   */
+  template <typename T>
+  class Tail {
+  public:
+
+    /**
+     * Counters describing how the tail is doing.
+     */
+    struct Stats {
+      Stats() : delivered(0), requeries(0), failures(0), decode_failures(0) { }
+      unsigned long long delivered;       ///< objects handed out
+      unsigned long long requeries;       ///< times the cursor was reopened
+      unsigned long long failures;        ///< connection or query errors
+      unsigned long long decode_failures; ///< documents skipped as undecodable
+    };
+
+    /**
+     * Plans a tail.  Nothing happens until start() or next().
+     * @param host the server
+     * @param collection the full name of the capped collection
+     * @param mapper the mapper to decode with
+     * @param filter restricts which documents are delivered
+     * @param after a position from last(), to deliver only what follows it;
+     *   empty for everything already in the collection
+     * @param field the field positions are taken from
+     * @param capacity how many objects the queue holds before the tail waits
+     * @param retry_ms how long to wait before reopening a dead cursor
+     */
+    Tail(std::string const& host, std::string const& collection,
+	 Mapper<T> const* mapper, Filter const& filter = Filter(),
+	 mongo::BSONObj const& after = mongo::BSONObj(),
+	 std::string const& field = "_id", size_t capacity = 1000,
+	 unsigned int retry_ms = 100)
+      : m_host(host), m_collection(collection), m_mapper(mapper), m_filter(filter),
+	m_field(field), m_last(after.getOwned()), m_retry_ms(retry_ms),
+	m_queue(capacity), m_queue_sink(&m_queue), m_sink(0), m_stopping(false) { }
+
+    ~Tail() {
+      stop();
+    }
+
+    /**
+     * Starts tailing into the queue, for next().
+     */
+    void start() {
+      start(&m_queue_sink);
+    }
+
+    /**
+     * Starts tailing, calling a function on each object from the tail's
+     * thread.
+     * @param f called as f(t); must outlive the tail, or its stop()
+     */
+    template <typename F>
+    void start(F &f) {
+      std::auto_ptr<Sink<T> > sink(new CallbackSink<T, F>(f));
+      start(sink.get());
+      m_callback = sink;
+    }
+
+    /**
+     * Gets the next object, waiting for one to be inserted if need be.
+     * Starts tailing into the queue if nothing has started yet.
+     * @param t where to store the object
+     * @return false once stopped
+     */
+    bool next(T &t) {
+      if (not m_thread.joinable()) start();
+      return m_queue.pop(t);
+    }
+
+    /**
+     * Stops tailing.  A cursor waiting on the server for data finishes
+     * that wait (a second or two) first.
+     */
+    void stop() {
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stopping = true;
+      }
+      m_wakeup.notify_all();
+      m_queue.cancel();
+      if (m_thread.joinable()) m_thread.join();
+    }
+
+    /**
+     * Gets the position of the last object delivered, for resuming later.
+     * @return a one-field document holding its position, or empty
+     */
+    mongo::BSONObj last() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_last;
+    }
+
+    Stats stats() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_stats;
+    }
+
+  private:
+    void start(Sink<T> *sink) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (m_thread.joinable()) throw std::logic_error("Tail has already been started.");
+      m_sink = sink;
+      m_thread = boost::thread(&Tail::run, this);
+    }
+
+    mongo::Query query() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (m_last.isEmpty()) return mongo::Query(m_filter.to_bson());
+      mongo::BSONObjBuilder after;
+      after.appendAs(m_last.firstElement(), "$gt");
+      mongo::BSONObjBuilder range;
+      range.append(m_field, after.obj());
+      return mongo::Query(Filter(m_filter, Filter(range.obj())).to_bson());
+    }
+
+    bool stopping() const {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      return m_stopping;
+    }
+
+    void run() {
+      bool first = true;
+      while (not stopping()) {
+	try {
+	  mongo::ScopedDbConnection connection(m_host);
+	  while (not stopping()) {
+	    if (not first) {
+	      boost::lock_guard<boost::mutex> lock(m_mutex);
+	      ++m_stats.requeries;
+	    }
+	    first = false;
+	    std::auto_ptr<mongo::DBClientCursor> cursor =
+	      connection->query(m_collection, query(), 0, 0, 0,
+				mongo::QueryOption_CursorTailable | mongo::QueryOption_AwaitData);
+	    if (not cursor.get()) throw std::runtime_error("Tailable query returned no cursor.");
+	    while (not stopping()) {
+	      // An await-data cursor makes more() wait a while on the server.
+	      if (cursor->more()) {
+		if (not deliver(cursor->nextSafe())) break;
+	      } else if (cursor->isDead()) {
+		break;
+	      }
+	    }
+	    if (not wait_to_retry(m_mutex, m_wakeup, m_stopping, m_retry_ms)) break;
+	  }
+	  connection.done();
+	} catch (std::exception const&) {
+	  {
+	    boost::lock_guard<boost::mutex> lock(m_mutex);
+	    ++m_stats.failures;
+	  }
+	  if (not wait_to_retry(m_mutex, m_wakeup, m_stopping, m_retry_ms)) break;
+	}
+      }
+    }
+
+    bool deliver(mongo::BSONObj const& document) {
+      T t;
+      try {
+	m_mapper->from_bson(document, t);
+      } catch (std::exception const&) {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	++m_stats.decode_failures;
+	note(document);
+	return true;
+      }
+      // The position moves first, so last() covers anything already
+      // handed out; it moves back if the object never was.
+      mongo::BSONObj previous;
+      {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	previous = m_last;
+	note(document);
+      }
+      bool delivered = m_sink->deliver(t);
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (not delivered) {
+	m_last = previous;
+	return false;
+      }
+      ++m_stats.delivered;
+      return true;
+    }
+
+    // Remembers a document's position.  Call with the lock held.
+    void note(mongo::BSONObj const& document) {
+      mongo::BSONElement position = document.getFieldDotted(m_field);
+      if (position.eoo()) return;
+      mongo::BSONObjBuilder last;
+      last.appendAs(position, m_field);
+      m_last = last.obj();
+    }
+
+    Tail(Tail const&);
+    Tail& operator=(Tail const&);
+
+    std::string m_host;
+    std::string m_collection;
+    Mapper<T> const* m_mapper;
+    Filter m_filter;
+    std::string m_field;
+    mongo::BSONObj m_last;
+    unsigned int m_retry_ms;
+    BoundedQueue<T> m_queue;
+    QueueSink<T> m_queue_sink;
+    Sink<T> *m_sink;
+    std::auto_ptr<Sink<T> > m_callback;
+    bool m_stopping;
+    Stats m_stats;
+    boost::thread m_thread;
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_wakeup;
+  };
+
+};
+
+#endif
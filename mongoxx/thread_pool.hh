@@ -0,0 +1,80 @@
+/* thread_pool.hh
+   A fixed set of worker threads running submitted tasks.
+
+*/
+
+#ifndef MONGOXX_THREAD_POOL_HH
+#define MONGOXX_THREAD_POOL_HH
+
+#include "queue.hh"
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace mongoxx {
+
+  /**
+   * A ThreadPool runs tasks on a fixed number of threads, in the order they
+   * were submitted (though several at once).  Tasks should catch their own
+   * exceptions; any that escape are dropped.  Destroying the pool finishes
+   * the tasks already submitted, then joins the threads.
+   *
+   *   ThreadPool pool(4);
+   *   pool.submit(boost::bind(&encode, &chunk));
+   */
+  class ThreadPool {
+  public:
+    typedef boost::function<void ()> Task;
+
+    /**
+     * Starts the threads.
+     * @param threads how many; 0 for one per core
+     * @param backlog how many tasks may wait before submit() blocks
+     */
+    explicit ThreadPool(unsigned int threads = 0, size_t backlog = 1024)
+      : m_tasks(backlog) {
+      if (threads == 0) threads = boost::thread::hardware_concurrency();
+      if (threads == 0) threads = 1;
+      m_size = threads;
+      for (unsigned int k = 0; k < threads; ++k) {
+	m_threads.add_thread(new boost::thread(&ThreadPool::work, this));
+      }
+    }
+
+    ~ThreadPool() {
+      m_tasks.close();
+      m_threads.join_all();
+    }
+
+    /**
+     * Queues a task, waiting for room if the backlog is full.
+     * @param task the task
+     */
+    void submit(Task const& task) {
+      m_tasks.push(task);
+    }
+
+    unsigned int size() const { return m_size; }
+
+  private:
+    void work() {
+      for (Task task; m_tasks.pop(task); task.clear()) {
+	try {
+	  task();
+	} catch (...) {
+	  // Nobody to tell.
+	}
+      }
+    }
+
+    ThreadPool(ThreadPool const&);
+    ThreadPool& operator=(ThreadPool const&);
+
+    BoundedQueue<Task> m_tasks;
+    boost::thread_group m_threads;
+    unsigned int m_size;
+  };
+
+};
+
+#endif
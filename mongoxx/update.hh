@@ -70,6 +70,17 @@ namespace mongoxx {
     return Update(a, b);
   }
 
+  /**
+   * How a findAndModify should behave.
+   */
+  struct ModifyOptions {
+    ModifyOptions() : return_new(false), upsert(false), remove(false) { }
+    bool return_new;        ///< return the document as modified, not as found
+    bool upsert;            ///< insert a document if none matches
+    bool remove;            ///< remove the document rather than update it
+    mongo::BSONObj fields;  ///< which fields to return; empty for all
+  };
+
 };
 
 #endif
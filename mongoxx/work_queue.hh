@@ -0,0 +1,253 @@
+/* work_queue.hh
+   A job queue kept in a collection, claimed with findAndModify.
+
+*/
+
+#ifndef MONGOXX_WORK_QUEUE_HH
+#define MONGOXX_WORK_QUEUE_HH
+
+#include "mongo/client/dbclient.h"
+
+#include "mapper.hh"
+#include "pipeline.hh"
+#include "session.hh"
+#include "stats.hh"
+#include "update.hh"
+
+#include <string>
+#include <vector>
+
+namespace mongoxx {
+
+  /**
+   * A WorkQueue keeps jobs in a collection that any number of workers, in
+   * any number of processes, pull from.  Claiming a job is a single
+   * findAndModify, so no two workers get the same job and each claim is
+   * one round trip; claim(n) pipelines n of them into one round trip.
+   *
+   *   WorkQueue<Job> queue(&session, "test.jobs", &mapper);
+   *   queue.push(job);
+   *   ...
+   *   WorkQueue<Job>::Claim claim;
+   *   while (queue.claim(claim)) {
+   *     if (run(claim.job)) queue.ack(claim);
+   *     else queue.retry(claim, 1000);
+   *   }
+   *
+   * A claimed job is leased to its worker for a while, then becomes
+   * claimable again; a worker that dies loses nothing, its jobs just wait
+   * out the lease.  Long jobs should extend() their lease.  Each claim
+   * counts an attempt, and a job claimed max_attempts times without an ack
+   * is left in the collection as dead, for someone to look at.
+   *
+   * The queue's bookkeeping lives in a "_q" subdocument beside the mapped
+   * fields.  Lease times come from the workers' clocks, which should
+   * roughly agree.  Index {"_q.visible": 1} on a queue of any size.
+   */
+  template <typename T>
+  class WorkQueue {
+  public:
+
+    /**
+     * A claimed job.
+     */
+    struct Claim {
+      Claim() : attempts(0) { }
+      T job;               ///< the job
+      mongo::BSONObj id;   ///< {_id: ...} of its document
+      std::string lease;   ///< the lease it is held under
+      int attempts;        ///< times it has been claimed, this one included
+    };
+
+    /**
+     * @param session the session to run on; one worker thread per session
+     * @param collection the full name of the collection, "db.collection"
+     * @param mapper the mapper to encode and decode jobs with
+     * @param lease_ms how long a claim lasts before the job is claimable again
+     * @param max_attempts how many claims a job gets; 0 for no limit
+     */
+    WorkQueue(Session *session, std::string const& collection, Mapper<T> const* mapper,
+	      unsigned int lease_ms = 30000, int max_attempts = 5)
+      : m_session(session), m_collection(collection), m_mapper(mapper),
+	m_lease_ms(lease_ms), m_max_attempts(max_attempts) { }
+
+    /**
+     * Adds a job.
+     * @param job the job
+     * @param delay_ms how long before it may be claimed
+     */
+    void push(T const& job, unsigned int delay_ms = 0) {
+      m_session->insert(m_collection, encode(job, now_ms() + delay_ms));
+    }
+
+    /**
+     * Adds many jobs in one message.
+     * @param jobs the jobs
+     * @param delay_ms how long before they may be claimed
+     */
+    void push_all(std::vector<T> const& jobs, unsigned int delay_ms = 0) {
+      long long visible = now_ms() + delay_ms;
+      std::vector<mongo::BSONObj> documents;
+      documents.reserve(jobs.size());
+      for (typename std::vector<T>::const_iterator i = jobs.begin(); i != jobs.end(); ++i) {
+	documents.push_back(encode(*i, visible));
+      }
+      m_session->insert(m_collection, documents);
+    }
+
+    /**
+     * Claims the job that has been claimable longest.
+     * @param claim where to store it
+     * @return false if no job is claimable
+     */
+    bool claim(Claim &claim) {
+      long long now = now_ms();
+      mongo::BSONObj document;
+      if (not m_session->find_and_modify(m_collection, claimable(now), order(),
+					 claim_update(now), returning_new(), document)) {
+	return false;
+      }
+      decode(document, claim);
+      return true;
+    }
+
+    /**
+     * Claims several jobs in one round trip.
+     * @param n the most jobs to claim
+     * @return the jobs claimed; fewer than n if fewer were claimable
+     */
+    std::vector<Claim> claim(size_t n) {
+      std::vector<Claim> claims;
+      if (n == 0) return claims;
+      long long now = now_ms();
+      mongo::BSONObj filter = claimable(now), update = claim_update(now);
+      Pipeline pipeline = m_session->pipeline();
+      for (size_t k = 0; k < n; ++k) {
+	pipeline.find_and_modify(m_collection, filter, order(), update, returning_new());
+      }
+      pipeline.execute();
+      for (size_t k = 0; k < n; ++k) {
+	mongo::BSONObj document;
+	if (not pipeline.modified(k, document)) break;
+	claims.push_back(Claim());
+	decode(document, claims.back());
+      }
+      return claims;
+    }
+
+    /**
+     * Finishes a job, removing it.
+     * @param claim the claim
+     * @return false if the lease had run out and the job been claimed again
+     */
+    bool ack(Claim const& claim) {
+      ModifyOptions options;
+      options.remove = true;
+      mongo::BSONObj document;
+      return m_session->find_and_modify(m_collection, held(claim), mongo::BSONObj(),
+					mongo::BSONObj(), options, document);
+    }
+
+    /**
+     * Gives a job back, to be claimed again later.  It keeps its attempts.
+     * @param claim the claim
+     * @param delay_ms how long before it may be claimed
+     * @return false if the lease had run out and the job been claimed again
+     */
+    bool retry(Claim const& claim, unsigned int delay_ms = 0) {
+      mongo::BSONObj update = BSON("$set" << BSON("_q.visible" << now_ms() + delay_ms)
+				   << "$unset" << BSON("_q.lease" << 1));
+      mongo::BSONObj document;
+      return m_session->find_and_modify(m_collection, held(claim), mongo::BSONObj(),
+					update, ModifyOptions(), document);
+    }
+
+    /**
+     * Extends a lease, for a job that is taking a while.
+     * @param claim the claim
+     * @param lease_ms how long from now the lease should last
+     * @return false if the lease had already run out and the job been
+     *   claimed again; the worker should abandon it
+     */
+    bool extend(Claim const& claim, unsigned int lease_ms) {
+      mongo::BSONObj update = BSON("$set" << BSON("_q.visible" << now_ms() + lease_ms));
+      mongo::BSONObj document;
+      return m_session->find_and_modify(m_collection, held(claim), mongo::BSONObj(),
+					update, ModifyOptions(), document);
+    }
+
+    /**
+     * Counts the jobs that could be claimed now.
+     */
+    unsigned long long ready() {
+      return m_session->count(m_collection, claimable(now_ms()));
+    }
+
+    /**
+     * Counts the jobs that have used up their attempts.
+     */
+    unsigned long long dead() {
+      if (m_max_attempts <= 0) return 0;
+      return m_session->count(m_collection, BSON("_q.attempts" << BSON("$gte" << m_max_attempts)));
+    }
+
+  private:
+    static long long now_ms() {
+      return static_cast<long long>(now_micros() / 1000);
+    }
+
+    mongo::BSONObj encode(T const& job, long long visible) const {
+      mongo::BSONObjBuilder builder;
+      m_mapper->to_bson(job, builder);
+      builder.append("_q", BSON("visible" << visible << "attempts" << 0));
+      return builder.obj();
+    }
+
+    void decode(mongo::BSONObj const& document, Claim &claim) const {
+      m_mapper->from_bson(document, claim.job);
+      claim.id = document["_id"].wrap();
+      claim.lease = document.getFieldDotted("_q.lease").str();
+      claim.attempts = document.getFieldDotted("_q.attempts").numberInt();
+    }
+
+    mongo::BSONObj claimable(long long now) const {
+      mongo::BSONObjBuilder filter;
+      filter.append("_q.visible", BSON("$lte" << now));
+      if (m_max_attempts > 0) filter.append("_q.attempts", BSON("$lt" << m_max_attempts));
+      return filter.obj();
+    }
+
+    static mongo::BSONObj order() {
+      return BSON("_q.visible" << 1);
+    }
+
+    // Leases the job to a fresh lease.
+    mongo::BSONObj claim_update(long long now) const {
+      return BSON("$set" << BSON("_q.visible" << now + m_lease_ms << "_q.lease" << mongo::OID::gen().str())
+		  << "$inc" << BSON("_q.attempts" << 1));
+    }
+
+    static ModifyOptions returning_new() {
+      ModifyOptions options;
+      options.return_new = true;
+      return options;
+    }
+
+    // Selects a claimed job, so long as the claim still holds it.
+    static mongo::BSONObj held(Claim const& claim) {
+      mongo::BSONObjBuilder filter;
+      filter.appendElements(claim.id);
+      filter.append("_q.lease", claim.lease);
+      return filter.obj();
+    }
+
+    Session *m_session;
+    std::string m_collection;
+    Mapper<T> const* m_mapper;
+    long long m_lease_ms;
+    int m_max_attempts;
+  };
+
+};
+
+#endif
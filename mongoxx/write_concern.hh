@@ -0,0 +1,53 @@
+/* write_concern.hh
+   How, and how often, writes are acknowledged.
+
+*/
+
+#ifndef MONGOXX_WRITE_CONCERN_HH
+#define MONGOXX_WRITE_CONCERN_HH
+
+namespace mongoxx {
+
+  /**
+   * A WriteConcern says whether the server is asked to acknowledge writes,
+   * and how many writes share each acknowledgement.
+   *
+   *   WriteConcern::none()      send and forget, as the legacy protocol
+   *                             does; cheapest, but failures go unseen
+   *   WriteConcern::every(n)    hold writes back and send them n at a
+   *                             time, one acknowledged round trip for n
+   *   WriteConcern::batched()   acknowledge every call, so each write,
+   *                             or each chunk of a bulk insert, costs a
+   *                             round trip
+   *
+   * Acknowledged writes go through the server's write commands, which
+   * report each failed document by its position; they are thrown as a
+   * write_error whose WriteErrors carry the failed documents.  Writes held
+   * back by every(n) go out once n have built up, when a read or another
+   * kind of write touches their collection, or on Session::flush(), and
+   * their failures are thrown from whichever call sent them.  They are
+   * sent unordered, so one failure doesn't stop the rest, as with
+   * unacknowledged writes.
+   *
+   *   session.write_concern("test.log", WriteConcern::every(100));
+   *   session.write_concern("test.accounts", WriteConcern::batched());
+   */
+  struct WriteConcern {
+    enum Mode { unacknowledged, every_n, per_batch };
+
+    explicit WriteConcern(Mode mode = unacknowledged, unsigned int n = 1)
+      : mode(mode), n(n ? n : 1) { }
+
+    static WriteConcern none() { return WriteConcern(unacknowledged); }
+    static WriteConcern every(unsigned int n) { return WriteConcern(every_n, n); }
+    static WriteConcern batched() { return WriteConcern(per_batch); }
+
+    bool acknowledged() const { return mode != unacknowledged; }
+
+    Mode mode;
+    unsigned int n;  ///< for every_n, how many writes share a round trip
+  };
+
+};
+
+#endif
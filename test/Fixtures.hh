@@ -0,0 +1,28 @@
+/* Fixtures.hh
+   The person most tests store, query and map.
+
+*/
+
+#ifndef MONGOXX_TEST_FIXTURES_HH
+#define MONGOXX_TEST_FIXTURES_HH
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+
+
+struct TestPerson {
+  std::string first_name;
+  std::string last_name;
+  int age;
+};
+
+inline mongoxx::Mapper<TestPerson> test_person_mapper() {
+  mongoxx::Mapper<TestPerson> mapper;
+  mapper.add_field("first_name", &TestPerson::first_name);
+  mapper.add_field("last_name", &TestPerson::last_name);
+  mapper.add_field("age", &TestPerson::age);
+  return mapper;
+}
+
+#endif
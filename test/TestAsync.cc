@@ -0,0 +1,145 @@
+/* TestAsync.cc
+   Test futures and the asynchronous session.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct Completions {
+  Completions() : count(0) { }
+  void done(Future<bool> const&) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    ++count;
+  }
+  int total() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return count;
+  }
+  boost::mutex mutex;
+  int count;
+};
+
+struct Seen {
+  Seen(int *seen) : seen(seen) { }
+  void operator()(Future<int> const& future) { *seen = future.get(); }
+  int *seen;
+};
+
+struct SumAgesA {
+  SumAgesA(int *sum) : sum(sum) { }
+  void operator()(TestPerson const& person) { *sum += person.age; }
+  int *sum;
+};
+
+// Unacknowledged inserts land on the server some time after they are
+// sent; waits a while for n documents to arrive.
+static std::vector<mongo::BSONObj> documents_after_inserts(FakeServer const& server,
+							    std::string const& ns, size_t n) {
+  for (int k = 0; k < 1000 and server.documents(ns).size() < n; ++k) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+  return server.documents(ns);
+}
+
+
+TEST(Future_value_and_error) {
+  Future<int> ok;
+  CHECK(not ok.ready());
+  CHECK(not ok.wait(1));
+  ok.set_value(3);
+  CHECK(ok.ready());
+  CHECK_EQUAL(3, ok.get());
+
+  Future<int> bad;
+  bad.set_error("broken");
+  CHECK(bad.failed());
+  CHECK_EQUAL("broken", bad.error());
+  CHECK_THROW(bad.get(), async_error);
+
+  // A callback may read the result it was called for.
+  Future<int> later;
+  int seen = 0;
+  later.on_complete(Seen(&seen));
+  later.set_value(5);
+  CHECK_EQUAL(5, seen);
+}
+
+
+TEST(AsyncSession_inserts_and_queries) {
+  FakeServer server(5000);
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  Completions completions;
+  std::vector<Future<bool> > inserts;
+  {
+    AsyncSession async(server.host(), 8);
+    for (int age = 0; age < 40; ++age) {
+      TestPerson person = { "Person", "Saalweachter", age };
+      inserts.push_back(async.insert("test.person", &mapper, person));
+      inserts.back().on_complete(boost::bind(&Completions::done, &completions, _1));
+    }
+    // A future is ready only once its callbacks have run.
+    for (size_t k = 0; k < inserts.size(); ++k) CHECK(inserts[k].get());
+    CHECK_EQUAL(40, completions.total());
+
+    // The inserts were sent unacknowledged on the workers' connections, so
+    // query a copy put straight into the server.
+    for (int age = 0; age < 40; ++age) {
+      server.insert("test.copy", BSON("first_name" << "Person" << "last_name" << "Saalweachter"
+				      << "age" << age));
+    }
+    Future<std::vector<TestPerson> > adults =
+      async.all(session.query("test.copy", &mapper).filter(mapper[&TestPerson::age] >= 18));
+    Future<TestPerson> youngest =
+      async.first(session.query("test.copy", &mapper).ascending(&TestPerson::age));
+    int sum = 0;
+    Future<size_t> each = async.each(session.query("test.copy", &mapper), SumAgesA(&sum));
+
+    CHECK_EQUAL(22u, adults.get().size());
+    CHECK_EQUAL(0, youngest.get().age);
+    CHECK_EQUAL(40u, each.get());
+    CHECK_EQUAL(39 * 40 / 2, sum);
+  }
+
+  std::vector<mongo::BSONObj> people = documents_after_inserts(server, "test.person", 40);
+  CHECK_EQUAL(40u, people.size());
+  std::set<int> ages;
+  for (size_t k = 0; k < people.size(); ++k) ages.insert(people[k]["age"].numberInt());
+  CHECK_EQUAL(40u, ages.size());
+  CHECK_EQUAL(0, *ages.begin());
+  CHECK_EQUAL(39, *ages.rbegin());
+}
+
+
+TEST(AsyncSession_failures) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  AsyncSession async(server.host(), 2);
+
+  Future<TestPerson> nobody = async.first(session.query("test.person", &mapper));
+  nobody.wait();
+  CHECK(nobody.failed());
+  CHECK_THROW(nobody.get(), async_error);
+
+  Future<bool> updated = async.update(session.query("test.person", &mapper),
+				      Update("$set", BSON("age" << 1)));
+  CHECK(updated.get());
+}
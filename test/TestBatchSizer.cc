@@ -0,0 +1,111 @@
+/* TestBatchSizer.cc
+   Test batch sizes that follow the server's latency.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct PointBs {
+  int id;
+  double x;
+};
+
+
+TEST(BatchSizer_grows_while_fast_and_shrinks_when_slow) {
+  BatchSizer sizer(50, 10, 1000);
+  CHECK_EQUAL(10u, sizer.size());
+
+  // 1ms a batch: far under the target, so it grows, but at most double.
+  size_t last = sizer.size();
+  for (int k = 0; k < 30; ++k) {
+    sizer.record(sizer.size(), 1000);
+    CHECK(sizer.size() <= 2 * last);
+    last = sizer.size();
+  }
+  CHECK_EQUAL(1000u, sizer.size());
+
+  // 500ms a batch: ten times the target, so it falls back, but at most half.
+  for (int k = 0; k < 30; ++k) {
+    sizer.record(sizer.size(), 500000);
+    CHECK(sizer.size() >= last / 2);
+    last = sizer.size();
+  }
+  CHECK_EQUAL(10u, sizer.size());
+
+  sizer.record(0, 1000000);
+  BatchSizer::Stats stats = sizer.stats();
+  CHECK_EQUAL(60ULL, stats.batches);
+  CHECK_EQUAL(10u, stats.size);
+  CHECK(stats.latency_ms > 50);
+}
+
+
+TEST(BatchSizer_settles_near_the_target) {
+  BatchSizer sizer(100, 1, 100000, 100);
+  // A server doing 10 documents a millisecond fits 1000 in 100ms.
+  for (int k = 0; k < 50; ++k) sizer.record(sizer.size(), sizer.size() * 100ULL);
+  CHECK(sizer.size() > 900 and sizer.size() < 1100);
+}
+
+
+TEST(BatchSizer_sizes_query_batches) {
+  FakeServer server;
+  for (int k = 0; k < 200; ++k) server.insert("test.point", BSON("_id" << k << "x" << k * 0.5));
+  Session session(server.host());
+  Mapper<PointBs> mapper;
+  mapper.add_field("_id", &PointBs::id);
+  mapper.add_field("x", &PointBs::x);
+  std::tr1::shared_ptr<BatchSizer> reads(new BatchSizer(100, 10, 1000));
+  session.size_reads("test.point", reads);
+  CHECK_EQUAL(reads.get(), session.read_sizer("test.point"));
+  CHECK(session.read_sizer("test.other") == NULL);
+
+  CHECK_EQUAL(200u, session.query("test.point", &mapper).all().size());
+  BatchSizer::Stats stats = reads->stats();
+  CHECK(stats.batches > 1);
+  CHECK_EQUAL(200ULL, stats.documents);
+  // Every batch came back well under 100ms, so they grew.
+  CHECK(stats.size > 10);
+
+  session.size_reads("test.point", std::tr1::shared_ptr<BatchSizer>());
+  CHECK(session.read_sizer("test.point") == NULL);
+}
+
+
+TEST(BatchSizer_sizes_acknowledged_writes) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<PointBs> mapper;
+  mapper.add_field("_id", &PointBs::id);
+  mapper.add_field("x", &PointBs::x);
+  std::tr1::shared_ptr<BatchSizer> writes(new BatchSizer(100, 10, 1000));
+  session.size_writes("test.point", writes);
+  session.write_concern("test.point", WriteConcern::batched());
+
+  std::vector<PointBs> points;
+  for (int k = 0; k < 500; ++k) {
+    PointBs point = { k, k * 0.5 };
+    points.push_back(point);
+  }
+  session.inserter("test.point", &mapper).insert_all(points);
+  CHECK_EQUAL(500u, server.documents("test.point").size());
+  BatchSizer::Stats stats = writes->stats();
+  CHECK_EQUAL(500ULL, stats.documents);
+  // Starting at 10 and at most doubling, 500 can't go in fewer than six.
+  CHECK(stats.batches >= 6);
+  CHECK(stats.size > 10);
+
+  for (size_t k = 0; k < points.size(); ++k) points[k].x = -1;
+  session.inserter("test.point", &mapper).upsert_all(points, false);
+  CHECK_EQUAL(1000ULL, writes->stats().documents);
+  CHECK_EQUAL(-1.0, server.documents("test.point")[499]["x"].number());
+}
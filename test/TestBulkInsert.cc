@@ -0,0 +1,120 @@
+/* TestBulkInsert.cc
+   Test chunked and parallel-encoded bulk inserts.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+static std::vector<TestPerson> people(int n) {
+  std::vector<TestPerson> res;
+  for (int age = 0; age < n; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    res.push_back(person);
+  }
+  return res;
+}
+
+struct Counter {
+  Counter() : count(0) { }
+  void add(int n) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    count += n;
+  }
+  boost::mutex mutex;
+  int count;
+};
+
+
+TEST(ThreadPool_runs_everything) {
+  Counter counter;
+  {
+    ThreadPool pool(3);
+    CHECK_EQUAL(3u, pool.size());
+    for (int k = 1; k <= 100; ++k) pool.submit(boost::bind(&Counter::add, &counter, k));
+  }
+  CHECK_EQUAL(5050, counter.count);
+}
+
+
+TEST(BulkInsert_chunked) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  session.inserter("test.person", &mapper).insert_all(people(25), true, 10);
+  // Unacknowledged; the count waits behind the inserts on the connection.
+  CHECK_EQUAL(25ULL, session.count("test.person", mongo::BSONObj()));
+  std::vector<mongo::BSONObj> documents = server.documents("test.person");
+  CHECK_EQUAL(25u, documents.size());
+  CHECK_EQUAL(24, documents.back()["age"].numberInt());
+}
+
+
+TEST(BulkInsert_zero_chunk) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  session.inserter("test.person", &mapper).insert_all(people(3), true, 0);
+  CHECK_EQUAL(3ULL, session.count("test.person", mongo::BSONObj()));
+}
+
+
+TEST(BulkInsert_splits_large_messages) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  std::vector<TestPerson> big = people(400);
+  for (size_t k = 0; k < big.size(); ++k) big[k].last_name = std::string(50 * 1024, 'x');
+
+  unsigned long long before = server.requests();
+  session.inserter("test.person", &mapper).insert_all(big, true, 400);
+  CHECK_EQUAL(400ULL, session.count("test.person", mongo::BSONObj()));
+  // 20MB goes in two inserts, under the server's message limit, and the count.
+  CHECK_EQUAL(3ULL, server.requests() - before);
+}
+
+
+TEST(BulkInsert_parallel_keeps_order) {
+  FakeServer server;
+  Session session(server.host());
+  session.enable_stats();
+  Mapper<TestPerson> mapper = test_person_mapper();
+  ThreadPool pool(4);
+
+  session.inserter("test.person", &mapper).insert_all(people(1000), pool, true, 37);
+  CHECK_EQUAL(1000ULL, session.count("test.person", mongo::BSONObj()));
+  std::vector<mongo::BSONObj> documents = server.documents("test.person");
+  CHECK_EQUAL(1000u, documents.size());
+  for (int age = 0; age < 1000; ++age) CHECK_EQUAL(age, documents[age]["age"].numberInt());
+}
+
+
+TEST(BulkInsert_parallel_unordered) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  ThreadPool pool(2);
+
+  session.inserter("test.person", &mapper).insert_all(people(500), pool, false, 50);
+  std::vector<TestPerson> found = session.query("test.person", &mapper)
+    .ascending(&TestPerson::age).all();
+  CHECK_EQUAL(500u, found.size());
+  CHECK_EQUAL(0, found.front().age);
+  CHECK_EQUAL(499, found.back().age);
+}
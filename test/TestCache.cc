@@ -0,0 +1,134 @@
+/* TestCache.cc
+   Test the query result cache, both on its own and through a Session.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <boost/thread.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+TEST(QueryCache_hit_miss) {
+  QueryCache cache(100, 60000);
+  std::string key = QueryCache::key("test.cache", mongo::Query(), 0, 0, 0);
+
+  std::vector<int> res;
+  CHECK(not cache.get(key, "test.cache", res));
+
+  std::vector<int> values;
+  values.push_back(1);
+  values.push_back(2);
+  cache.put(key, "test.cache", values);
+
+  CHECK(cache.get(key, "test.cache", res));
+  CHECK_EQUAL(2U, res.size());
+
+  QueryCache::Stats stats = cache.stats();
+  CHECK_EQUAL(1U, stats.hits);
+  CHECK_EQUAL(1U, stats.misses);
+  CHECK_EQUAL(1U, stats.entries);
+  CHECK_EQUAL(2U, stats.documents);
+}
+
+
+TEST(QueryCache_checks_type) {
+  QueryCache cache(100, 60000);
+  std::string key = QueryCache::key("test.cache", mongo::Query(), 0, 0, 0);
+  cache.put(key, "test.cache", std::vector<int>(3, 7));
+
+  // The same key, as if a Mapper of another type had taken the address.
+  std::vector<std::string> names;
+  CHECK(not cache.get(key, "test.cache", names));
+  CHECK(names.empty());
+  CHECK_EQUAL(0U, cache.stats().entries);
+
+  cache.put(key, "test.cache", std::vector<std::string>(1, "x"));
+  CHECK(cache.get(key, "test.cache", names));
+  CHECK_EQUAL("x", names[0]);
+}
+
+
+TEST(QueryCache_lru) {
+  QueryCache cache(2, 60000);
+  std::string a = QueryCache::key("test.cache", mongo::Query(), 1, 0, 0);
+  std::string b = QueryCache::key("test.cache", mongo::Query(), 2, 0, 0);
+  std::string c = QueryCache::key("test.cache", mongo::Query(), 3, 0, 0);
+
+  std::vector<int> one(1, 1);
+  std::vector<int> res;
+  cache.put(a, "test.cache", one);
+  cache.put(b, "test.cache", one);
+  CHECK(cache.get(a, "test.cache", res));
+  cache.put(c, "test.cache", one);
+
+  CHECK(cache.get(a, "test.cache", res));
+  CHECK(not cache.get(b, "test.cache", res));
+  CHECK(cache.get(c, "test.cache", res));
+  CHECK_EQUAL(1U, cache.stats().evictions);
+}
+
+
+TEST(QueryCache_ttl) {
+  QueryCache cache(100, 10);
+  std::string key = QueryCache::key("test.cache", mongo::Query(), 0, 0, 0);
+
+  std::vector<int> one(1, 1);
+  std::vector<int> res;
+  cache.put(key, "test.cache", one);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+
+  CHECK(not cache.get(key, "test.cache", res));
+  CHECK_EQUAL(1U, cache.stats().expirations);
+}
+
+
+TEST(QueryCache_invalidate) {
+  QueryCache cache(100, 60000);
+  std::string key = QueryCache::key("test.cache", mongo::Query(), 0, 0, 0);
+  std::string other = QueryCache::key("test.other", mongo::Query(), 0, 0, 0);
+
+  std::vector<int> one(1, 1);
+  std::vector<int> res;
+  cache.put(key, "test.cache", one);
+  cache.put(other, "test.other", one);
+  cache.invalidate("test.cache");
+
+  CHECK(not cache.get(key, "test.cache", res));
+  CHECK(cache.get(other, "test.other", res));
+}
+
+
+struct PersonC {
+  std::string first_name;
+  std::string last_name;
+};
+
+
+TEST(Session_cache) {
+  Session session("localhost");
+  session.enable_cache(1000, 60000);
+
+  Table<PersonC> table("test.session_cache");
+  table.add_field("first_name", &PersonC::first_name);
+  table.add_field("last_name", &PersonC::last_name);
+
+  session.query(table).remove_all();
+  CHECK_EQUAL(0U, session.query(table).all().size());
+  CHECK_EQUAL(0U, session.query(table).all().size());
+  CHECK_EQUAL(1U, session.cache_stats().hits);
+
+  PersonC person = { "Jack", "Saalweachter" };
+  session.inserter(table).insert(person);
+
+  CHECK_EQUAL(1U, session.query(table).all().size());
+  CHECK_EQUAL("Jack", session.query(table).first().first_name);
+  CHECK_EQUAL("Jack", session.query(table).first().first_name);
+  CHECK_EQUAL(2U, session.cache_stats().hits);
+}
@@ -0,0 +1,82 @@
+/* TestCounterBuffer.cc
+   Test that buffered increments add up and make it to the database.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+
+using namespace mongoxx;
+
+
+struct PageCB {
+  std::string url;
+  int hits;
+  double weight;
+};
+
+
+TEST(CounterBuffer_rejects_set) {
+  Session session("localhost");
+
+  Table<PageCB> table("test.counter_buffer_rejects_set");
+  table.add_field("url", &PageCB::url);
+  table.add_field("hits", &PageCB::hits);
+
+  CounterBuffer counters(&session, 1000, 0);
+  CHECK_THROW(counters.add(session.query(table), table[&PageCB::hits] = 1),
+	      std::invalid_argument);
+
+  // Nothing of a rejected update is kept, not even the $inc part.
+  CHECK_THROW(counters.add(session.query(table),
+			   (table[&PageCB::hits] += 1, table[&PageCB::url] = "/a")),
+	      std::invalid_argument);
+  CHECK_THROW(counters.add(session.query(table), Update("$inc", BSON("hits" << 1 << "url" << "/a"))),
+	      std::invalid_argument);
+  CHECK_EQUAL(0U, counters.pending());
+  CHECK_EQUAL(0U, counters.stats().increments);
+}
+
+
+TEST(CounterBuffer_flush) {
+  Session session("localhost");
+
+  Table<PageCB> table("test.counter_buffer_flush");
+  table.add_field("url", &PageCB::url);
+  table.add_field("hits", &PageCB::hits);
+  table.add_field("weight", &PageCB::weight);
+
+  session.query(table).remove_all();
+  PageCB page1 = { "/a", 0, 0.0 };
+  PageCB page2 = { "/b", 0, 0.0 };
+  session.inserter(table).insert(page1).insert(page2);
+
+  Session counter_session("localhost");
+  {
+    CounterBuffer counters(&counter_session, 1000, 0);
+    for (int i = 0; i < 100; ++i) {
+      counters.add(session.query(table).filter(table[&PageCB::url] == "/a"),
+		   table[&PageCB::hits] += 1);
+    }
+    counters.add(session.query(table).filter(table[&PageCB::url] == "/b"),
+		 (table[&PageCB::hits] += 2, table[&PageCB::weight] += 0.5));
+    CHECK_EQUAL(3U, counters.pending());
+
+    counters.flush();
+    CHECK_EQUAL(0U, counters.pending());
+    CHECK_EQUAL(2U, counters.stats().updates);
+    CHECK_EQUAL(102U, counters.stats().increments);
+
+    CHECK_EQUAL(100, session.query(table).filter(table[&PageCB::url] == "/a").one().hits);
+    CHECK_EQUAL(2, session.query(table).filter(table[&PageCB::url] == "/b").one().hits);
+
+    counters.add(session.query(table).filter(table[&PageCB::url] == "/a"),
+		 table[&PageCB::hits] += 1);
+  }
+
+  // The destructor flushes.
+  CHECK_EQUAL(101, session.query(table).filter(table[&PageCB::url] == "/a").one().hits);
+}
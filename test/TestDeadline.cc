@@ -0,0 +1,96 @@
+/* TestDeadline.cc
+   Test query deadlines and cancellation.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <boost/thread/thread.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+static void insert_people(FakeServer &server, int n) {
+  for (int age = 0; age < n; ++age) {
+    server.insert("test.person", BSON("first_name" << "Person" << "last_name" << "Saalweachter"
+				      << "age" << age));
+  }
+}
+
+// Reads the whole first batch, and one past it.
+static void read_past_first_batch(QueryResult<TestPerson> const& result) {
+  TestPerson person;
+  for (int k = 0; k < 102; ++k) result.next(person);
+}
+
+// OP_KILL_CURSORS has no reply, so the kill lands on the server some time
+// after it is sent; waits a while for it.
+static size_t open_cursors_after_kill(FakeServer const& server) {
+  for (int k = 0; k < 1000 and server.open_cursors() > 0; ++k) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+  return server.open_cursors();
+}
+
+
+TEST(Deadline_met) {
+  FakeServer server;
+  insert_people(server, 10);
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  CHECK_EQUAL(10u, session.query("test.person", &mapper).deadline(1000).all().size());
+}
+
+
+TEST(Deadline_server_side) {
+  FakeServer server(20000);
+  insert_people(server, 10);
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  CHECK_THROW(session.query("test.person", &mapper).deadline(5).all(), timeout_error);
+  CHECK_THROW(session.query("test.person", &mapper).deadline(5).first(), timeout_error);
+}
+
+
+TEST(Deadline_between_batches) {
+  FakeServer server;
+  insert_people(server, 300);
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  QueryResult<TestPerson> result = session.query("test.person", &mapper).deadline(30).result();
+  TestPerson person;
+  CHECK(result.next(person));
+  CHECK_EQUAL(1u, server.open_cursors());
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  CHECK_THROW(read_past_first_batch(result), timeout_error);
+  CHECK_EQUAL(0u, open_cursors_after_kill(server));
+}
+
+
+TEST(Cancel_kills_cursor) {
+  FakeServer server;
+  insert_people(server, 300);
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  CancellationToken token;
+  QueryResult<TestPerson> result = session.query("test.person", &mapper).cancel_with(token).result();
+  TestPerson person;
+  CHECK(result.next(person));
+  token.cancel();
+  CHECK_EQUAL(0u, open_cursors_after_kill(server));
+  CHECK_THROW(read_past_first_batch(result), cancelled_error);
+
+  CHECK_THROW(session.query("test.person", &mapper).cancel_with(token).result(), cancelled_error);
+}
@@ -0,0 +1,193 @@
+/* TestDump.cc
+   Test writing and mapping BSON dump files.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+static void write_people(std::string const& path, int n, unsigned int stride) {
+  Mapper<TestPerson> mapper = test_person_mapper();
+  DumpWriter dump(path, stride);
+  for (int age = 0; age < n; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    dump.write(person, mapper);
+  }
+  dump.close();
+}
+
+static void remove_dump(std::string const& path) {
+  std::remove(path.c_str());
+  std::remove((path + ".idx").c_str());
+}
+
+struct SumAges {
+  SumAges() : sum(0), count(0) { }
+  void operator()(TestPerson const& person) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    sum += person.age;
+    ++count;
+  }
+  boost::mutex mutex;
+  long sum;
+  int count;
+};
+
+
+TEST(Dump_round_trip) {
+  std::string path = "TestDump_round_trip.bson";
+  write_people(path, 100, 16);
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  DumpReader dump(path);
+  CHECK_EQUAL(100u, dump.documents());
+  TestPerson person;
+  int expected = 0;
+  for (DumpRange all = dump.all(); all.next(person, mapper); ++expected) {
+    CHECK_EQUAL(expected, person.age);
+    CHECK_EQUAL("Saalweachter", person.last_name);
+  }
+  CHECK_EQUAL(100, expected);
+  remove_dump(path);
+}
+
+
+TEST(Dump_split_covers_everything_once) {
+  std::string path = "TestDump_split.bson";
+  write_people(path, 1000, 10);
+  Mapper<TestPerson> mapper = test_person_mapper();
+  DumpReader dump(path);
+
+  std::vector<DumpRange> ranges = dump.split(7);
+  CHECK_EQUAL(7u, ranges.size());
+  std::vector<int> ages;
+  TestPerson person;
+  for (size_t k = 0; k < ranges.size(); ++k) {
+    while (ranges[k].next(person, mapper)) ages.push_back(person.age);
+  }
+  CHECK_EQUAL(1000u, ages.size());
+  for (int age = 0; age < 1000; ++age) CHECK_EQUAL(age, ages[age]);
+
+  SumAges sum;
+  dump.parallel_for_each(mapper, sum, 4);
+  CHECK_EQUAL(1000, sum.count);
+  CHECK_EQUAL(999 * 1000 / 2, sum.sum);
+  remove_dump(path);
+}
+
+
+TEST(Dump_without_index) {
+  std::string path = "TestDump_without_index.bson";
+  write_people(path, 50, 4);
+  std::remove((path + ".idx").c_str());
+
+  DumpReader dump(path);
+  CHECK_EQUAL(50u, dump.documents());
+  CHECK(dump.split(3).size() > 1);
+  remove_dump(path);
+}
+
+
+TEST(Dump_stale_index) {
+  std::string path = "TestDump_stale_index.bson";
+  std::string stale = "TestDump_stale_index.old.idx";
+  write_people(path, 40, 4);
+  std::rename((path + ".idx").c_str(), stale.c_str());
+
+  // The same number of documents, each a byte longer, so the old offsets
+  // land inside documents.
+  Mapper<TestPerson> mapper = test_person_mapper();
+  {
+    DumpWriter dump(path, 4);
+    for (int age = 0; age < 40; ++age) {
+      TestPerson person = { "Someone", "Saalweachter", age };
+      dump.write(person, mapper);
+    }
+    dump.close();
+  }
+  std::rename(stale.c_str(), (path + ".idx").c_str());
+
+  DumpReader dump(path);
+  CHECK_EQUAL(40u, dump.documents());
+  std::vector<DumpRange> ranges = dump.split(5);
+  int expected = 0;
+  TestPerson person;
+  for (size_t k = 0; k < ranges.size(); ++k) {
+    for (; ranges[k].next(person, mapper); ++expected) CHECK_EQUAL(expected, person.age);
+  }
+  CHECK_EQUAL(40, expected);
+  remove_dump(path);
+}
+
+
+TEST(Dump_index_matches_its_dump) {
+  std::string path = "TestDump_index_matches.bson";
+  write_people(path, 40, 4);
+
+  // Rewriting the dump drops the old index straight away.
+  {
+    DumpWriter dump(path, 4);
+    CHECK(std::fopen((path + ".idx").c_str(), "rb") == 0);
+  }
+
+  // A dump that grew after its index was written is scanned instead.
+  write_people(path, 40, 4);
+  mongo::BSONObj extra = BSON("first_name" << "Person" << "last_name" << "Saalweachter"
+			      << "age" << 40);
+  std::FILE *file = std::fopen(path.c_str(), "ab");
+  CHECK(file != 0);
+  CHECK_EQUAL(1u, std::fwrite(extra.objdata(), extra.objsize(), 1, file));
+  std::fclose(file);
+
+  DumpReader dump(path);
+  CHECK_EQUAL(41u, dump.documents());
+  remove_dump(path);
+}
+
+
+TEST(Dump_truncated) {
+  std::string path = "TestDump_truncated.bson";
+  write_people(path, 3, 1);
+  std::remove((path + ".idx").c_str());
+  CHECK(truncate(path.c_str(), 40) == 0);
+
+  CHECK_THROW(DumpReader dump(path), dump_error);
+  remove_dump(path);
+}
+
+
+TEST(Dump_query_result) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  for (int age = 0; age < 10; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    session.inserter("test.person", &mapper).insert(person);
+  }
+
+  std::string path = "TestDump_query_result.bson";
+  {
+    DumpWriter dump(path);
+    CHECK_EQUAL(10u, dump.write(session.query("test.person", &mapper).result()));
+  }
+  DumpReader dump(path);
+  SumAges sum;
+  dump.for_each(mapper, sum);
+  CHECK_EQUAL(10, sum.count);
+  CHECK_EQUAL(45, sum.sum);
+  remove_dump(path);
+}
@@ -0,0 +1,137 @@
+/* TestFakeServer.cc
+   Test the in-process fake server, end to end through a Session.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+
+TEST(FakeServer_insert_and_query) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  TestPerson jack = { "Jack", "Saalweachter", 28 };
+  session.inserter("test.person", &mapper).insert(jack);
+
+  TestPerson person = session.query("test.person", &mapper).first();
+  CHECK_EQUAL("Jack", person.first_name);
+  CHECK_EQUAL(28, person.age);
+  CHECK_EQUAL(1u, server.documents("test.person").size());
+}
+
+
+TEST(FakeServer_filters_and_sorts) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  Inserter<TestPerson> inserter = session.inserter("test.person", &mapper);
+  for (int age = 0; age < 10; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    inserter.insert(person);
+  }
+
+  std::vector<TestPerson> people = session.query("test.person", &mapper)
+    .filter(mapper[&TestPerson::age] >= 3)
+    .filter(mapper[&TestPerson::age] < 7)
+    .descending(&TestPerson::age).all();
+  CHECK_EQUAL(4u, people.size());
+  CHECK_EQUAL(6, people.front().age);
+  CHECK_EQUAL(3, people.back().age);
+}
+
+
+TEST(FakeServer_get_more) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  for (int age = 0; age < 250; ++age) {
+    server.insert("test.person", BSON("first_name" << "P" << "last_name" << "Q"
+				      << "age" << age));
+  }
+
+  unsigned long long before = server.requests();
+  std::vector<TestPerson> people = session.query("test.person", &mapper).all();
+  CHECK_EQUAL(250u, people.size());
+  CHECK_EQUAL(249, people.back().age);
+  CHECK(server.requests() - before >= 2);
+}
+
+
+TEST(FakeServer_update_and_upsert) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  TestPerson jack = { "Jack", "Saalweachter", 28 };
+  session.inserter("test.person", &mapper).insert(jack);
+
+  session.query("test.person", &mapper)
+    .filter(mapper[&TestPerson::first_name] == "Jack")
+    .update(mapper[&TestPerson::age] += 2);
+  CHECK_EQUAL(30, session.query("test.person", &mapper).first().age);
+
+  session.execute_upsert("test.person", mongo::Query(BSON("first_name" << "John")),
+			 BSON("$set" << BSON("age" << 40)));
+  // The upsert is unacknowledged; the count waits behind it.
+  CHECK_EQUAL(2ULL, session.count("test.person", mongo::BSONObj()));
+  std::vector<mongo::BSONObj> documents = server.documents("test.person");
+  CHECK_EQUAL(2u, documents.size());
+  CHECK_EQUAL("John", documents[1]["first_name"].str());
+  CHECK_EQUAL(40, documents[1]["age"].numberInt());
+}
+
+
+TEST(FakeServer_remove) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  Inserter<TestPerson> inserter = session.inserter("test.person", &mapper);
+  TestPerson jack = { "Jack", "Saalweachter", 28 };
+  TestPerson john = { "John", "Saalweachter", 30 };
+  inserter.insert(jack);
+  inserter.insert(john);
+
+  session.query("test.person", &mapper)
+    .filter(mapper[&TestPerson::first_name] == "Jack").remove_all();
+  std::vector<TestPerson> people = session.query("test.person", &mapper).all();
+  CHECK_EQUAL(1u, people.size());
+  CHECK_EQUAL("John", people[0].first_name);
+}
+
+
+TEST(FakeServer_count) {
+  FakeServer server;
+  mongo::ScopedDbConnection connection(server.host());
+
+  for (int i = 0; i < 5; ++i) server.insert("test.thing", BSON("i" << i));
+
+  CHECK_EQUAL(5u, connection->count("test.thing"));
+  CHECK_EQUAL(3u, connection->count("test.thing", BSON("i" << BSON("$gt" << 1))));
+  connection.done();
+}
+
+
+TEST(FakeServer_latency) {
+  FakeServer server(20000);
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  unsigned long long start = now_micros();
+  session.query("test.person", &mapper).all();
+  CHECK(now_micros() - start >= 20000);
+}
@@ -0,0 +1,73 @@
+/* TestIdentityMap.cc
+   Test that the identity map hands back one instance per document.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct PersonIM {
+  std::string first_name;
+  std::string last_name;
+  int id;
+};
+
+
+TEST(IdentityMap_shared_instances) {
+  Session session("localhost");
+
+  Table<PersonIM> table("test.identity_map_shared");
+  table.add_field("_id", &PersonIM::id);
+  table.add_field("first_name", &PersonIM::first_name);
+  table.add_field("last_name", &PersonIM::last_name);
+
+  session.query(table).remove_all();
+  Inserter<PersonIM> inserter = session.inserter(table);
+  PersonIM person1 = { "Jack", "Saalweachter", 1 };
+  inserter.insert(person1);
+  PersonIM person2 = { "John", "Saalweachter", 2 };
+  inserter.insert(person2);
+
+  IdentityMap<PersonIM> map(&session, table);
+
+  std::vector<std::tr1::shared_ptr<PersonIM> > all = map.all(session.query(table).ascending(&PersonIM::id));
+  CHECK_EQUAL(2U, all.size());
+  CHECK_EQUAL(2U, map.size());
+
+  std::tr1::shared_ptr<PersonIM> jack = map.first(session.query(table).filter(table[&PersonIM::first_name] == "Jack"));
+  CHECK(jack.get() == all[0].get());
+  CHECK(map.get(2).get() == all[1].get());
+  CHECK(not map.get(3));
+}
+
+
+TEST(IdentityMap_commit) {
+  Session session("localhost");
+
+  Table<PersonIM> table("test.identity_map_commit");
+  table.add_field("_id", &PersonIM::id);
+  table.add_field("first_name", &PersonIM::first_name);
+  table.add_field("last_name", &PersonIM::last_name);
+
+  session.query(table).remove_all();
+  PersonIM person = { "Jack", "Saalweachter", 1 };
+  session.inserter(table).insert(person);
+
+  IdentityMap<PersonIM> map(&session, table);
+  std::tr1::shared_ptr<PersonIM> jack = map.get(1);
+  jack->first_name = "Sal";
+  map.mark_dirty(jack);
+  map.mark_dirty(jack);
+  CHECK_EQUAL(1U, map.dirty());
+
+  map.commit();
+  CHECK_EQUAL(0U, map.dirty());
+  CHECK_EQUAL("Sal", session.query(table).filter(table[&PersonIM::id] == 1).one().first_name);
+}
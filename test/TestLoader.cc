@@ -0,0 +1,92 @@
+/* TestLoader.cc
+   Test that the Loader batches up lookups and hands back the right documents.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <boost/thread.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct PersonL {
+  std::string first_name;
+  std::string last_name;
+  int id;
+};
+
+
+static Table<PersonL> loader_table(std::string const& collection) {
+  Table<PersonL> table(collection);
+  table.add_field("_id", &PersonL::id);
+  table.add_field("first_name", &PersonL::first_name);
+  table.add_field("last_name", &PersonL::last_name);
+  return table;
+}
+
+
+TEST(Loader_load) {
+  Session session("localhost");
+  Table<PersonL> table = loader_table("test.loader_load");
+
+  session.query(table).remove_all();
+  Inserter<PersonL> inserter = session.inserter(table);
+  PersonL person1 = { "Jack", "Saalweachter", 1 };
+  inserter.insert(person1);
+  PersonL person2 = { "John", "Saalweachter", 2 };
+  inserter.insert(person2);
+
+  Session loader_session("localhost");
+  Loader<PersonL, int> loader(&loader_session, table, &PersonL::id);
+
+  CHECK_EQUAL("Jack", loader.load(1).first_name);
+  CHECK_EQUAL("John", loader.load(2).first_name);
+  CHECK_THROW(loader.load(3), query_error);
+
+  PersonL person3;
+  CHECK(not loader.load(3, person3));
+}
+
+
+struct LoadInto {
+  LoadInto(Loader<PersonL, int> *loader, int id, std::string *name)
+    : m_loader(loader), m_id(id), m_name(name) { }
+  void operator()() { *m_name = m_loader->load(m_id).first_name; }
+
+  Loader<PersonL, int> *m_loader;
+  int m_id;
+  std::string *m_name;
+};
+
+
+TEST(Loader_concurrent) {
+  Session session("localhost");
+  Table<PersonL> table = loader_table("test.loader_concurrent");
+
+  session.query(table).remove_all();
+  Inserter<PersonL> inserter = session.inserter(table);
+  PersonL person1 = { "Jack", "Saalweachter", 1 };
+  inserter.insert(person1);
+  PersonL person2 = { "John", "Saalweachter", 2 };
+  inserter.insert(person2);
+
+  Session loader_session("localhost");
+  Loader<PersonL, int> loader(&loader_session, table, &PersonL::id, 4, 20);
+
+  std::vector<std::string> names(8);
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < names.size(); ++i) {
+    threads.create_thread(LoadInto(&loader, 1 + i % 2, &names[i]));
+  }
+  threads.join_all();
+
+  for (unsigned int i = 0; i < names.size(); ++i) {
+    CHECK_EQUAL(i % 2 == 0 ? "Jack" : "John", names[i]);
+  }
+}
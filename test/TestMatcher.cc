@@ -0,0 +1,136 @@
+/* TestMatcher.cc
+   Test that filters evaluate on the client the way the server would.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct PersonM {
+  std::string first_name;
+  std::string last_name;
+  int age;
+  double weight;
+};
+
+
+TEST(Matcher_empty) {
+  Matcher matcher;
+  CHECK(matcher.matches(BSON("a" << 1)));
+  CHECK(matcher.matches(mongo::BSONObj()));
+}
+
+
+TEST(Matcher_equality) {
+  Mapper<PersonM> mapper;
+  mapper.add_field("first_name", &PersonM::first_name);
+  mapper.add_field("last_name", &PersonM::last_name);
+  mapper.add_field("age", &PersonM::age);
+  mapper.add_field("weight", &PersonM::weight);
+  PersonM jack = { "Jack", "Saalweachter", 28, 210.5 };
+  PersonM john = { "John", "Saalweachter", 30, 180.0 };
+
+  Matcher matcher(mapper[&PersonM::first_name] == "Jack");
+  CHECK(matcher.matches(jack, mapper));
+  CHECK(not matcher.matches(john, mapper));
+}
+
+
+TEST(Matcher_comparisons) {
+  Mapper<PersonM> mapper;
+  mapper.add_field("first_name", &PersonM::first_name);
+  mapper.add_field("last_name", &PersonM::last_name);
+  mapper.add_field("age", &PersonM::age);
+  mapper.add_field("weight", &PersonM::weight);
+  PersonM jack = { "Jack", "Saalweachter", 28, 210.5 };
+
+  CHECK(Matcher(mapper[&PersonM::age] < 29).matches(jack, mapper));
+  CHECK(not Matcher(mapper[&PersonM::age] < 28).matches(jack, mapper));
+  CHECK(Matcher(mapper[&PersonM::age] <= 28).matches(jack, mapper));
+  CHECK(Matcher(mapper[&PersonM::age] > 27).matches(jack, mapper));
+  CHECK(not Matcher(mapper[&PersonM::age] > 28).matches(jack, mapper));
+  CHECK(Matcher(mapper[&PersonM::age] >= 28).matches(jack, mapper));
+  CHECK(Matcher(mapper[&PersonM::age] != 30).matches(jack, mapper));
+  CHECK(not Matcher(mapper[&PersonM::age] != 28).matches(jack, mapper));
+  CHECK(Matcher(mapper[&PersonM::weight] > 200.0).matches(jack, mapper));
+}
+
+
+TEST(Matcher_combined) {
+  Mapper<PersonM> mapper;
+  mapper.add_field("first_name", &PersonM::first_name);
+  mapper.add_field("last_name", &PersonM::last_name);
+  mapper.add_field("age", &PersonM::age);
+  mapper.add_field("weight", &PersonM::weight);
+  PersonM jack = { "Jack", "Saalweachter", 28, 210.5 };
+
+  CHECK(Matcher((mapper[&PersonM::age] > 20, mapper[&PersonM::age] < 30)).matches(jack, mapper));
+  CHECK(not Matcher((mapper[&PersonM::age] > 20, mapper[&PersonM::age] < 25)).matches(jack, mapper));
+  CHECK(Matcher((mapper[&PersonM::first_name] == "Jack",
+		 mapper[&PersonM::weight] >= 210.5)).matches(jack, mapper));
+}
+
+
+TEST(Matcher_in) {
+  Mapper<PersonM> mapper;
+  mapper.add_field("first_name", &PersonM::first_name);
+  mapper.add_field("last_name", &PersonM::last_name);
+  mapper.add_field("age", &PersonM::age);
+  mapper.add_field("weight", &PersonM::weight);
+  PersonM jack = { "Jack", "Saalweachter", 28, 210.5 };
+
+  std::vector<int> few;
+  few.push_back(1);
+  few.push_back(28);
+  CHECK(Matcher(mapper[&PersonM::age].in(few)).matches(jack, mapper));
+  CHECK(not Matcher(mapper[&PersonM::age].not_in(few)).matches(jack, mapper));
+
+  // Long lists are searched sorted.
+  std::vector<int> many;
+  for (int i = 100; i > 0; i -= 3) many.push_back(i);
+  CHECK(Matcher(mapper[&PersonM::age].in(many)).matches(jack, mapper));
+  CHECK(not Matcher(mapper[&PersonM::age].not_in(many)).matches(jack, mapper));
+  many.push_back(0);
+  PersonM baby = { "Baby", "Saalweachter", 0, 8.0 };
+  CHECK(Matcher(mapper[&PersonM::age].in(many)).matches(baby, mapper));
+  PersonM two = { "Two", "Saalweachter", 2, 30.0 };
+  CHECK(not Matcher(mapper[&PersonM::age].in(many)).matches(two, mapper));
+}
+
+
+TEST(Matcher_server_rules) {
+  mongo::BSONObj document = BSON("a" << 5 << "b" << BSON("c" << 1)
+				 << "tags" << BSON_ARRAY("x" << "y"));
+  CHECK(Matcher(BSON("a" << 5.0)).matches(document));
+  CHECK(Matcher(BSON("b.c" << 1)).matches(document));
+  CHECK(Matcher(BSON("tags" << "y")).matches(document));
+  CHECK(Matcher(BSON("missing" << BSON("$exists" << false))).matches(document));
+  CHECK(not Matcher(BSON("a" << BSON("$gt" << "5"))).matches(document));
+  CHECK(Matcher(BSON("$or" << BSON_ARRAY(BSON("a" << 1) << BSON("a" << 5)))).matches(document));
+  CHECK(not Matcher(BSON("$nor" << BSON_ARRAY(BSON("a" << 5)))).matches(document));
+  CHECK_THROW(Matcher(BSON("a" << BSON("$where" << "true"))), std::invalid_argument);
+}
+
+
+TEST(Matcher_select) {
+  Mapper<PersonM> mapper;
+  mapper.add_field("first_name", &PersonM::first_name);
+  mapper.add_field("last_name", &PersonM::last_name);
+  mapper.add_field("age", &PersonM::age);
+  mapper.add_field("weight", &PersonM::weight);
+  std::vector<PersonM> people;
+  for (int age = 0; age < 10; ++age) {
+    PersonM person = { "Person", "Saalweachter", age, 100.0 };
+    people.push_back(person);
+  }
+  std::vector<PersonM> selected = Matcher(mapper[&PersonM::age] >= 7).select(people, mapper);
+  CHECK_EQUAL(3u, selected.size());
+  CHECK_EQUAL(7, selected[0].age);
+}
@@ -0,0 +1,182 @@
+/* TestMemoryCollection.cc
+   Test the in-memory collection backend.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <boost/thread/thread.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+static std::vector<mongo::BSONObj> people(int n) {
+  std::vector<mongo::BSONObj> documents;
+  for (int age = 0; age < n; ++age) {
+    documents.push_back(BSON("first_name" << "Person" << "last_name" << (age % 2 ? "Odd" : "Even")
+			     << "age" << age));
+  }
+  return documents;
+}
+
+static std::vector<int> ages(MemoryCursor &cursor) {
+  std::vector<int> res;
+  for (mongo::BSONObj obj; cursor.next(obj); res.push_back(obj["age"].numberInt()));
+  return res;
+}
+
+
+TEST(MemoryCollection_scan) {
+  MemoryCollection memory("test.person");
+  memory.load(people(10));
+
+  std::tr1::shared_ptr<MemoryCursor> cursor =
+    memory.find(mongo::Query(BSON("age" << BSON("$gte" << 7))), 0, 0);
+  std::vector<int> found = ages(*cursor);
+  CHECK_EQUAL(3u, found.size());
+  CHECK_EQUAL(7, found[0]);
+  CHECK_EQUAL(1u, memory.stats().scanned_queries);
+  CHECK_EQUAL(10u, memory.stats().documents);
+}
+
+
+TEST(MemoryCollection_hash_index) {
+  MemoryCollection memory("test.person");
+  memory.load(people(10));
+  memory.add_hash_index("last_name");
+
+  std::tr1::shared_ptr<MemoryCursor> cursor =
+    memory.find(mongo::Query(BSON("last_name" << "Odd")), 0, 0);
+  CHECK_EQUAL(5u, cursor->size());
+
+  cursor = memory.find(mongo::Query(BSON("last_name" << "Odd" << "age" << 3)), 0, 0);
+  std::vector<int> found = ages(*cursor);
+  CHECK_EQUAL(1u, found.size());
+  CHECK_EQUAL(3, found[0]);
+  CHECK_EQUAL(2u, memory.stats().indexed_queries);
+}
+
+
+TEST(MemoryCollection_numbers_hash_alike) {
+  MemoryCollection memory("test.person");
+  memory.add_hash_index("age");
+  memory.load(people(10));
+
+  std::tr1::shared_ptr<MemoryCursor> cursor =
+    memory.find(mongo::Query(BSON("age" << 4.0)), 0, 0);
+  CHECK_EQUAL(1u, cursor->size());
+  cursor = memory.find(mongo::Query(BSON("age" << BSON("$in" << BSON_ARRAY(1 << 2LL << 30)))), 0, 0);
+  CHECK_EQUAL(2u, cursor->size());
+}
+
+
+TEST(MemoryCollection_ordered_index) {
+  MemoryCollection memory("test.person");
+  memory.add_ordered_index("age");
+  memory.load(people(10));
+
+  std::tr1::shared_ptr<MemoryCursor> cursor =
+    memory.find(mongo::Query(BSON("age" << BSON("$gt" << 2 << "$lte" << 5))), 0, 0);
+  CHECK_EQUAL(3u, cursor->size());
+
+  cursor = memory.find(mongo::Query().sort("age", -1), 3, 1);
+  std::vector<int> found = ages(*cursor);
+  CHECK_EQUAL(3u, found.size());
+  CHECK_EQUAL(8, found[0]);
+  CHECK_EQUAL(6, found[2]);
+}
+
+
+TEST(MemoryCollection_sort_without_index) {
+  MemoryCollection memory("test.person");
+  memory.load(people(6));
+
+  std::tr1::shared_ptr<MemoryCursor> cursor =
+    memory.find(mongo::Query().sort(BSON("last_name" << 1 << "age" << -1)), 0, 0);
+  std::vector<int> found = ages(*cursor);
+  CHECK_EQUAL(6u, found.size());
+  CHECK_EQUAL(4, found[0]);
+  CHECK_EQUAL(0, found[2]);
+  CHECK_EQUAL(5, found[3]);
+}
+
+
+TEST(MemoryCollection_cursor_outlives_reload) {
+  MemoryCollection memory("test.person");
+  memory.load(people(4));
+  std::tr1::shared_ptr<MemoryCursor> cursor = memory.find(mongo::Query(), 0, 0);
+  memory.load(people(0));
+
+  CHECK_EQUAL(4u, ages(*cursor).size());
+  CHECK_EQUAL(0u, memory.find(mongo::Query(), 0, 0)->size());
+}
+
+
+TEST(MemoryCollection_routed_session) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  Inserter<TestPerson> inserter = session.inserter("test.person", &mapper);
+  for (int age = 0; age < 10; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    inserter.insert(person);
+  }
+
+  std::tr1::shared_ptr<MemoryCollection> memory(new MemoryCollection("test.person"));
+  memory->add_ordered_index(mapper, &TestPerson::age);
+  session.route_to_memory(memory);
+  session.refresh("test.person");
+  unsigned long long requests = server.requests();
+
+  std::vector<TestPerson> found = session.query("test.person", &mapper)
+    .filter(mapper[&TestPerson::age] >= 5)
+    .descending(&TestPerson::age)
+    .limit(2)
+    .all();
+  CHECK_EQUAL(2u, found.size());
+  CHECK_EQUAL(9, found[0].age);
+  CHECK_EQUAL(8, found[1].age);
+  CHECK_EQUAL(requests, server.requests());
+
+  session.unroute("test.person");
+  CHECK_EQUAL(10u, session.query("test.person", &mapper).all().size());
+  CHECK(server.requests() > requests);
+}
+
+
+// Waits a while for the background refresher to finish n loads.
+static unsigned long long refreshes_after(MemoryCollection const& memory, unsigned long long n) {
+  for (int k = 0; k < 1000 and memory.stats().refreshes < n; ++k) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+  return memory.stats().refreshes;
+}
+
+
+TEST(MemoryCollection_refresh_only_when_stale) {
+  FakeServer server;
+  std::vector<mongo::BSONObj> documents = people(3);
+  for (size_t k = 0; k < documents.size(); ++k) server.insert("test.person", documents[k]);
+
+  MemoryCollection memory("test.person");
+  memory.start_refresh(server.host(), 0);
+  CHECK_EQUAL(1ULL, refreshes_after(memory, 1));
+  CHECK_EQUAL(3u, memory.stats().documents);
+
+  // No interval, so nothing reloads until the copy is marked stale.
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  CHECK_EQUAL(1ULL, memory.stats().refreshes);
+  server.insert("test.person", people(4)[3]);
+  memory.mark_stale();
+  CHECK_EQUAL(2ULL, refreshes_after(memory, 2));
+  CHECK_EQUAL(4u, memory.stats().documents);
+}
@@ -0,0 +1,67 @@
+/* TestObserver.cc
+   Test that observers hear about every operation.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct PersonO {
+  std::string first_name;
+  std::string last_name;
+};
+
+
+class RecordingObserver : public Observer {
+public:
+  RecordingObserver() : m_started(0) { }
+
+  void started(OperationInfo const& info) { ++m_started; }
+  void finished(OperationInfo const& info) {
+    m_operations.push_back(info.operation);
+    m_collections.push_back(*info.collection);
+    m_documents.push_back(info.documents);
+  }
+
+  int m_started;
+  std::vector<std::string> m_operations;
+  std::vector<std::string> m_collections;
+  std::vector<size_t> m_documents;
+};
+
+
+TEST(Observer_operations) {
+  Session session("localhost");
+
+  Table<PersonO> table("test.observer_operations");
+  table.add_field("first_name", &PersonO::first_name);
+  table.add_field("last_name", &PersonO::last_name);
+
+  RecordingObserver observer;
+  session.add_observer(&observer);
+
+  session.query(table).remove_all();
+  PersonO person = { "Jack", "Saalweachter" };
+  session.inserter(table).insert(person);
+  session.query(table).all();
+  session.query(table).update(table[&PersonO::first_name] = "Sal");
+
+  session.remove_observer(&observer);
+  session.query(table).remove_all();
+
+  CHECK_EQUAL(4, observer.m_started);
+  CHECK_EQUAL(4U, observer.m_operations.size());
+  CHECK_EQUAL("remove", observer.m_operations[0]);
+  CHECK_EQUAL("insert", observer.m_operations[1]);
+  CHECK_EQUAL("query", observer.m_operations[2]);
+  CHECK_EQUAL("update", observer.m_operations[3]);
+  CHECK_EQUAL("test.observer_operations", observer.m_collections[2]);
+  CHECK_EQUAL(1U, observer.m_documents[2]);
+}
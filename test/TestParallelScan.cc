@@ -0,0 +1,170 @@
+/* TestParallelScan.cc
+   Test range-partitioned parallel scans.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+static void insert_people(Session &session, Mapper<TestPerson> const& mapper, int n) {
+  Inserter<TestPerson> inserter = session.inserter("test.person", &mapper);
+  for (int age = 0; age < n; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    inserter.insert(person);
+  }
+}
+
+struct CollectAges {
+  void operator()(TestPerson const& person) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    ages.push_back(person.age);
+  }
+  boost::mutex mutex;
+  std::vector<int> ages;
+};
+
+
+TEST(ParallelScan_queue) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  insert_people(session, mapper, 200);
+
+  std::tr1::shared_ptr<ParallelScan<TestPerson> > scan =
+    session.query("test.person", &mapper).parallel_scan(4, "age");
+  CHECK_EQUAL(4u, scan->ranges().size());
+
+  std::vector<int> ages;
+  for (TestPerson person; scan->next(person); ages.push_back(person.age));
+  std::sort(ages.begin(), ages.end());
+  CHECK_EQUAL(200u, ages.size());
+  for (int age = 0; age < 200; ++age) CHECK_EQUAL(age, ages[age]);
+}
+
+
+TEST(ParallelScan_callback_with_filter) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  insert_people(session, mapper, 100);
+
+  CollectAges collect;
+  size_t delivered = session.query("test.person", &mapper)
+    .filter(mapper[&TestPerson::age] >= 50)
+    .parallel_scan(3, "age")->run(collect);
+  CHECK_EQUAL(50u, delivered);
+  std::sort(collect.ages.begin(), collect.ages.end());
+  CHECK_EQUAL(50, collect.ages.front());
+  CHECK_EQUAL(99, collect.ages.back());
+}
+
+
+TEST(ParallelScan_single_range) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  insert_people(session, mapper, 10);
+
+  std::tr1::shared_ptr<ParallelScan<TestPerson> > scan =
+    session.query("test.person", &mapper).parallel_scan(1, "age");
+  CHECK_EQUAL(1u, scan->ranges().size());
+  int n = 0;
+  for (TestPerson person; scan->next(person); ++n);
+  CHECK_EQUAL(10, n);
+}
+
+
+TEST(ParallelScan_cancel) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  insert_people(session, mapper, 500);
+
+  std::tr1::shared_ptr<ParallelScan<TestPerson> > scan =
+    session.query("test.person", &mapper).parallel_scan(4, "age");
+  TestPerson person;
+  CHECK(scan->next(person));
+  scan->cancel();
+  CHECK(not scan->next(person));
+}
+
+
+static mongo::BSONObj person_with(mongo::BSONObj const& extra, int age) {
+  mongo::BSONObjBuilder person;
+  person.appendElements(extra);
+  person.append("first_name", "Person");
+  person.append("last_name", "Saalweachter");
+  person.append("age", age);
+  return person.obj();
+}
+
+
+TEST(ParallelScan_mixed_types) {
+  FakeServer server;
+  for (int k = 0; k < 60; ++k) server.insert("test.person", person_with(BSON("_id" << k), k));
+  for (int k = 0; k < 20; ++k) {
+    server.insert("test.person", person_with(BSON("_id" << std::string(1, char('a' + k))), 60 + k));
+  }
+  for (int k = 0; k < 10; ++k) server.insert("test.person", person_with(mongo::BSONObj(), 80 + k));
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  // The split points land on numbers and a string; only the numbers split,
+  // and the first range takes the strings and ObjectIds.
+  std::tr1::shared_ptr<ParallelScan<TestPerson> > scan =
+    session.query("test.person", &mapper).parallel_scan(4);
+  CHECK_EQUAL(3u, scan->ranges().size());
+  std::vector<int> ages;
+  for (TestPerson person; scan->next(person); ages.push_back(person.age));
+  std::sort(ages.begin(), ages.end());
+  CHECK_EQUAL(90u, ages.size());
+  for (int age = 0; age < 90; ++age) CHECK_EQUAL(age, ages[age]);
+}
+
+
+TEST(ParallelScan_missing_field) {
+  FakeServer server;
+  for (int k = 0; k < 60; ++k) {
+    server.insert("test.person", person_with(k % 2 ? BSON("rank" << k) : mongo::BSONObj(), k));
+  }
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  CollectAges collect;
+  CHECK_EQUAL(60u, session.query("test.person", &mapper).parallel_scan(4, "rank")->run(collect));
+  CollectAges adults;
+  CHECK_EQUAL(42u, session.query("test.person", &mapper).filter(mapper[&TestPerson::age] >= 18)
+	      .parallel_scan(4, "rank")->run(adults));
+}
+
+
+TEST(ParallelScan_filter_on_split_field) {
+  FakeServer server;
+  for (int age = 0; age < 60; ++age) {
+    server.insert("test.person", person_with(mongo::BSONObj(), age));
+  }
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  CollectAges collect;
+  CHECK_EQUAL(1u, session.query("test.person", &mapper).filter(mapper[&TestPerson::age] == 30)
+	      .parallel_scan(4, "age")->run(collect));
+  CollectAges between;
+  CHECK_EQUAL(20u, session.query("test.person", &mapper)
+	      .filter(mapper[&TestPerson::age] >= 20).filter(mapper[&TestPerson::age] < 40)
+	      .parallel_scan(4, "age")->run(between));
+}
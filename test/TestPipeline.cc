@@ -0,0 +1,179 @@
+/* TestPipeline.cc
+   Test pipelined queries and writes.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include "Fixtures.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+// Reads the rest of the first batch, and one past it.
+static void read_past_first_batch(QueryResult<TestPerson> const& result) {
+  TestPerson person;
+  for (int k = 0; k < 101; ++k) result.next(person);
+}
+
+
+TEST(Pipeline_queries_and_writes) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  Pipeline pipeline = session.pipeline();
+  for (int age = 0; age < 10; ++age) {
+    TestPerson person = { "Person", "Saalweachter", age };
+    pipeline.insert("test.person", &mapper, person);
+  }
+  Query<TestPerson> young = session.query("test.person", &mapper).filter(mapper[&TestPerson::age] < 3);
+  Query<TestPerson> old = session.query("test.person", &mapper)
+    .filter(mapper[&TestPerson::age] >= 3).descending(&TestPerson::age).limit(2);
+  pipeline.add(young)
+    .add(session.query("test.person", &mapper), Update("$set", BSON("last_name" << "Smith")))
+    .add(old);
+  CHECK_EQUAL(2u, pipeline.size());
+  pipeline.execute();
+
+  std::vector<TestPerson> found = pipeline.result(0, young).all();
+  CHECK_EQUAL(3u, found.size());
+  CHECK_EQUAL("Saalweachter", found[0].last_name);
+
+  found = pipeline.result(1, old).all();
+  CHECK_EQUAL(2u, found.size());
+  CHECK_EQUAL(9, found[0].age);
+  CHECK_EQUAL(8, found[1].age);
+}
+
+
+TEST(Pipeline_misuse) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  Pipeline pipeline = session.pipeline();
+  pipeline.add(session.query("test.person", &mapper));
+  CHECK_THROW(pipeline.result(0, &mapper), std::logic_error);
+  pipeline.execute();
+  CHECK_EQUAL(0u, pipeline.result(0, &mapper).all().size());
+  CHECK_THROW(pipeline.result(1, &mapper), std::out_of_range);
+  CHECK_THROW(pipeline.execute(), std::logic_error);
+}
+
+
+// Keyed by age, so a second person of the same age is a duplicate.
+static Mapper<TestPerson> keyed_person_mapper() {
+  Mapper<TestPerson> mapper;
+  mapper.add_field("_id", &TestPerson::age);
+  mapper.add_field("first_name", &TestPerson::first_name);
+  return mapper;
+}
+
+
+TEST(Pipeline_batched_writes) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = keyed_person_mapper();
+  session.write_concern("test.person", WriteConcern::batched());
+
+  Pipeline pipeline = session.pipeline();
+  Query<TestPerson> all = session.query("test.person", &mapper);
+  TestPerson jack = { "Jack", "", 30 }, jill = { "Jill", "", 30 }, joe = { "Joe", "", 40 };
+  pipeline.insert("test.person", &mapper, jack).add(all)
+    .insert("test.person", &mapper, jill)
+    .add(all, Update("$set", BSON("first_name" << "Jim")))
+    .insert("test.person", &mapper, joe).add(all);
+  try {
+    pipeline.execute();
+    CHECK(false);
+  } catch (write_error const& e) {
+    // Reported by position among everything added, after every reply.
+    CHECK_EQUAL(1u, e.errors().size());
+    CHECK_EQUAL(2u, e.errors()[0].index);
+    CHECK_EQUAL(11000, e.errors()[0].code);
+    CHECK_EQUAL("Jill", e.errors()[0].document["first_name"].str());
+  }
+  CHECK_EQUAL(1u, pipeline.result(0, all).all().size());
+  std::vector<TestPerson> found = pipeline.result(1, all).all();
+  CHECK_EQUAL(2u, found.size());
+  CHECK_EQUAL("Jim", found[0].first_name);
+
+  // The connection is still in step.
+  CHECK_EQUAL(2ULL, session.count("test.person", mongo::BSONObj()));
+}
+
+
+TEST(Pipeline_sends_held_writes_first) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = keyed_person_mapper();
+  session.write_concern("test.person", WriteConcern::every(10));
+  session.insert("test.person", BSON("_id" << 1 << "first_name" << "held"));
+  session.insert("test.person", BSON("_id" << 2 << "first_name" << "held"));
+
+  Query<TestPerson> all = session.query("test.person", &mapper);
+  TestPerson jack = { "Jack", "", 30 };
+  Pipeline pipeline = session.pipeline();
+  pipeline.add(all).insert("test.person", &mapper, jack).add(all)
+    .find_and_modify(all.filter(mapper[&TestPerson::age] == 30), Update("$set", BSON("first_name" << "Jim")));
+  pipeline.execute();
+  CHECK_EQUAL(2u, pipeline.result(0, all).all().size());
+  CHECK_EQUAL(3u, pipeline.result(1, all).all().size());
+  TestPerson modified;
+  CHECK(pipeline.modified(2, &mapper, modified));
+  CHECK_EQUAL(30, modified.age);
+  CHECK_EQUAL(3ULL, session.count("test.person", mongo::BSONObj()));
+}
+
+
+TEST(Pipeline_reads_every_reply_after_a_failure) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+  TestPerson jack = { "Jack", "Saalweachter", 30 };
+  session.inserter("test.person", &mapper).insert(jack);
+
+  Query<TestPerson> all = session.query("test.person", &mapper);
+  Pipeline pipeline = session.pipeline();
+  pipeline.find_and_modify("test.person", BSON("age" << BSON("$bogus" << 1)), mongo::BSONObj(),
+			   BSON("$set" << BSON("age" << 31)))
+    .add(all).add(all);
+  CHECK_THROW(pipeline.execute(), query_error);
+
+  // The replies to the later queries were read, not left for these.
+  CHECK_EQUAL(1u, pipeline.result(1, all).all().size());
+  CHECK_EQUAL(1ULL, session.count("test.person", mongo::BSONObj()));
+  CHECK_EQUAL(1u, session.query("test.person", &mapper).all().size());
+}
+
+
+TEST(Pipeline_keeps_deadlines_and_tokens) {
+  FakeServer server(20000);
+  for (int age = 0; age < 300; ++age) {
+    server.insert("test.person", BSON("first_name" << "Person" << "last_name" << "Saalweachter"
+				      << "age" << age));
+  }
+  Session session(server.host());
+  Mapper<TestPerson> mapper = test_person_mapper();
+
+  CancellationToken token;
+  Query<TestPerson> late = session.query("test.person", &mapper).deadline(5);
+  Query<TestPerson> cancelled = session.query("test.person", &mapper).cancel_with(token);
+  Pipeline pipeline = session.pipeline();
+  pipeline.add(late).add(cancelled);
+  pipeline.execute();
+
+  CHECK_THROW(pipeline.result(0, late).all(), timeout_error);
+  QueryResult<TestPerson> result = pipeline.result(1, cancelled);
+  TestPerson person;
+  CHECK(result.next(person));
+  token.cancel();
+  CHECK_THROW(read_past_first_batch(result), cancelled_error);
+}
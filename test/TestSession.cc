@@ -308,3 +308,30 @@ TEST(Session_query_insert_overwrite) {
 
 }
 
+
+
+TEST(Session_query_upsert_all) {
+  Session session("localhost");
+
+  Table<PersonID> table("test.person_query_upsert_all");
+  table.add_field("_id", &PersonID::id);
+  table.add_field("first_name", &PersonID::first_name);
+  table.add_field("last_name", &PersonID::last_name);
+
+  session.query(table).remove_all();
+
+  std::vector<PersonID> people;
+  for (int i = 0; i < 2500; ++i) {
+    PersonID person = { "John", "Saalweachter", i };
+    people.push_back(person);
+  }
+
+  Inserter<PersonID> inserter = session.inserter(table);
+  inserter.upsert_all(people);
+  CHECK_EQUAL(2500U, session.query(table).all().size());
+
+  people[42].first_name = "Sal";
+  inserter.upsert_all(people, false);
+  CHECK_EQUAL(2500U, session.query(table).all().size());
+  CHECK_EQUAL("Sal", session.query(table).filter(table[&PersonID::id] == 42).one().first_name);
+}
@@ -0,0 +1,54 @@
+/* TestShardedCounter.cc
+   Test that a sharded counter adds up across its shards.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <boost/thread.hpp>
+
+using namespace mongoxx;
+
+
+TEST(ShardedCounter_increment) {
+  Session session("localhost");
+
+  ShardedCounter counter(&session, "test.sharded_counter", "increment", 8,
+			 ShardedCounter::random);
+  counter.reset();
+  CHECK_EQUAL(0LL, counter.value());
+
+  for (int i = 0; i < 100; ++i) {
+    counter.increment();
+  }
+  counter.increment(-10);
+
+  CHECK_EQUAL(90LL, counter.value());
+}
+
+
+struct CountUp {
+  CountUp(unsigned int times) : m_times(times) { }
+  void operator()() {
+    Session session("localhost");
+    ShardedCounter counter(&session, "test.sharded_counter", "threads", 4);
+    for (unsigned int i = 0; i < m_times; ++i) counter.increment();
+  }
+  unsigned int m_times;
+};
+
+
+TEST(ShardedCounter_threads) {
+  Session session("localhost");
+
+  ShardedCounter counter(&session, "test.sharded_counter", "threads", 4);
+  counter.reset();
+
+  boost::thread_group threads;
+  for (int i = 0; i < 4; ++i) threads.create_thread(CountUp(50));
+  threads.join_all();
+
+  CHECK_EQUAL(200LL, counter.value());
+}
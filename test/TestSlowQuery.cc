@@ -0,0 +1,61 @@
+/* TestSlowQuery.cc
+   Test query shapes and the slow query log.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <sstream>
+#include <string>
+
+using namespace mongoxx;
+
+
+struct PersonSQ {
+  std::string first_name;
+  std::string last_name;
+  int age;
+};
+
+
+TEST(SlowQueryLog_shape) {
+  Mapper<PersonSQ> mapper;
+  mapper.add_field("first_name", &PersonSQ::first_name);
+  mapper.add_field("last_name", &PersonSQ::last_name);
+  mapper.add_field("age", &PersonSQ::age);
+
+  mongo::Query jack((mapper[&PersonSQ::first_name] == "Jack",
+		     mapper[&PersonSQ::age] > 25).to_bson());
+  mongo::Query john((mapper[&PersonSQ::first_name] == "John",
+		     mapper[&PersonSQ::age] > 30).to_bson());
+
+  CHECK_EQUAL(SlowQueryLog::shape(jack, 0, 0), SlowQueryLog::shape(john, 0, 0));
+  CHECK_EQUAL("{ \"filter\" : { \"age\" : { \"$gt\" : 1 }, \"first_name\" : 1 } }",
+	      SlowQueryLog::shape(jack, 0, 0));
+
+  jack.sort("age", -1);
+  CHECK_EQUAL("{ \"filter\" : { \"age\" : { \"$gt\" : 1 }, \"first_name\" : 1 }, \"sort\" : { \"age\" : -1 }, \"limit\" : 10 }",
+	      SlowQueryLog::shape(jack, 10, 0));
+}
+
+
+TEST(SlowQueryLog_logs) {
+  Session session("localhost");
+
+  Table<PersonSQ> table("test.slow_query_logs");
+  table.add_field("first_name", &PersonSQ::first_name);
+  table.add_field("last_name", &PersonSQ::last_name);
+  table.add_field("age", &PersonSQ::age);
+
+  std::ostringstream out;
+  SlowQueryLog slow(0, out);
+  session.add_observer(&slow);
+
+  session.query(table).filter(table[&PersonSQ::age] > 25).all();
+  session.remove_observer(&slow);
+
+  CHECK(out.str().find("test.slow_query_logs") != std::string::npos);
+  CHECK(out.str().find("\"$gt\" : 1") != std::string::npos);
+}
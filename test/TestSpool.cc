@@ -0,0 +1,166 @@
+/* TestSpool.cc
+   Test the local write spool and the inserter that spills into it.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct EventS {
+  int n;
+  std::string what;
+};
+
+
+TEST(Spool_survives_reopening) {
+  std::string path = "TestSpool.spool";
+  std::remove(path.c_str());
+  {
+    Spool spool(path, 4096);
+    for (int n = 0; n < 500; ++n) spool.append(BSON("n" << n << "pad" << std::string(20, 'x')));
+    CHECK_EQUAL(500u, spool.size());
+    std::vector<mongo::BSONObj> batch;
+    CHECK_EQUAL(2u, spool.read(batch, 2));
+    CHECK_EQUAL(0, batch[0]["n"].numberInt());
+    spool.consume(1);
+  }
+  {
+    Spool spool(path);
+    CHECK_EQUAL(499u, spool.size());
+    std::vector<mongo::BSONObj> batch;
+    spool.read(batch, 1000);
+    CHECK_EQUAL(499u, batch.size());
+    CHECK_EQUAL(1, batch.front()["n"].numberInt());
+    CHECK_EQUAL(499, batch.back()["n"].numberInt());
+    spool.consume(499);
+    CHECK(spool.empty());
+    CHECK_EQUAL(0u, spool.bytes());
+    spool.append(BSON("n" << 1000));
+  }
+  {
+    Spool spool(path);
+    std::vector<mongo::BSONObj> batch;
+    CHECK_EQUAL(1u, spool.read(batch, 10));
+    CHECK_EQUAL(1000, batch[0]["n"].numberInt());
+  }
+  std::remove(path.c_str());
+}
+
+
+// Overwrites part of a file, as a crash between writebacks might leave it.
+static void scribble(std::string const& path, long offset, std::string const& bytes) {
+  FILE *file = std::fopen(path.c_str(), "r+b");
+  std::fseek(file, offset, SEEK_SET);
+  std::fwrite(bytes.data(), 1, bytes.size(), file);
+  std::fclose(file);
+}
+
+
+TEST(Spool_ends_at_a_torn_record) {
+  std::string path = "TestSpoolTorn.spool";
+  std::remove(path.c_str());
+  mongo::BSONObj first = BSON("n" << 0 << "pad" << std::string(20, 'x'));
+  mongo::BSONObj second = BSON("n" << 1 << "pad" << std::string(20, 'y'));
+  {
+    Spool spool(path, 4096);
+    spool.append(first);
+    spool.append(second);
+    spool.append(BSON("n" << 2));
+  }
+  // The second record's length made it to disk but its body didn't; the
+  // mapping past the tail is zeroes, so it still ends in a zero byte.
+  long body = 16 + first.objsize() + 8 + 4;
+  scribble(path, body, std::string(second.objsize() - 4, '\0'));
+  {
+    Spool spool(path);
+    CHECK_EQUAL(1u, spool.size());
+    std::vector<mongo::BSONObj> batch;
+    spool.read(batch, 10);
+    CHECK_EQUAL(0, batch[0]["n"].numberInt());
+    spool.append(BSON("n" << 3));
+  }
+  {
+    // The torn record and what followed it were written over.
+    Spool spool(path);
+    std::vector<mongo::BSONObj> batch;
+    CHECK_EQUAL(2u, spool.read(batch, 10));
+    CHECK_EQUAL(3, batch[1]["n"].numberInt());
+  }
+  std::remove(path.c_str());
+}
+
+
+TEST(SpoolingInserter_spills_when_the_server_is_slow) {
+  std::string path = "TestSpoolSlow.spool";
+  std::remove(path.c_str());
+  FakeServer server;
+  server.set_latency(20000);
+  Session session(server.host());
+  Mapper<EventS> mapper;
+  mapper.add_field("n", &EventS::n);
+  mapper.add_field("what", &EventS::what);
+  {
+    std::tr1::shared_ptr<SpoolingInserter<EventS> > events =
+      session.inserter("test.event", &mapper).spooling(path, 5);
+    for (int n = 0; n < 50; ++n) {
+      EventS event = { n, "happened" };
+      events->insert(event);
+    }
+    CHECK(events->stats().spooled > 0);
+    CHECK(events->flush(10000));
+    CHECK_EQUAL(0u, events->backlog());
+    CHECK_EQUAL(50ULL, events->stats().sent);
+  }
+  std::vector<mongo::BSONObj> found = server.documents("test.event");
+  CHECK_EQUAL(50u, found.size());
+  for (size_t k = 0; k < found.size(); ++k) CHECK_EQUAL(int(k), found[k]["n"].numberInt());
+  std::remove(path.c_str());
+}
+
+
+TEST(SpoolingInserter_replays_a_spool_left_behind) {
+  std::string path = "TestSpoolReplay.spool";
+  std::remove(path.c_str());
+  FakeServer server;
+  Mapper<EventS> mapper;
+  mapper.add_field("n", &EventS::n);
+  mapper.add_field("what", &EventS::what);
+  {
+    // Nobody is listening; everything stays queued, and stop() spools it.
+    FakeServer gone;
+    std::string host = gone.host();
+    gone.stop();
+    SpoolingInserter<EventS> events(host, "test.event", &mapper, path, 1000, 100, 10);
+    for (int n = 0; n < 3; ++n) {
+      EventS event = { n, "waiting" };
+      events.insert(event);
+    }
+    events.stop();
+    CHECK_EQUAL(3u, events.backlog());
+    CHECK_THROW(events.insert(EventS()), std::logic_error);
+  }
+  {
+    Spool spool(path);
+    CHECK_EQUAL(3u, spool.size());
+    std::vector<mongo::BSONObj> batch;
+    spool.read(batch, 1);
+    // A document that made it before the crash is not a failure.
+    server.insert("test.event", batch[0]);
+  }
+  SpoolingInserter<EventS> events(server.host(), "test.event", &mapper, path);
+  CHECK(events.flush(5000));
+  CHECK_EQUAL(3ULL, events.stats().sent);
+  CHECK_EQUAL(0ULL, events.stats().failed);
+  CHECK_EQUAL(3u, server.documents("test.event").size());
+  events.stop();
+  std::remove(path.c_str());
+}
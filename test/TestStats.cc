@@ -0,0 +1,101 @@
+/* TestStats.cc
+   Test the latency histograms and the Session statistics built on them.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+
+#include <string>
+
+using namespace mongoxx;
+
+
+TEST(Histogram_empty) {
+  Histogram histogram;
+  CHECK_EQUAL(0U, histogram.count());
+  CHECK_EQUAL(0U, histogram.percentile(50));
+}
+
+
+TEST(Histogram_small_values_exact) {
+  Histogram histogram;
+  for (unsigned long long i = 1; i <= 20; ++i) histogram.record(i);
+
+  CHECK_EQUAL(20U, histogram.count());
+  CHECK_EQUAL(1U, histogram.min());
+  CHECK_EQUAL(20U, histogram.max());
+  CHECK_EQUAL(10U, histogram.percentile(50));
+  CHECK_EQUAL(20U, histogram.percentile(100));
+  CHECK_CLOSE(10.5, histogram.mean(), 0.001);
+}
+
+
+TEST(Histogram_large_values_close) {
+  Histogram histogram;
+  for (unsigned long long i = 1; i <= 100000; ++i) histogram.record(i);
+
+  CHECK_CLOSE(50000.0, double(histogram.percentile(50)), 50000.0 * 0.07);
+  CHECK_CLOSE(99000.0, double(histogram.percentile(99)), 99000.0 * 0.07);
+  CHECK_EQUAL(100000U, histogram.percentile(100));
+}
+
+
+TEST(Histogram_merge) {
+  Histogram a;
+  Histogram b;
+  a.record(5);
+  b.record(7);
+  b.record(1000);
+  a.merge(b);
+
+  CHECK_EQUAL(3U, a.count());
+  CHECK_EQUAL(5U, a.min());
+  CHECK_EQUAL(1000U, a.max());
+}
+
+
+struct PersonS {
+  std::string first_name;
+  std::string last_name;
+};
+
+
+TEST(Session_stats_off) {
+  Session session("localhost");
+  CHECK(session.recorder() == 0);
+  CHECK(session.stats().operations().empty());
+}
+
+
+TEST(Session_stats) {
+  Session session("localhost");
+
+  Table<PersonS> table("test.session_stats");
+  table.add_field("first_name", &PersonS::first_name);
+  table.add_field("last_name", &PersonS::last_name);
+
+  session.query(table).remove_all();
+  session.enable_stats();
+
+  Inserter<PersonS> inserter = session.inserter(table);
+  PersonS person1 = { "Jack", "Saalweachter" };
+  PersonS person2 = { "John", "Saalweachter" };
+  inserter.insert(person1).insert(person2);
+
+  CHECK_EQUAL(2U, session.query(table).all().size());
+
+  SessionStats stats = session.stats();
+  CHECK_EQUAL(2U, stats.operation("test.session_stats", "insert").latency.count());
+  CHECK_EQUAL(2U, stats.operation("test.session_stats", "insert").documents);
+  CHECK(stats.operation("test.session_stats", "insert").bytes_sent > 0);
+  CHECK_EQUAL(2U, stats.operation("test.session_stats", "encode").latency.count());
+  CHECK_EQUAL(1U, stats.operation("test.session_stats", "query").latency.count());
+  CHECK_EQUAL(2U, stats.operation("test.session_stats", "query").documents);
+  CHECK_EQUAL(2U, stats.operation("test.session_stats", "decode").latency.count());
+  CHECK_EQUAL(2U, stats.total("insert").documents);
+
+  session.reset_stats();
+  CHECK(session.stats().operations().empty());
+}
@@ -0,0 +1,118 @@
+/* TestTail.cc
+   Test following a collection with a tail.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct Event {
+  int sequence;
+  std::string kind;
+};
+
+static void insert_events(FakeServer &server, int begin, int end) {
+  for (int k = begin; k < end; ++k) {
+    server.insert("test.events", BSON("_id" << k << "kind" << (k % 2 ? "odd" : "even")));
+  }
+}
+
+struct CollectEvents {
+  void operator()(Event const& event) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    sequences.push_back(event.sequence);
+  }
+  size_t size() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return sequences.size();
+  }
+  boost::mutex mutex;
+  std::vector<int> sequences;
+};
+
+
+TEST(Tail_follows_inserts) {
+  FakeServer server;
+  insert_events(server, 0, 5);
+  Session session(server.host());
+  Mapper<Event> mapper;
+  mapper.add_field("_id", &Event::sequence);
+  mapper.add_field("kind", &Event::kind);
+
+  std::tr1::shared_ptr<Tail<Event> > tail = session.query("test.events", &mapper).tail();
+  Event event;
+  for (int k = 0; k < 5; ++k) {
+    CHECK(tail->next(event));
+    CHECK_EQUAL(k, event.sequence);
+  }
+  insert_events(server, 5, 8);
+  for (int k = 5; k < 8; ++k) {
+    CHECK(tail->next(event));
+    CHECK_EQUAL(k, event.sequence);
+  }
+  CHECK_EQUAL(7, tail->last()["_id"].numberInt());
+  tail->stop();
+  CHECK(not tail->next(event));
+}
+
+
+TEST(Tail_streams_without_requerying) {
+  FakeServer server;
+  insert_events(server, 0, 3);
+  Session session(server.host());
+  Mapper<Event> mapper;
+  mapper.add_field("_id", &Event::sequence);
+  mapper.add_field("kind", &Event::kind);
+
+  std::tr1::shared_ptr<Tail<Event> > tail = session.query("test.events", &mapper).tail();
+  Event event;
+  for (int k = 0; k < 3; ++k) CHECK(tail->next(event));
+  for (int k = 3; k < 8; ++k) {
+    // Longer than the retry interval, so a dead cursor would be requeried.
+    boost::this_thread::sleep(boost::posix_time::milliseconds(150));
+    insert_events(server, k, k + 1);
+    CHECK(tail->next(event));
+    CHECK_EQUAL(k, event.sequence);
+  }
+  CHECK_EQUAL(0ULL, tail->stats().requeries);
+  CHECK_EQUAL(1u, server.open_cursors());
+  tail->stop();
+}
+
+
+TEST(Tail_resumes_with_filter_and_callback) {
+  FakeServer server;
+  insert_events(server, 0, 10);
+  Session session(server.host());
+  Mapper<Event> mapper;
+  mapper.add_field("_id", &Event::sequence);
+  mapper.add_field("kind", &Event::kind);
+
+  CollectEvents collect;
+  std::tr1::shared_ptr<Tail<Event> > tail = session.query("test.events", &mapper)
+    .filter(mapper[&Event::kind] == std::string("odd"))
+    .tail(BSON("_id" << 4));
+  tail->start(collect);
+  insert_events(server, 10, 12);
+  for (int wait = 0; wait < 100 and collect.size() < 4; ++wait) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+  }
+  tail->stop();
+
+  CHECK_EQUAL(4u, collect.sequences.size());
+  CHECK_EQUAL(5, collect.sequences[0]);
+  CHECK_EQUAL(11, collect.sequences[3]);
+  CHECK_EQUAL(4u, tail->stats().delivered);
+}
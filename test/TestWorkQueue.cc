@@ -0,0 +1,173 @@
+/* TestWorkQueue.cc
+   Test findAndModify and the work queue built on it.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include <boost/thread/thread.hpp>
+
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct JobW {
+  std::string name;
+  int priority;
+};
+
+static void insert_jobs(FakeServer &server, int n) {
+  for (int priority = 0; priority < n; ++priority) {
+    server.insert("test.jobs", BSON("name" << "job" << "priority" << priority));
+  }
+}
+
+
+TEST(FindAndModify_returns_old_or_new) {
+  FakeServer server;
+  insert_jobs(server, 3);
+  Session session(server.host());
+  Mapper<JobW> mapper;
+  mapper.add_field("name", &JobW::name);
+  mapper.add_field("priority", &JobW::priority);
+  Query<JobW> jobs = session.query("test.jobs", &mapper);
+
+  JobW job = jobs.descending(&JobW::priority)
+    .find_and_modify(Update("$set", BSON("name" << "taken")));
+  CHECK_EQUAL("job", job.name);
+  CHECK_EQUAL(2, job.priority);
+
+  ModifyOptions options;
+  options.return_new = true;
+  job = jobs.ascending(&JobW::priority).find_and_modify(Update("$set", BSON("name" << "taken")), options);
+  CHECK_EQUAL("taken", job.name);
+  CHECK_EQUAL(0, job.priority);
+
+  CHECK_EQUAL(2u, jobs.filter(mapper[&JobW::name] == "taken").all().size());
+  CHECK_THROW(jobs.filter(mapper[&JobW::priority] > 10)
+	      .find_and_modify(Update("$set", BSON("name" << "none"))), query_error);
+}
+
+
+TEST(FindAndModify_upsert_and_remove) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<JobW> mapper;
+  mapper.add_field("name", &JobW::name);
+  mapper.add_field("priority", &JobW::priority);
+  Query<JobW> jobs = session.query("test.jobs", &mapper);
+
+  ModifyOptions options;
+  options.upsert = true;
+  options.return_new = true;
+  JobW job;
+  CHECK(jobs.filter(mapper[&JobW::name] == "new")
+	.find_and_modify(Update("$set", BSON("priority" << 7)), job, options));
+  CHECK_EQUAL("new", job.name);
+  CHECK_EQUAL(7, job.priority);
+
+  CHECK(jobs.find_and_remove(job));
+  CHECK_EQUAL(7, job.priority);
+  CHECK(not jobs.find_and_remove(job));
+  CHECK_EQUAL(0u, server.documents("test.jobs").size());
+}
+
+
+TEST(WorkQueue_claim_ack_retry) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<JobW> mapper;
+  mapper.add_field("name", &JobW::name);
+  mapper.add_field("priority", &JobW::priority);
+  WorkQueue<JobW> queue(&session, "test.jobs", &mapper);
+
+  JobW first = { "first", 1 }, second = { "second", 2 };
+  queue.push(first);
+  queue.push(second);
+  CHECK_EQUAL(2u, queue.ready());
+
+  WorkQueue<JobW>::Claim claim;
+  CHECK(queue.claim(claim));
+  CHECK_EQUAL("first", claim.job.name);
+  CHECK_EQUAL(1, claim.attempts);
+  CHECK_EQUAL(1u, queue.ready());
+  CHECK(queue.ack(claim));
+  CHECK(not queue.ack(claim));
+
+  CHECK(queue.claim(claim));
+  CHECK_EQUAL("second", claim.job.name);
+  CHECK(not queue.claim(claim));
+  CHECK(queue.retry(claim));
+  CHECK(queue.claim(claim));
+  CHECK_EQUAL("second", claim.job.name);
+  CHECK_EQUAL(2, claim.attempts);
+  CHECK(queue.ack(claim));
+  CHECK_EQUAL(0u, server.documents("test.jobs").size());
+}
+
+
+TEST(WorkQueue_lease_expiry_and_dead_jobs) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<JobW> mapper;
+  mapper.add_field("name", &JobW::name);
+  mapper.add_field("priority", &JobW::priority);
+  WorkQueue<JobW> queue(&session, "test.jobs", &mapper, 20, 2);
+
+  JobW job = { "flaky", 1 };
+  queue.push(job);
+  WorkQueue<JobW>::Claim lost, again;
+  CHECK(queue.claim(lost));
+  CHECK(not queue.claim(again));
+
+  // The first worker's lease runs out; another picks the job up.
+  boost::this_thread::sleep(boost::posix_time::milliseconds(40));
+  CHECK(queue.claim(again));
+  CHECK_EQUAL(2, again.attempts);
+  CHECK(not queue.ack(lost));
+  CHECK(not queue.extend(lost, 1000));
+  CHECK(queue.extend(again, 1000));
+
+  // Out of attempts, it stays put but is never claimed.
+  CHECK(queue.retry(again));
+  CHECK(not queue.claim(again));
+  CHECK_EQUAL(0u, queue.ready());
+  CHECK_EQUAL(1u, queue.dead());
+}
+
+
+TEST(WorkQueue_batched_claims_are_disjoint) {
+  FakeServer server;
+  Session session(server.host());
+  Mapper<JobW> mapper;
+  mapper.add_field("name", &JobW::name);
+  mapper.add_field("priority", &JobW::priority);
+  WorkQueue<JobW> queue(&session, "test.jobs", &mapper);
+
+  std::vector<JobW> jobs;
+  for (int k = 0; k < 10; ++k) {
+    JobW job = { "batch", k };
+    jobs.push_back(job);
+  }
+  queue.push_all(jobs);
+
+  unsigned long long before = server.requests();
+  std::vector<WorkQueue<JobW>::Claim> claims = queue.claim(4);
+  CHECK_EQUAL(4u, claims.size());
+  // One findAndModify each, all sent before any reply is read.
+  CHECK_EQUAL(4ULL, server.requests() - before);
+
+  std::vector<WorkQueue<JobW>::Claim> rest = queue.claim(20);
+  CHECK_EQUAL(6u, rest.size());
+  std::set<int> seen;
+  for (size_t k = 0; k < claims.size(); ++k) seen.insert(claims[k].job.priority);
+  for (size_t k = 0; k < rest.size(); ++k) seen.insert(rest[k].job.priority);
+  CHECK_EQUAL(10u, seen.size());
+  CHECK_EQUAL(0u, queue.claim(5).size());
+}
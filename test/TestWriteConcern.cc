@@ -0,0 +1,134 @@
+/* TestWriteConcern.cc
+   Test acknowledged writes and the errors they report.
+
+*/
+
+#include "UnitTest++.h"
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include <string>
+#include <vector>
+
+using namespace mongoxx;
+
+
+struct PersonWc {
+  int id;
+  std::string name;
+};
+
+
+TEST(WriteConcern_unacknowledged_by_default) {
+  FakeServer server;
+  Session session(server.host());
+  session.insert("test.person", BSON("_id" << 1));
+  session.insert("test.person", BSON("_id" << 1));
+  CHECK_EQUAL(1ULL, session.count("test.person", mongo::BSONObj()));
+}
+
+
+TEST(WriteConcern_batched_reports_each_write) {
+  FakeServer server;
+  Session session(server.host());
+  session.write_concern("test.person", WriteConcern::batched());
+  session.insert("test.person", BSON("_id" << 1));
+  try {
+    session.insert("test.person", BSON("_id" << 1 << "name" << "again"));
+    CHECK(false);
+  } catch (write_error const& e) {
+    CHECK_EQUAL(1u, e.errors().size());
+    CHECK_EQUAL(0u, e.errors()[0].index);
+    CHECK_EQUAL(11000, e.errors()[0].code);
+    CHECK_EQUAL("again", e.errors()[0].document["name"].str());
+  }
+
+  // Other collections keep the Session's default.
+  session.insert("test.other", BSON("_id" << 1));
+  session.insert("test.other", BSON("_id" << 1));
+
+  session.remove_all("test.person", mongo::Query());
+  CHECK_EQUAL(0u, server.documents("test.person").size());
+}
+
+
+TEST(WriteConcern_every_n_groups_writes) {
+  FakeServer server;
+  Session session(server.host());
+  session.write_concern(WriteConcern::every(3));
+  session.insert("test.person", BSON("_id" << 1));
+  session.insert("test.person", BSON("_id" << 2));
+  CHECK_EQUAL(0u, server.documents("test.person").size());
+  session.insert("test.person", BSON("_id" << 3));
+  CHECK_EQUAL(3u, server.documents("test.person").size());
+
+  session.insert("test.person", BSON("_id" << 1 << "name" << "dup"));
+  session.insert("test.person", BSON("_id" << 4));
+  try {
+    session.insert("test.person", BSON("_id" << 2 << "name" << "dup"));
+    CHECK(false);
+  } catch (write_error const& e) {
+    CHECK_EQUAL(2u, e.errors().size());
+    CHECK_EQUAL(0u, e.errors()[0].index);
+    CHECK_EQUAL(1, e.errors()[0].document["_id"].numberInt());
+    CHECK_EQUAL(2u, e.errors()[1].index);
+    CHECK_EQUAL(2, e.errors()[1].document["_id"].numberInt());
+  }
+  // Unordered, so the good write in between landed.
+  CHECK_EQUAL(4u, server.documents("test.person").size());
+}
+
+
+TEST(WriteConcern_reads_and_flush_send_held_writes) {
+  FakeServer server;
+  Mapper<PersonWc> mapper;
+  mapper.add_field("_id", &PersonWc::id);
+  mapper.add_field("name", &PersonWc::name);
+  {
+    Session session(server.host());
+    session.write_concern("test.person", WriteConcern::every(100));
+    PersonWc a = { 1, "a" }, b = { 2, "b" };
+    session.inserter("test.person", &mapper).insert(a).insert(b);
+    CHECK_EQUAL(0u, server.documents("test.person").size());
+    CHECK_EQUAL(2u, session.query("test.person", &mapper).all().size());
+
+    session.query("test.person", &mapper).filter(mapper[&PersonWc::id] == 1)
+      .update(Update("$set", BSON("name" << "z")));
+    CHECK_EQUAL(std::string("a"), server.documents("test.person")[0]["name"].str());
+    session.flush();
+    CHECK_EQUAL(std::string("z"), server.documents("test.person")[0]["name"].str());
+
+    PersonWc c = { 3, "c" };
+    session.inserter("test.person", &mapper).insert(c);
+  }
+  // The destructor sends what is still held.
+  CHECK_EQUAL(3u, server.documents("test.person").size());
+}
+
+
+TEST(WriteConcern_inserter_numbers_errors_across_chunks) {
+  FakeServer server;
+  server.insert("test.person", BSON("_id" << 1));
+  server.insert("test.person", BSON("_id" << 5));
+  Session session(server.host());
+  Mapper<PersonWc> mapper;
+  mapper.add_field("_id", &PersonWc::id);
+  mapper.add_field("name", &PersonWc::name);
+
+  std::vector<PersonWc> people;
+  for (int k = 0; k < 8; ++k) {
+    PersonWc person = { k, "person" };
+    people.push_back(person);
+  }
+  try {
+    session.inserter("test.person", &mapper).write_concern(WriteConcern::batched())
+      .insert_all(people, false, 3);
+    CHECK(false);
+  } catch (write_error const& e) {
+    CHECK_EQUAL(2u, e.errors().size());
+    CHECK_EQUAL(1u, e.errors()[0].index);
+    CHECK_EQUAL(5u, e.errors()[1].index);
+  }
+  CHECK_EQUAL(8u, server.documents("test.person").size());
+}
@@ -0,0 +1,470 @@
+/* LoadGen.cc
+   A YCSB-style load generator built on Session, Inserter and Query.
+
+   Usage: LoadGen [--host H | --fake] [--records N] [--threads N]
+                  [--read F] [--update F] [--insert F] [--scan F] [--increment F]
+                  [--distribution uniform|zipfian|latest] [--rate OPS]
+                  [--duration SECONDS] [--fields N] [--field-length N]
+   Run with --help for the full list.
+*/
+
+#include "mongoxx/mongoxx.hh"
+#include "mongoxx/fake_server.hh"
+
+#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+using namespace mongoxx;
+namespace po = boost::program_options;
+
+
+struct Record {
+  std::string key;
+  long long counter;
+  std::string field0, field1, field2, field3, field4;
+  std::string field5, field6, field7, field8, field9;
+};
+
+static std::string Record::* const record_fields[] = {
+  &Record::field0, &Record::field1, &Record::field2, &Record::field3, &Record::field4,
+  &Record::field5, &Record::field6, &Record::field7, &Record::field8, &Record::field9
+};
+static unsigned int const max_fields = sizeof(record_fields) / sizeof(record_fields[0]);
+
+
+enum Operation { op_read, op_update, op_insert, op_scan, op_increment, op_count };
+static char const* const operation_names[op_count] = {
+  "read", "update", "insert", "scan", "increment"
+};
+
+
+struct Options {
+  std::string host;
+  std::string collection;
+  bool fake;
+  unsigned int fake_latency_us;
+  unsigned long long records;
+  unsigned int threads;
+  double mix[op_count];
+  std::string distribution;
+  double zipfian_constant;
+  double rate;
+  double duration;
+  unsigned long long operations;
+  unsigned int fields;
+  unsigned int field_length;
+  unsigned int scan_length;
+  bool load;
+  bool json;
+};
+
+
+/**
+ * Picks record numbers.  The zipfian generator is the one from YCSB (Gray
+ * et al., "Quickly Generating Billion-Record Synthetic Databases"), with the
+ * popular items scattered through the key space by hashing.
+ */
+class KeyChooser {
+public:
+  KeyChooser(std::string const& distribution, unsigned long long items, double theta)
+    : m_distribution(distribution), m_items(items ? items : 1), m_theta(theta) {
+    if (m_distribution != "uniform" and m_distribution != "zipfian" and
+	m_distribution != "latest") {
+      throw std::invalid_argument("unknown distribution: " + distribution);
+    }
+    m_zetan = zeta(m_items, m_theta);
+    m_alpha = 1.0 / (1.0 - m_theta);
+    // With two items or fewer the first two branches of zipfian() cover
+    // everything, and eta would divide by zero.
+    m_eta = m_items <= 2 ? 0.0 : (1.0 - std::pow(2.0 / m_items, 1.0 - m_theta)) /
+      (1.0 - zeta(2, m_theta) / m_zetan);
+  }
+
+  /**
+   * Chooses a record.
+   * @param u a uniform random number in [0, 1)
+   * @param inserted how many records exist right now
+   * @return a record number below inserted
+   */
+  unsigned long long next(double u, unsigned long long inserted) const {
+    if (inserted == 0) return 0;
+    if (m_distribution == "uniform") {
+      return static_cast<unsigned long long>(u * inserted) % inserted;
+    }
+    unsigned long long rank = zipfian(u);
+    if (m_distribution == "latest") {
+      return rank < inserted ? inserted - 1 - rank : 0;
+    }
+    return fnv(rank) % inserted;
+  }
+
+private:
+  static double zeta(unsigned long long n, double theta) {
+    double sum = 0.0;
+    for (unsigned long long i = 1; i <= n; ++i) sum += 1.0 / std::pow(double(i), theta);
+    return sum;
+  }
+
+  static unsigned long long fnv(unsigned long long value) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+      hash ^= value & 0xff;
+      hash *= 0x100000001B3ULL;
+      value >>= 8;
+    }
+    return hash;
+  }
+
+  unsigned long long zipfian(double u) const {
+    double uz = u * m_zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + std::pow(0.5, m_theta)) return 1;
+    return static_cast<unsigned long long>(m_items * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+  }
+
+  std::string m_distribution;
+  unsigned long long m_items;
+  double m_theta;
+  double m_zetan;
+  double m_alpha;
+  double m_eta;
+};
+
+
+// State shared by every worker.
+struct Shared {
+  Shared() : inserted(0) { }
+
+  unsigned long long next_insert() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return inserted++;
+  }
+
+  unsigned long long count() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return inserted;
+  }
+
+  boost::mutex mutex;
+  unsigned long long inserted;
+};
+
+
+static std::string record_key(unsigned long long n) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "user%012llu", n);
+  return buffer;
+}
+
+
+class Worker {
+public:
+  Worker(Options const& options, Mapper<Record> const* mapper,
+	 KeyChooser const* chooser, Shared *shared, unsigned int seed)
+    : m_options(options), m_mapper(mapper), m_chooser(chooser), m_shared(shared),
+      m_random(seed), m_latency(op_count), m_errors(op_count, 0) { }
+
+  /**
+   * Inserts records [begin, end).
+   */
+  void load(unsigned long long begin, unsigned long long end) {
+    Session session(m_options.host);
+    Inserter<Record> inserter = session.inserter(m_options.collection, m_mapper);
+    for (unsigned long long n = begin; n < end; ++n) {
+      unsigned long long start = now_micros();
+      try {
+	inserter.insert(make_record(n));
+      } catch (std::exception const&) {
+	++m_errors[op_insert];
+      }
+      m_latency[op_insert].record(now_micros() - start);
+    }
+  }
+
+  /**
+   * Runs the operation mix until the deadline or the operation budget.
+   * @param deadline when to stop, from now_micros()
+   * @param operations how many operations to run; 0 for no limit
+   * @param rate this worker's share of the target rate; 0 for flat out
+   */
+  void run(unsigned long long deadline, unsigned long long operations, double rate) {
+    Session session(m_options.host);
+    Inserter<Record> inserter = session.inserter(m_options.collection, m_mapper);
+    double interval = rate > 0 ? 1e6 / rate : 0;
+    double scheduled = now_micros();
+
+    for (unsigned long long done = 0; operations == 0 or done < operations; ++done) {
+      unsigned long long start = now_micros();
+      if (start >= deadline) break;
+      if (interval > 0) {
+	// Latency counts from when the operation should have started, so a
+	// stall doesn't hide the queueing it causes.
+	if (scheduled > start) {
+	  boost::this_thread::sleep(boost::posix_time::microseconds(
+	    static_cast<long long>(scheduled - start)));
+	}
+	start = static_cast<unsigned long long>(scheduled);
+	scheduled += interval;
+      }
+
+      Operation operation = choose_operation();
+      try {
+	perform(session, inserter, operation);
+      } catch (std::exception const&) {
+	++m_errors[operation];
+      }
+      m_latency[operation].record(now_micros() - start);
+    }
+  }
+
+  std::vector<Histogram> const& latency() const { return m_latency; }
+  std::vector<unsigned long long> const& errors() const { return m_errors; }
+
+private:
+  double uniform() {
+    return boost::uniform_01<boost::mt19937&>(m_random)();
+  }
+
+  Operation choose_operation() {
+    double u = uniform();
+    for (int op = 0; op < op_count; ++op) {
+      if (u < m_options.mix[op]) return Operation(op);
+      u -= m_options.mix[op];
+    }
+    return op_read;
+  }
+
+  std::string random_value() {
+    std::string value(m_options.field_length, ' ');
+    for (std::string::iterator c = value.begin(); c != value.end(); ++c) {
+      *c = 'a' + static_cast<int>(uniform() * 26) % 26;
+    }
+    return value;
+  }
+
+  Record make_record(unsigned long long n) {
+    Record record;
+    record.key = record_key(n);
+    record.counter = 0;
+    for (unsigned int f = 0; f < m_options.fields; ++f) {
+      record.*record_fields[f] = random_value();
+    }
+    return record;
+  }
+
+  void perform(Session &session, Inserter<Record> &inserter, Operation operation) {
+    Mapper<Record> const& mapper = *m_mapper;
+    Query<Record> query = session.query(m_options.collection, m_mapper);
+    std::string key = record_key(m_chooser->next(uniform(), m_shared->count()));
+
+    switch (operation) {
+    case op_read: {
+      Record record;
+      query.filter(mapper[&Record::key] == key).limit(1).result().first(record);
+      break;
+    }
+    case op_update: {
+      unsigned int f = static_cast<unsigned int>(uniform() * m_options.fields) % m_options.fields;
+      query.filter(mapper[&Record::key] == key)
+	.update(mapper[record_fields[f]] = random_value());
+      break;
+    }
+    case op_insert:
+      inserter.insert(make_record(m_shared->next_insert()));
+      break;
+    case op_scan:
+      query.filter(mapper[&Record::key] >= key).ascending(&Record::key)
+	.limit(m_options.scan_length).all();
+      break;
+    case op_increment:
+      query.filter(mapper[&Record::key] == key).update(mapper[&Record::counter] += 1);
+      break;
+    default:
+      break;
+    }
+  }
+
+  Options const& m_options;
+  Mapper<Record> const* m_mapper;
+  KeyChooser const* m_chooser;
+  Shared *m_shared;
+  boost::mt19937 m_random;
+  std::vector<Histogram> m_latency;
+  std::vector<unsigned long long> m_errors;
+};
+
+
+static void report(std::string const& phase, double seconds,
+		   std::vector<std::tr1::shared_ptr<Worker> > const& workers,
+		   bool json) {
+  std::vector<Histogram> latency(op_count);
+  std::vector<unsigned long long> errors(op_count, 0);
+  for (size_t w = 0; w < workers.size(); ++w) {
+    for (int op = 0; op < op_count; ++op) {
+      latency[op].merge(workers[w]->latency()[op]);
+      errors[op] += workers[w]->errors()[op];
+    }
+  }
+
+  if (json) {
+    std::cout << "{\"phase\": \"" << phase << "\", \"seconds\": " << seconds
+	      << ", \"operations\": [";
+  } else {
+    std::printf("%s: %.2fs\n", phase.c_str(), seconds);
+    std::printf("%-10s %10s %10s %8s %8s %8s %8s %8s %8s\n", "operation", "count",
+		"ops/s", "errors", "p50us", "p95us", "p99us", "p999us", "maxus");
+  }
+  bool first = true;
+  for (int op = 0; op < op_count; ++op) {
+    Histogram const& h = latency[op];
+    if (h.count() == 0) continue;
+    double throughput = seconds > 0 ? h.count() / seconds : 0;
+    if (json) {
+      std::cout << (first ? "" : ", ") << "{\"name\": \"" << operation_names[op] << "\""
+		<< ", \"count\": " << h.count() << ", \"ops_per_sec\": " << throughput
+		<< ", \"errors\": " << errors[op]
+		<< ", \"p50_us\": " << h.percentile(50) << ", \"p95_us\": " << h.percentile(95)
+		<< ", \"p99_us\": " << h.percentile(99) << ", \"p999_us\": " << h.percentile(99.9)
+		<< ", \"max_us\": " << h.max() << "}";
+    } else {
+      std::printf("%-10s %10llu %10.0f %8llu %8llu %8llu %8llu %8llu %8llu\n",
+		  operation_names[op], h.count(), throughput,
+		  errors[op], h.percentile(50), h.percentile(95), h.percentile(99),
+		  h.percentile(99.9), h.max());
+    }
+    first = false;
+  }
+  if (json) std::cout << "]}" << std::endl;
+}
+
+
+int main(int argc, char **argv) {
+  Options options;
+  po::options_description description("LoadGen options");
+  description.add_options()
+    ("help", "print this message")
+    ("host", po::value<std::string>(&options.host)->default_value("localhost"), "server to load")
+    ("fake", po::bool_switch(&options.fake), "run against an in-process FakeServer")
+    ("fake-latency-us", po::value<unsigned int>(&options.fake_latency_us)->default_value(0),
+     "latency the FakeServer adds to each request")
+    ("collection", po::value<std::string>(&options.collection)->default_value("loadgen.usertable"),
+     "collection to use")
+    ("records", po::value<unsigned long long>(&options.records)->default_value(10000),
+     "records to load before the run")
+    ("no-load", "skip the load phase; the records are already there")
+    ("threads", po::value<unsigned int>(&options.threads)->default_value(4), "client threads")
+    ("read", po::value<double>(&options.mix[op_read])->default_value(0.95), "fraction of reads")
+    ("update", po::value<double>(&options.mix[op_update])->default_value(0.05), "fraction of updates")
+    ("insert", po::value<double>(&options.mix[op_insert])->default_value(0), "fraction of inserts")
+    ("scan", po::value<double>(&options.mix[op_scan])->default_value(0), "fraction of scans")
+    ("increment", po::value<double>(&options.mix[op_increment])->default_value(0),
+     "fraction of $inc updates")
+    ("distribution", po::value<std::string>(&options.distribution)->default_value("zipfian"),
+     "key distribution: uniform, zipfian or latest")
+    ("zipfian-constant", po::value<double>(&options.zipfian_constant)->default_value(0.99),
+     "skew of the zipfian and latest distributions")
+    ("rate", po::value<double>(&options.rate)->default_value(0), "target ops/s over all threads; 0 for flat out")
+    ("duration", po::value<double>(&options.duration)->default_value(10), "seconds to run")
+    ("operations", po::value<unsigned long long>(&options.operations)->default_value(0),
+     "operations per thread; 0 to run for the duration")
+    ("fields", po::value<unsigned int>(&options.fields)->default_value(10), "string fields per record")
+    ("field-length", po::value<unsigned int>(&options.field_length)->default_value(100),
+     "bytes per field")
+    ("scan-length", po::value<unsigned int>(&options.scan_length)->default_value(100),
+     "records per scan")
+    ("json", po::bool_switch(&options.json), "report as JSON");
+
+  po::variables_map variables;
+  try {
+    po::store(po::parse_command_line(argc, argv, description), variables);
+    po::notify(variables);
+  } catch (std::exception const& e) {
+    std::cerr << e.what() << std::endl << description << std::endl;
+    return 1;
+  }
+  if (variables.count("help")) {
+    std::cout << description << std::endl;
+    return 0;
+  }
+  options.load = not variables.count("no-load");
+  if (options.fields < 1 or options.fields > max_fields) {
+    std::cerr << "--fields must be between 1 and " << max_fields << std::endl;
+    return 1;
+  }
+  if (options.threads < 1) options.threads = 1;
+  double total = 0;
+  for (int op = 0; op < op_count; ++op) total += options.mix[op];
+  if (total <= 0) {
+    std::cerr << "the operation mix is empty" << std::endl;
+    return 1;
+  }
+  for (int op = 0; op < op_count; ++op) options.mix[op] /= total;
+
+  std::tr1::shared_ptr<FakeServer> fake;
+  if (options.fake) {
+    fake.reset(new FakeServer(options.fake_latency_us));
+    options.host = fake->host();
+  }
+
+  Mapper<Record> mapper;
+  mapper.add_field("key", &Record::key);
+  mapper.add_field("counter", &Record::counter);
+  for (unsigned int f = 0; f < options.fields; ++f) {
+    std::ostringstream name;
+    name << "field" << f;
+    mapper.add_field(name.str(), record_fields[f]);
+  }
+
+  try {
+    KeyChooser chooser(options.distribution, options.records, options.zipfian_constant);
+    Shared shared;
+
+    if (options.load) {
+      std::vector<std::tr1::shared_ptr<Worker> > loaders;
+      boost::thread_group threads;
+      unsigned long long start = now_micros();
+      for (unsigned int t = 0; t < options.threads; ++t) {
+	std::tr1::shared_ptr<Worker> worker(new Worker(options, &mapper, &chooser, &shared, t + 1));
+	loaders.push_back(worker);
+	threads.create_thread(boost::bind(&Worker::load, worker.get(),
+					  options.records * t / options.threads,
+					  options.records * (t + 1) / options.threads));
+      }
+      threads.join_all();
+      report("load", (now_micros() - start) / 1e6, loaders, options.json);
+    }
+    shared.inserted = options.records;
+
+    std::vector<std::tr1::shared_ptr<Worker> > workers;
+    boost::thread_group threads;
+    unsigned long long start = now_micros();
+    unsigned long long deadline = start + static_cast<unsigned long long>(options.duration * 1e6);
+    for (unsigned int t = 0; t < options.threads; ++t) {
+      std::tr1::shared_ptr<Worker> worker(new Worker(options, &mapper, &chooser, &shared,
+						     1000 + t));
+      workers.push_back(worker);
+      threads.create_thread(boost::bind(&Worker::run, worker.get(), deadline,
+					options.operations, options.rate / options.threads));
+    }
+    threads.join_all();
+    report("run", (now_micros() - start) / 1e6, workers, options.json);
+  } catch (std::exception const& e) {
+    std::cerr << "LoadGen: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}